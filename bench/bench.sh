@@ -0,0 +1,127 @@
+#!/bin/sh
+#
+# bench.sh - throughput benchmark for wafreport
+#
+# Generates synthetic scores with wafgen, then times wafreport reading them
+# through each of its ingest paths, and times whole runs reporting on a
+# snapshot, which skip parsing altogether: process startup, decoding the
+# snapshot, the statistics and the rendering. The statistics and rendering
+# stages are also timed on their own, as measured by --profile in those
+# runs. Each case is run BENCH_RUNS times and the fastest run is kept.
+#
+# The results are written to stdout as tab-separated values: comment lines
+# starting with "#" describe the run, then a header line, then one line per
+# case with its name, the lines and bytes it read, the seconds it took, and
+# its throughput in lines and megabytes (10^6 bytes) per second. Cases which
+# parse no lines only have the seconds. E.g.
+#   make bench > bench-$(git describe --always).tsv
+#
+# Settings come from the environment:
+#   BENCH_LINES  number of lines to generate (default 2000000)
+#   BENCH_RUNS   runs of each case (default 3)
+#   WAFREPORT    the wafreport binary (default ./wafreport)
+#   WAFGEN       the wafgen binary (default bench/wafgen)
+
+set -e
+
+BENCH_LINES=${BENCH_LINES:-2000000}
+BENCH_RUNS=${BENCH_RUNS:-3}
+WAFREPORT=${WAFREPORT:-./wafreport}
+WAFGEN=${WAFGEN:-bench/wafgen}
+
+dir=$(mktemp -d "${TMPDIR:-/tmp}/wafbench.XXXXXX")
+trap 'rm -rf "$dir"' EXIT INT TERM
+
+# now: Prints the time in nanoseconds
+now() {
+	date +%s%N
+}
+
+# run NAME LINES INPUT COMMAND...: Runs COMMAND with stdin from INPUT and
+# stdout thrown away BENCH_RUNS times, and prints the result line for the
+# fastest run. INPUT is the data the case reads, whether from stdin or as a
+# FILE argument, and its size is the number of bytes read. A LINES of "-"
+# marks a case parsing no lines, whose other columns are left empty
+run() {
+	name=$1 lines=$2 input=$3
+	shift 3
+	bytes=$(wc -c < "$input")
+	best=
+	i=0
+	while [ "$i" -lt "$BENCH_RUNS" ]; do
+		start=$(now)
+		"$@" < "$input" > /dev/null
+		end=$(now)
+		ns=$((end - start))
+		if [ -z "$best" ] || [ "$ns" -lt "$best" ]; then
+			best=$ns
+		fi
+		i=$((i + 1))
+	done
+	awk -v name="$name" -v lines="$lines" -v bytes="$bytes" -v ns="$best" \
+	    'BEGIN {
+		s = ns / 1e9
+		if (lines == "-") {
+			printf "%s\t\t\t%.6f\t\t\n", name, s
+			exit
+		}
+		if (s <= 0)
+			s = 1e-9
+		printf "%s\t%d\t%d\t%.6f\t%.0f\t%.2f\n", name, lines, bytes,
+		       s, lines / s, bytes / s / 1e6
+	    }'
+}
+
+# run_phases NAME INPUT COMMAND...: Runs COMMAND with --profile and stdin
+# from INPUT BENCH_RUNS times, and prints the result lines NAME-stats and
+# NAME-render with the fastest time --profile gave for each of those phases
+run_phases() {
+	name=$1 input=$2
+	shift 2
+	best_stats= best_render=
+	i=0
+	while [ "$i" -lt "$BENCH_RUNS" ]; do
+		times=$("$@" --profile < "$input" 2>&1 > /dev/null |
+		        awk '$1 == "stats" { s = $2 } $1 == "render" { r = $2 }
+		             END { print s, r }')
+		best_stats=$(echo "$times $best_stats" | awk '{
+			print ($3 == "" || $1 < $3) ? $1 : $3 }')
+		best_render=$(echo "$times $best_render" | awk '{
+			print ($3 == "" || $2 < $3) ? $2 : $3 }')
+		i=$((i + 1))
+	done
+	printf '%s-stats\t\t\t%s\t\t\n' "$name" "$best_stats"
+	printf '%s-render\t\t\t%s\t\t\n' "$name" "$best_render"
+}
+
+"$WAFGEN" -F scores -n "$BENCH_LINES" > "$dir/scores.txt"
+"$WAFGEN" -F log -n "$BENCH_LINES" > "$dir/access.log"
+"$WAFGEN" -F json -n "$BENCH_LINES" > "$dir/audit.json"
+gzip -c "$dir/access.log" > "$dir/access.log.gz"
+"$WAFREPORT" -S "$dir/scores.snap" "$dir/scores.txt"
+"$WAFREPORT" -x -S "$dir/scores-x.snap" "$dir/scores.txt"
+
+echo "# wafreport benchmark"
+echo "# version: $(git describe --always --dirty 2>/dev/null || echo unknown)"
+echo "# date: $(date -u +%Y-%m-%dT%H:%M:%SZ)"
+echo "# host: $(uname -srm), $(getconf _NPROCESSORS_ONLN 2>/dev/null || echo '?') CPUs"
+echo "# lines: $BENCH_LINES, runs: $BENCH_RUNS (fastest kept)"
+printf 'case\tlines\tbytes\tseconds\tlines_per_s\tmb_per_s\n'
+
+# Ingest paths: the original fgets reader, the block reader, memory-mapped
+# files on one thread and on all of them, gzip (whose bytes are the
+# compressed ones), and the log formats
+run stdin-fgets "$BENCH_LINES" "$dir/scores.txt" "$WAFREPORT"
+run stdin-block "$BENCH_LINES" "$dir/scores.txt" "$WAFREPORT" -b
+run mmap "$BENCH_LINES" "$dir/scores.txt" "$WAFREPORT" "$dir/scores.txt"
+run mmap-jobs "$BENCH_LINES" "$dir/scores.txt" "$WAFREPORT" -j 0 "$dir/scores.txt"
+run gzip-log "$BENCH_LINES" "$dir/access.log.gz" "$WAFREPORT" -F log "$dir/access.log.gz"
+run log "$BENCH_LINES" "$dir/access.log" "$WAFREPORT" -F log "$dir/access.log"
+run json "$BENCH_LINES" "$dir/audit.json" "$WAFREPORT" -F json "$dir/audit.json"
+
+# Whole runs reporting on the snapshot of the same scores, and with the
+# cross-tabulation and threshold tables, then their stats and render stages
+run report-total - "$dir/scores.snap" "$WAFREPORT" -M -p 50,99,99.9
+run report-xt-total - "$dir/scores-x.snap" "$WAFREPORT" -M -x -T
+run_phases report "$dir/scores.snap" "$WAFREPORT" -M -p 50,99,99.9
+run_phases report-xt "$dir/scores-x.snap" "$WAFREPORT" -M -x -T
@@ -0,0 +1,313 @@
+/*
+ * wafgen - synthetic ModSecurity anomaly score generator for benchmarking
+ * wafreport
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Writes LINES lines of made-up but realistic OWASP CRS anomaly scores to
+ * stdout, in any of the input formats wafreport reads. Most requests match no
+ * rules and score 0. The rest match a few rules, each adding its severity
+ * (critical 5, error 4, warning 3, notice 2), so scores cluster at multiples
+ * of 5 with a long tail from the occasional request matching dozens of
+ * rules. Outbound scores are non-zero far more rarely. A few lines carry no
+ * valid score at all.
+ *
+ * The random numbers come from a fixed generator (xorshift64*), not rand(3),
+ * so the same seed gives the same bytes on every system, and benchmark
+ * results stay comparable between machines and versions.
+ *
+ * Usage:
+ *   ./wafgen [-F scores|log|json] [-n LINES] [-s SEED] > scores.txt
+ *
+ * Options:
+ *   -F, --format FORMAT
+ *                "scores" (the default) for "INBOUND OUTBOUND" lines, "log"
+ *                for Apache combined access log lines ending in the two
+ *                scores, or "json" for one-line JSON audit log records as
+ *                stock ModSecurity writes them
+ *   -n, --lines LINES
+ *                Number of lines to write (default 1000000)
+ *   -s, --seed SEED
+ *                Seed of the random numbers (default 1)
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_LINES 1000000
+#define DEFAULT_SEED 1
+#define CLIENTS 50000
+#define PATHS 2000
+
+enum {
+	FORMAT_SCORES,
+	FORMAT_LOG,
+	FORMAT_JSON
+};
+
+static const char *const methods[] = { "GET", "GET", "GET", "POST", "HEAD" };
+static const char *const statuses[] = { "200", "200", "200", "304", "404" };
+
+uint64_t rng_state;
+
+void usage(const char *prog);
+void rng_seed(uint64_t seed);
+uint64_t rng_next(void);
+unsigned rng_below(unsigned n);
+int crs_score(int rule_pct, int more_pct);
+void write_line(FILE *out, int format, uint64_t n);
+uint64_t parse_count_arg(const char *arg, const char *what);
+
+int main(int argc, char *argv[])
+{
+	uint64_t lines = DEFAULT_LINES, seed = DEFAULT_SEED, n;
+	int format = FORMAT_SCORES, opt;
+
+	static const struct option long_opts[] = {
+		{ "format", required_argument, NULL, 'F' },
+		{ "lines", required_argument, NULL, 'n' },
+		{ "seed", required_argument, NULL, 's' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	while ((opt = getopt_long(argc, argv, "F:hn:s:", long_opts,
+	                          NULL)) != -1) {
+		switch (opt) {
+		case 'F':
+			if (strcmp(optarg, "scores") == 0)
+				format = FORMAT_SCORES;
+			else if (strcmp(optarg, "log") == 0)
+				format = FORMAT_LOG;
+			else if (strcmp(optarg, "json") == 0)
+				format = FORMAT_JSON;
+			else {
+				fprintf(stderr, "wafgen: unknown format: %s\n",
+				        optarg);
+				return 1;
+			}
+			break;
+		case 'n':
+			lines = parse_count_arg(optarg, "number of lines");
+			break;
+		case 's':
+			seed = parse_count_arg(optarg, "seed");
+			break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind < argc) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	rng_seed(seed);
+	for (n = 0; n < lines; n++)
+		write_line(stdout, format, n);
+
+	if (fflush(stdout) != 0 || ferror(stdout)) {
+		perror("wafgen: write");
+		return 1;
+	}
+
+	return 0;
+}
+
+
+/******************************************************************************
+ * usage: Prints a short summary of the command line options to stderr        *
+ ******************************************************************************/
+void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [OPTION]...\n", prog);
+	fprintf(stderr, "Write synthetic CRS anomaly scores to stdout, for benchmarking wafreport.\n\n");
+	fprintf(stderr, "  -F, --format FORMAT\n");
+	fprintf(stderr, "                scores (default), log (access log lines) or json (audit\n");
+	fprintf(stderr, "                log records)\n");
+	fprintf(stderr, "  -n, --lines LINES\n");
+	fprintf(stderr, "                number of lines to write (default %d)\n", DEFAULT_LINES);
+	fprintf(stderr, "  -s, --seed SEED\n");
+	fprintf(stderr, "                seed of the random numbers (default %d)\n", DEFAULT_SEED);
+	fprintf(stderr, "  -h, --help    display this help and exit\n");
+}
+
+
+/******************************************************************************
+ * rng_seed: Starts the generator from the seed given by the argument, mixed  *
+ *           with one step of splitmix64 so that every seed, including the    *
+ *           default, gives a different stream                                *
+ ******************************************************************************/
+void rng_seed(uint64_t seed)
+{
+	uint64_t z = seed + UINT64_C(0x9e3779b97f4a7c15);
+
+	z = (z ^ z >> 30) * UINT64_C(0xbf58476d1ce4e5b9);
+	z = (z ^ z >> 27) * UINT64_C(0x94d049bb133111eb);
+	z ^= z >> 31;
+
+	/* xorshift gets stuck at 0, which only one seed mixes to */
+	rng_state = z != 0 ? z : UINT64_C(0x9e3779b97f4a7c15);
+}
+
+
+/******************************************************************************
+ * rng_next: Returns the next 64-bit number from the xorshift64* generator    *
+ ******************************************************************************/
+uint64_t rng_next(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+
+	return rng_state * UINT64_C(0x2545f4914f6cdd1d);
+}
+
+
+/******************************************************************************
+ * rng_below: Returns a random number from 0 up to but not including the      *
+ *            argument                                                        *
+ ******************************************************************************/
+unsigned rng_below(unsigned n)
+{
+	return (unsigned) ((rng_next() >> 32) * n >> 32);
+}
+
+
+/******************************************************************************
+ * crs_score: Returns a random anomaly score: 0 unless a rule matches, which  *
+ *            happens for the percentage of requests given by the first       *
+ *            argument. Each matching rule adds its severity score, mostly    *
+ *            critical, and after each one another rule matches with the      *
+ *            percentage given by the second argument, which makes for the    *
+ *            long tail                                                       *
+ ******************************************************************************/
+int crs_score(int rule_pct, int more_pct)
+{
+	int score = 0;
+	unsigned r;
+
+	if ((int) rng_below(100) >= rule_pct)
+		return 0;
+
+	do {
+		r = rng_below(100);
+		score += r < 80 ? 5 : r < 90 ? 3 : r < 95 ? 4 : 2;
+	} while ((int) rng_below(100) < more_pct);
+
+	return score;
+}
+
+
+/******************************************************************************
+ * write_line: Writes the line numbered by the third argument, with random    *
+ *             scores, to the stream given by the first argument in the       *
+ *             format given by the second argument. About one line in a       *
+ *             thousand has a missing ("-") inbound score                     *
+ ******************************************************************************/
+void write_line(FILE *out, int format, uint64_t n)
+{
+	unsigned client, path, size;
+	const char *method, *status;
+	int in, out_score, invalid;
+	char in_str[16];
+
+	/* Every random number is drawn here, in a fixed order, since the
+	 * order arguments are evaluated in is up to the compiler */
+	client = rng_below(CLIENTS);
+	path = rng_below(PATHS);
+	in = crs_score(15, 55);
+	out_score = crs_score(2, 30);
+	invalid = rng_below(1000) == 0;
+	method = methods[rng_below(5)];
+	status = statuses[rng_below(5)];
+	size = 200 + rng_below(20000);
+
+	/* Clients and paths are skewed towards a busy few */
+	if (rng_below(4) == 0)
+		client %= 100;
+	if (rng_below(2) == 0)
+		path %= 20;
+
+	if (invalid)
+		strcpy(in_str, "-");
+	else
+		snprintf(in_str, sizeof(in_str), "%d", in);
+
+	switch (format) {
+	case FORMAT_LOG:
+		fprintf(out, "10.%u.%u.%u - - [13/Sep/2020:12:%02u:%02u +0000] "
+		        "\"%s /app/%u?id=%" PRIu64 " HTTP/1.1\" %s %u \"-\" "
+		        "\"Mozilla/5.0 (X11; Linux x86_64)\" %s %d\n",
+		        client >> 16, client >> 8 & 255, client & 255,
+		        (unsigned) (n / 60 % 60), (unsigned) (n % 60),
+		        method, path, n, status, size, in_str, out_score);
+		break;
+	case FORMAT_JSON:
+		/* Stock ModSecurity records, with CRS 4's reporting rule set to
+		 * report every transaction, so each one carries its totals in
+		 * the message of rule 980170 */
+		fprintf(out, "{\"transaction\":{\"client_ip\":\"10.%u.%u.%u\","
+		        "\"time_stamp\":\"Sun Sep 13 12:%02u:%02u 2020\","
+		        "\"request\":{\"method\":\"%s\",\"uri\":\"/app/%u?id=%"
+		        PRIu64 "\",\"headers\":{\"Host\":\"www.example.com\"}},"
+		        "\"response\":{\"http_code\":%s},\"messages\":[{"
+		        "\"message\":\"Anomaly Scores: (Inbound Scores: "
+		        "blocking=%s, detection=%s, per_pl=%s-0-0-0, threshold=5) - "
+		        "(Outbound Scores: blocking=%d, detection=%d, "
+		        "per_pl=%d-0-0-0, threshold=4)\",\"details\":{"
+		        "\"ruleId\":\"980170\",\"data\":\"\",\"severity\":\"0\","
+		        "\"ver\":\"OWASP_CRS/4.1.0\",\"tags\":[\"reporting\","
+		        "\"OWASP_CRS\"]}}]}}\n",
+		        client >> 16, client >> 8 & 255, client & 255,
+		        (unsigned) (n / 60 % 60), (unsigned) (n % 60),
+		        method, path, n, status, in_str, in_str, in_str,
+		        out_score, out_score, out_score);
+		break;
+	default:
+		fprintf(out, "%s %d\n", in_str, out_score);
+		break;
+	}
+}
+
+
+/******************************************************************************
+ * parse_count_arg: Converts the first argument to a non-negative number.     *
+ *                  Exits with an error message naming what it is, given by   *
+ *                  the second argument, if it isn't one                      *
+ ******************************************************************************/
+uint64_t parse_count_arg(const char *arg, const char *what)
+{
+	char *end;
+	unsigned long long n;
+
+	errno = 0;
+	n = strtoull(arg, &end, 10);
+	if (errno != 0 || end == arg || *end != '\0' || arg[0] == '-') {
+		fprintf(stderr, "wafgen: invalid %s: %s\n", what, arg);
+		exit(EXIT_FAILURE);
+	}
+
+	return n;
+}
@@ -0,0 +1,393 @@
+#!/bin/sh
+#
+# check.sh - regression tests for wafreport
+#
+# Runs wafreport on the fixtures in tests/ (NAME.txt, NAME.log, NAME.json or
+# NAME.snap), and on inputs generated here, through each of its readers and
+# with each of its options, and compares the report with an expected one
+# stored in tests/ (NAME.out, or named after the option), or with the report
+# on the same input read another way. Prints one line per failed case and
+# exits non-zero if there was any. E.g.
+#   make check
+#
+# Settings come from the environment:
+#   WAFREPORT        the wafreport binary (default ./wafreport)
+#   WAFREPORT_CHUNK  wafreport built to feed gzip data to zlib in pieces of
+#                    1000 bytes (default tests/wafreport-chunk)
+#   WAFGEN           the benchmark's score generator (default bench/wafgen)
+
+WAFREPORT=${WAFREPORT:-./wafreport}
+WAFREPORT_CHUNK=${WAFREPORT_CHUNK:-tests/wafreport-chunk}
+WAFGEN=${WAFGEN:-bench/wafgen}
+TESTS=$(dirname "$0")
+
+dir=$(mktemp -d "${TMPDIR:-/tmp}/wafcheck.XXXXXX")
+trap 'rm -rf "$dir"' EXIT INT TERM
+
+failed=0
+
+# check NAME EXPECTED INPUT COMMAND...: Runs COMMAND with stdin from INPUT
+# and reports the case NAME as failed unless its output matches EXPECTED
+check() {
+	name=$1 expected=$2 input=$3
+	shift 3
+	if ! "$@" < "$input" 2>/dev/null | cmp -s - "$expected"; then
+		echo "FAIL: $name"
+		failed=1
+	fi
+}
+
+# The same scores give the same report through the line reader, the block
+# parser and a mapped file
+check scores-fgets "$TESTS/scores.out" "$TESTS/scores.txt" "$WAFREPORT"
+check scores-block "$TESTS/scores.out" "$TESTS/scores.txt" "$WAFREPORT" -b
+check scores-mmap "$TESTS/scores.out" /dev/null "$WAFREPORT" "$TESTS/scores.txt"
+
+# A mapped file whose last line has no newline still counts that line
+printf %s "$(cat "$TESTS/scores.txt")" > "$dir/noeol.txt"
+check scores-mmap-noeol "$TESTS/scores.out" /dev/null "$WAFREPORT" "$dir/noeol.txt"
+
+# Parsing on several threads gives the same report as on one, and as the
+# line reader, with a file big enough to be cut into several slices of
+# FILE_TASK_SIZE bytes, on lines of varying length with some invalid ones
+awk 'BEGIN {
+	for (i = 0; i < 2000000; i++)
+		if (i % 101 == 0) print "- " i % 5
+		else print (i * 7919) % 1009, i % 17 ? 0 : i % 23
+}' > "$dir/jobs.txt"
+"$WAFREPORT" < "$dir/jobs.txt" > "$dir/jobs.out"
+check jobs-1 "$dir/jobs.out" /dev/null "$WAFREPORT" -j 1 "$dir/jobs.txt"
+check jobs-4 "$dir/jobs.out" /dev/null "$WAFREPORT" -j 4 "$dir/jobs.txt"
+
+# The report rendered into one buffer is byte for byte the one the
+# baseline printed row by row, with columns several digits wide
+awk 'BEGIN {
+	for (i = 0; i < 300000; i++)
+		if (i % 997 == 0) print "- -"
+		else print int(i / 2300) * 7 % 1031, (i * 7) % 37 < 30 ? 0 : (i * 7) % 37
+}' > "$dir/widths.txt"
+check widths "$TESTS/widths.out" "$dir/widths.txt" "$WAFREPORT"
+
+# Scores too large for an int saturate at INT_MAX, whichever reader sees them
+check overlong-fgets "$TESTS/overlong.out" "$TESTS/overlong.txt" "$WAFREPORT"
+check overlong-block "$TESTS/overlong.out" "$TESTS/overlong.txt" "$WAFREPORT" -b
+check overlong-mmap "$TESTS/overlong.out" /dev/null "$WAFREPORT" "$TESTS/overlong.txt"
+
+# Lines longer than any buffer are one record each, whichever reader sees them
+check longline-fgets "$TESTS/longline.out" "$TESTS/longline.txt" "$WAFREPORT"
+check longline-block "$TESTS/longline.out" "$TESTS/longline.txt" "$WAFREPORT" -b
+check longline-mmap "$TESTS/longline.out" /dev/null "$WAFREPORT" "$TESTS/longline.txt"
+
+# Scores from the top of the dense range of a histogram up into its sparse
+# bins are counted whole, without a clamp, in the rows, means, medians and
+# percentiles alike
+check sparse-fgets "$TESTS/sparse.out" "$TESTS/sparse.txt" "$WAFREPORT" -p 50,100
+check sparse-block "$TESTS/sparse.out" "$TESTS/sparse.txt" "$WAFREPORT" -b -p 50,100
+check sparse-mmap "$TESTS/sparse.out" /dev/null "$WAFREPORT" -p 50,100 "$TESTS/sparse.txt"
+
+# gzip input is recognised as a mapped file, redirected to stdin and, with
+# -b, through a pipe, and gives the report on the uncompressed scores
+gzip -c "$TESTS/scores.txt" > "$dir/scores.txt.gz"
+check gzip-mmap "$TESTS/scores.out" /dev/null "$WAFREPORT" "$dir/scores.txt.gz"
+check gzip-stdin "$TESTS/scores.out" "$dir/scores.txt.gz" "$WAFREPORT"
+check gzip-pipe "$TESTS/scores.out" /dev/null \
+    sh -c 'cat "$1" | "$2" -b' sh "$dir/scores.txt.gz" "$WAFREPORT"
+
+# Mapped gzip files are fed to zlib in pieces, since it takes no more than
+# 4 GiB at once: with pieces of 1000 bytes, a file of two members (so one
+# ends mid-piece) gives the same report as the uncompressed scores, with no
+# error, and one cut short is reported as such once every byte has been used
+awk 'BEGIN { for (i = 0; i < 50000; i++) print i % 97, i % 13 }' \
+    > "$dir/many.txt"
+"$WAFREPORT" "$dir/many.txt" > "$dir/many.out"
+head -n 20000 "$dir/many.txt" | gzip -1 > "$dir/many.txt.gz"
+tail -n +20001 "$dir/many.txt" | gzip -1 >> "$dir/many.txt.gz"
+check gzip-chunks "$dir/many.out" /dev/null \
+    "$WAFREPORT_CHUNK" "$dir/many.txt.gz"
+if "$WAFREPORT_CHUNK" "$dir/many.txt.gz" 2>&1 >/dev/null | grep -q .; then
+	echo "FAIL: gzip-chunks-error"
+	failed=1
+fi
+head -c 20000 "$dir/many.txt.gz" > "$dir/short.txt.gz"
+if ! "$WAFREPORT_CHUNK" "$dir/short.txt.gz" 2>&1 >/dev/null |
+    grep -q "unexpected end of compressed data"; then
+	echo "FAIL: gzip-chunks-short"
+	failed=1
+fi
+
+# Access log lines ending in the scores give the report the baseline gave
+# on the scores grep -E -o "[0-9-]+ [0-9-]+$" pulls out of them
+check log-fgets "$TESTS/access.out" "$TESTS/access.log" "$WAFREPORT" -F log
+check log-block "$TESTS/access.out" "$TESTS/access.log" "$WAFREPORT" -F log -b
+check log-mmap "$TESTS/access.out" /dev/null "$WAFREPORT" -F log "$TESTS/access.log"
+
+# Counts past 2^32 are added and printed whole: tests/big.snap holds 5e9
+# lines, 2e9 of them with an inbound score of 0 and 3e9 of 5, and 1e9 with
+# an invalid outbound score, so two of it make 1e10
+check counts-64bit "$TESTS/big.out" /dev/null "$WAFREPORT" -M "$TESTS/big.snap" "$TESTS/big.snap"
+
+# Windows end at the newest time in the log, out of order and in any zone:
+# in UTC the lines are at 05:00:00, 05:58:30, 05:59:10, 05:59:50, 06:00:00
+# and 05:59:59, so the last 10s hold 2 of them, the last minute 4 and the
+# last 5 minutes 5
+check windows-fgets "$TESTS/windows.out" "$TESTS/windows.log" "$WAFREPORT" -F log -w 10s,1m,5m
+check windows-mmap "$TESTS/windows.out" /dev/null "$WAFREPORT" -F log -w 10s,1m,5m "$TESTS/windows.log"
+
+# Snapshots of two halves of the scores, one written to stdout, merge into
+# the report on all of them, with the pairs too when saved with -x
+head -n 30 "$TESTS/scores.txt" | "$WAFREPORT" -S "$dir/head.snap"
+tail -n +31 "$TESTS/scores.txt" | "$WAFREPORT" -S - > "$dir/tail.snap"
+check snapshot-merge "$TESTS/scores.out" "$dir/tail.snap" \
+    "$WAFREPORT" -M "$dir/head.snap" -
+head -n 4 "$TESTS/stats.txt" | "$WAFREPORT" -x -S "$dir/head-x.snap"
+tail -n +5 "$TESTS/stats.txt" | "$WAFREPORT" -x -S "$dir/tail-x.snap"
+check snapshot-merge-cross "$TESTS/cross.out" /dev/null \
+    "$WAFREPORT" -x -M "$dir/head-x.snap" "$dir/tail-x.snap"
+
+# A snapshot with a byte changed in its trailer, or cut short, is rejected
+# rather than merged
+size=$(wc -c < "$dir/head.snap")
+last=$(tail -c 1 "$dir/head.snap" | od -An -to1 | tr -d ' ')
+head -c $((size - 1)) "$dir/head.snap" > "$dir/bad.snap"
+if [ "$last" = 001 ]; then
+	printf '\002' >> "$dir/bad.snap"
+else
+	printf '\001' >> "$dir/bad.snap"
+fi
+head -c 20 "$dir/head.snap" > "$dir/short.snap"
+for snap in bad short; do
+	if "$WAFREPORT" -M "$dir/$snap.snap" > /dev/null 2>&1 ||
+	    ! "$WAFREPORT" -M "$dir/$snap.snap" 2>&1 >/dev/null |
+	    grep -q "corrupt snapshot"; then
+		echo "FAIL: snapshot-$snap"
+		failed=1
+	fi
+done
+
+# Stock ModSecurity v3 JSON audit records (CRS 3 and 4), whose totals are
+# only in the messages of the rules reporting them, one logged below the
+# blocking threshold (which holds no score), and one with TX keys
+check json-mmap "$TESTS/audit.out" /dev/null "$WAFREPORT" -F json "$TESTS/audit.json"
+check json-block "$TESTS/audit.out" "$TESTS/audit.json" "$WAFREPORT" -b -F json
+
+# The means and medians of a few scores, with gaps between them and invalid
+# ones in either direction, match those the baseline printed
+check stats "$TESTS/stats.out" "$TESTS/stats.txt" "$WAFREPORT"
+
+# Nearest-rank percentiles over the valid scores, checked by hand: the 8
+# valid inbound scores are 0 3 3 4 7 7 20 40 and the outbound 0 1 2 2 9 9
+# 100 100
+check percentiles "$TESTS/percentiles.out" "$TESTS/stats.txt" "$WAFREPORT" -p 1,50,90,99.9,100
+
+# The cross-tabulation counts every line as a pair, invalid scores as "-",
+# with the correlation over the 7 pairs of valid scores (0.5067) checked by
+# hand, and high pairs kept outside the grid are listed in order with the
+# rest (-0.2987 over 6)
+check cross "$TESTS/cross.out" "$TESTS/stats.txt" "$WAFREPORT" -x
+check cross-sparse "$TESTS/cross-sparse.out" /dev/null "$WAFREPORT" -x "$TESTS/sparse.txt"
+
+# A threshold blocks every line scoring at or above it, and lets through
+# the rest along with the invalid scores
+check thresholds "$TESTS/thresholds.out" "$TESTS/stats.txt" "$WAFREPORT" -T
+check thresholds-sparse "$TESTS/thresholds-sparse.out" /dev/null "$WAFREPORT" -T "$TESTS/sparse.txt"
+
+# Groups keyed by a field counted from the end (the vhost) or the start
+# (the status, with the bracketed time and quoted request one field each),
+# or by JSON keys, with the summary sorted by mean or p99
+check group-vhost "$TESTS/group-vhost.out" "$TESTS/access.log" "$WAFREPORT" -F log -g -3
+check group-status "$TESTS/group-status.out" /dev/null "$WAFREPORT" -F log -g 6 -O p99 "$TESTS/access.log"
+check group-json "$TESTS/group-json.out" /dev/null "$WAFREPORT" -F json -g host,http_code "$TESTS/audit.json"
+
+# The heaviest clients and URIs, by requests and by inbound score, with
+# nothing overcounted while there are fewer of them than the sketch holds
+check topk "$TESTS/topk.out" "$TESTS/access.log" "$WAFREPORT" -F log -k 3
+
+# A client making every tenth of 20000 requests, among thousands making one
+# each, tops both lists with its exact counts, however many the sketch has
+# had to evict
+awk 'BEGIN {
+	for (i = 0; i < 20000; i++) {
+		ip = i % 10 ? "10." int(i / 256) % 256 "." i % 256 ".1" : "203.0.113.66"
+		printf "%s - - [16/Oct/2026:06:00:00 +0000] \"GET /p%d HTTP/1.1\" 200 1 \"-\" \"-\" %d 0\n",
+		    ip, i, i % 10 ? 1 : 50
+	}
+}' > "$dir/heavy.log"
+"$WAFREPORT" -F log -k 2 "$dir/heavy.log" > "$dir/heavy.out"
+if [ "$(grep -c '^203\.0\.113\.66 |  *2000 |.*|  *0$' "$dir/heavy.out")" != 1 ] ||
+    [ "$(grep -c '^203\.0\.113\.66 |  *100000 |.*|  *0$' "$dir/heavy.out")" != 1 ]; then
+	echo "FAIL: topk-heavy"
+	failed=1
+fi
+
+# Distinct clients per score and per band are exact while there are few of
+# them: 5 clients in all, 2 scoring 0-4 inbound, 3 scoring 5-19 and 2 20+
+check distinct "$TESTS/distinct.out" "$TESTS/access.log" "$WAFREPORT" -F log -d
+check bands "$TESTS/bands.out" /dev/null "$WAFREPORT" -F log -D 5,20 "$TESTS/access.log"
+
+# 100000 distinct clients, half of them scoring 5, are estimated within 2%
+awk 'BEGIN {
+	for (i = 0; i < 100000; i++)
+		printf "10.%d.%d.%d - - [16/Oct/2026:06:00:00 +0000] \"GET / HTTP/1.1\" 200 1 \"-\" \"-\" %d 0\n",
+		    int(i / 65536), int(i / 256) % 256, i % 256, i % 2 ? 5 : 0
+}' > "$dir/clients.log"
+"$WAFREPORT" -F log -D 5 "$dir/clients.log" |
+    awk -F '|' '/^All / && all == "" { all = $3 }
+                /^0-4 / && low == "" { low = $3 }
+                /^5\+ / && high == "" { high = $3 }
+                END { exit !(all > 98000 && all < 102000 &&
+                             low > 49000 && low < 51000 &&
+                             high > 49000 && high < 51000) }' || {
+	echo "FAIL: distinct-estimate"
+	failed=1
+}
+
+# A median past all the valid scores is "-", while a real one of 65537 (the
+# old sentinel) is printed as such
+check median "$TESTS/median.out" "$TESTS/median.txt" "$WAFREPORT"
+
+# Several files, plain and compressed, read on a pool of threads give the
+# report on all their lines together
+cat "$TESTS/scores.txt" "$TESTS/stats.txt" "$TESTS/sparse.txt" |
+    "$WAFREPORT" > "$dir/files.out"
+check files-jobs "$dir/files.out" /dev/null "$WAFREPORT" -j 3 \
+    "$dir/scores.txt.gz" "$TESTS/stats.txt" "$TESTS/sparse.txt"
+
+# Per-file reports on several threads match those on one, with a file big
+# enough to be cut into slices parsed by different threads
+awk 'BEGIN { for (i = 0; i < 1500000; i++) print i % 89, i % 7 }' \
+    > "$dir/slices.txt"
+"$WAFREPORT" -P -j 1 "$dir/slices.txt" "$TESTS/overlong.txt" \
+    "$TESTS/longline.txt" > "$dir/per-file.out"
+check per-file-jobs "$dir/per-file.out" /dev/null "$WAFREPORT" -P -j 4 \
+    "$dir/slices.txt" "$TESTS/overlong.txt" "$TESTS/longline.txt"
+
+# Following a pipe prints a report every interval while lines arrive, and
+# a final one on all of them once the writer goes away
+head -n 5 "$TESTS/scores.txt" | "$WAFREPORT" > "$dir/follow-pipe.expected"
+printf '\n\n\n' >> "$dir/follow-pipe.expected"
+cat "$TESTS/scores.out" >> "$dir/follow-pipe.expected"
+(head -n 5 "$TESTS/scores.txt"; sleep 1.5; tail -n +6 "$TESTS/scores.txt") |
+    "$WAFREPORT" -f -i 1 > "$dir/follow-pipe.out"
+if ! cmp -s "$dir/follow-pipe.out" "$dir/follow-pipe.expected"; then
+	echo "FAIL: follow-pipe"
+	failed=1
+fi
+
+# Each run with a state file parses only the lines appended since the last
+# one, leaving a last line without its newline for the next, yet reports on
+# every line so far. A file replaced since, or truncated and written past
+# the old offset again in place, is read from the start
+head -n 30 "$TESTS/scores.txt" > "$dir/state.log"
+head -n 30 "$TESTS/scores.txt" | "$WAFREPORT" > "$dir/state-30.out"
+head -n 59 "$TESTS/scores.txt" | "$WAFREPORT" > "$dir/state-59.out"
+check state-first "$dir/state-30.out" /dev/null \
+    "$WAFREPORT" -C "$dir/state" "$dir/state.log"
+tail -n +31 "$TESTS/scores.txt" | head -n 29 >> "$dir/state.log"
+printf %s "$(tail -n 1 "$TESTS/scores.txt")" >> "$dir/state.log"
+check state-appended "$dir/state-59.out" /dev/null \
+    "$WAFREPORT" -C "$dir/state" "$dir/state.log"
+echo >> "$dir/state.log"
+check state-newline "$TESTS/scores.out" /dev/null \
+    "$WAFREPORT" -C "$dir/state" "$dir/state.log"
+check state-unchanged "$TESTS/scores.out" /dev/null \
+    "$WAFREPORT" -C "$dir/state" "$dir/state.log"
+cp "$TESTS/stats.txt" "$dir/state.new"
+mv "$dir/state.new" "$dir/state.log"
+check state-replaced "$TESTS/stats.out" /dev/null \
+    "$WAFREPORT" -C "$dir/state" "$dir/state.log"
+cat "$TESTS/scores.txt" > "$dir/state.log"
+check state-rewritten "$TESTS/scores.out" /dev/null \
+    "$WAFREPORT" -C "$dir/state" "$dir/state.log"
+
+# A followed file truncated in place (copytruncate) and written past where
+# it was left before wafreport looks again is read again from the start
+printf '1 0\n2 0\n3 0\n' > "$dir/follow.log"
+"$WAFREPORT" -f -i 100 "$dir/follow.log" > "$dir/follow.out" 2>/dev/null &
+pid=$!
+sleep 1
+: > "$dir/follow.log"
+printf '5 0\n5 0\n5 0\n5 0\n5 0\n' >> "$dir/follow.log"
+sleep 1
+kill "$pid"
+wait "$pid"
+printf '1 0\n2 0\n3 0\n5 0\n5 0\n5 0\n5 0\n5 0\n' |
+    "$WAFREPORT" > "$dir/follow.expected"
+if ! cmp -s "$dir/follow.out" "$dir/follow.expected"; then
+	echo "FAIL: follow-copytruncate"
+	failed=1
+fi
+
+# A followed file renamed away and replaced by a new one is read to its
+# end, including a line written to it after the rename, before the new one
+# is read from its start
+printf '1 0\n2 0\n' > "$dir/rotate.log"
+"$WAFREPORT" -f -i 100 "$dir/rotate.log" > "$dir/rotate.out" 2>/dev/null &
+pid=$!
+sleep 1
+printf '3 0\n' >> "$dir/rotate.log"
+mv "$dir/rotate.log" "$dir/rotate.log.1"
+printf '4 0\n' >> "$dir/rotate.log.1"
+printf '5 0\n6 0\n' > "$dir/rotate.log"
+sleep 1
+kill "$pid"
+wait "$pid"
+printf '1 0\n2 0\n3 0\n4 0\n5 0\n6 0\n' | "$WAFREPORT" > "$dir/rotate.expected"
+if ! cmp -s "$dir/rotate.out" "$dir/rotate.expected"; then
+	echo "FAIL: follow-rename"
+	failed=1
+fi
+
+# The generator writes the same lines for the same seed and other lines for
+# another, and the same scores in each of its formats, which wafreport reads
+# back into the same report
+"$WAFGEN" -n 20000 -s 3 > "$dir/gen.txt"
+"$WAFGEN" -n 20000 -s 4 > "$dir/gen-4.txt"
+"$WAFREPORT" "$dir/gen.txt" > "$dir/gen.out"
+check gen-seed "$dir/gen.txt" /dev/null "$WAFGEN" -n 20000 -s 3
+if cmp -s "$dir/gen.txt" "$dir/gen-4.txt"; then
+	echo "FAIL: gen-other-seed"
+	failed=1
+fi
+for format in log json; do
+	"$WAFGEN" -F "$format" -n 20000 -s 3 > "$dir/gen.$format"
+	check "gen-$format" "$dir/gen.out" /dev/null \
+	    "$WAFREPORT" -F "$format" "$dir/gen.$format"
+done
+
+# --profile leaves the report alone and writes to stderr a row for each
+# phase, along with the bytes and lines that were parsed
+check profile-report "$TESTS/scores.out" /dev/null \
+    "$WAFREPORT" --profile "$TESTS/scores.txt"
+"$WAFREPORT" --profile "$TESTS/scores.txt" 2>&1 >/dev/null |
+    awk -v bytes="$(wc -c < "$TESTS/scores.txt")" '
+	$1 ~ /^(read|stats|render|write|total)$/ { phases++ }
+	/^Bytes parsed:/ && $3 == bytes { ok++ }
+	/^Score lines:/ && $3 == 59 { ok++ }
+	END { exit !(phases == 5 && ok == 2) }' || {
+	echo "FAIL: profile"
+	failed=1
+}
+
+# The metrics endpoint, scraped over a Unix socket while following the
+# overlong fixture, once every line has been read
+if command -v curl > /dev/null; then
+	"$WAFREPORT" -m "$dir/metrics.sock" -B 5,100 "$TESTS/overlong.txt" &
+	pid=$!
+	i=0
+	while [ "$i" -lt 50 ]; do
+		curl -s --unix-socket "$dir/metrics.sock" \
+		    http://localhost/metrics > "$dir/metrics.out" 2>/dev/null &&
+		    grep -q "^wafreport_scores_read_total 4$" "$dir/metrics.out" &&
+		    break
+		sleep 0.1
+		i=$((i + 1))
+	done
+	kill "$pid"
+	wait "$pid"
+	if ! cmp -s "$dir/metrics.out" "$TESTS/metrics.out"; then
+		echo "FAIL: metrics"
+		failed=1
+	fi
+fi
+
+exit $failed
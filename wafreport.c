@@ -33,64 +33,1455 @@
  *
  * Usage: Intended to be used with grep, piping in anomaly scores like so:
  *   grep -E -o "[0-9-]+ [0-9-]+$" my_waf.log | ./wafreport
+ *
+ * Options:
+ *   -b, --block  Read stdin in large blocks and parse the scores with the
+ *                hand-rolled parser instead of line by line with the legacy
+ *                reader (much faster on large inputs; the output is the same)
+ *
+ *   -j, --jobs N Read the FILEs with N threads (0 = one per CPU), which share
+ *                out slices of the mapped files and whole compressed ones,
+ *                stealing from each other when they run out
+ *   -P, --per-file
+ *                Print a report for each FILE before the combined report
+ *   -g, --group-by FIELDS
+ *                Also break the scores down by a key made of up to four
+ *                fields of each line: field numbers for scores and log lines
+ *                (from 1 at the start, or -1 at the end; quoted and
+ *                bracketed fields count as one), key names for JSON:
+ *                  ./wafreport -F log -g 1 other_vhosts_access.log
+ *                  ./wafreport -F json -g host,http_code modsec_audit.log
+ *   -O, --group-order ORDER
+ *                Sort the group summary by the inbound "mean" (the default)
+ *                or "p99"
+ *   -k, --top K  After the inbound scores, list the K heaviest client
+ *                addresses and URIs (without query strings) of log or JSON
+ *                input, by requests and by summed inbound score. They are
+ *                found in fixed memory with Space-Saving summaries, so each
+ *                count may be overstated, by at most its "Overcount"
+ *   -d, --distinct
+ *                Also estimate the number of distinct clients with each
+ *                score, in a column of their own, from HyperLogLog sketches
+ *                of 4 KB each (within about 1.6%)
+ *   -D, --bands LIST
+ *                Estimate the distinct clients per score band instead, given
+ *                by their lower bounds, e.g. -D 5,10,25 for 0-4, 5-9, 10-24
+ *                and 25+, in a table after each direction's percentiles
+ *   -F, --format FORMAT
+ *                Input format: "scores" (the default, as above), "log" for
+ *                native access log lines ending in the two anomaly scores,
+ *                which makes the grep pre-filter unnecessary:
+ *                  ./wafreport -F log /var/log/apache2/access.log
+ *                or "json" for JSON audit logs (SecAuditLogFormat JSON), one
+ *                record per line, carrying the scores in the messages of the
+ *                CRS rules reporting them, as stock ModSecurity logs them,
+ *                or in keys ending in inbound_anomaly_score and
+ *                outbound_anomaly_score
+ *   -p, --percentiles LIST
+ *                Also print the given percentiles of the valid scores in each
+ *                direction, e.g. -p 50,90,95,99,99.9
+ *   -f, --follow Keep reading a single FILE (or stdin) as it grows, like
+ *                tail -F, printing a fresh report every interval while new
+ *                scores arrive and a final one on SIGINT/SIGTERM. A FILE
+ *                that logrotate renames and recreates, or truncates, is
+ *                followed across the rotation without losing lines, and
+ *                waited on with inotify in between writes
+ *   -i, --interval SECS
+ *                Seconds between reports in follow mode (default 10)
+ *   -w, --windows LIST
+ *                Also report on the scores of the most recent stretches of
+ *                time, e.g. -w 1m,5m,1h, using the times logged on access,
+ *                error or JSON audit log lines, or the time lines were read
+ *   -x, --cross  Also print the joint distribution of the inbound and outbound
+ *                scores: a cross-tabulation, the conditional distributions of
+ *                each given the other, and their correlation
+ *   -T, --thresholds
+ *                Also print the share of requests and responses that every
+ *                candidate anomaly threshold would block, and with -x the
+ *                exact combined block rate of every pair of thresholds
+ *   -m, --metrics ADDR
+ *                Follow a single FILE (or stdin) as with -f, but instead of
+ *                printing reports, serve the score histograms as OpenMetrics
+ *                text over HTTP, on [HOST:]PORT (HOST defaults to 127.0.0.1)
+ *                or a Unix socket if ADDR contains a slash:
+ *                  ./wafreport -F log -m :9464 /var/log/apache2/access.log
+ *   -B, --buckets LIST
+ *                Upper bounds of the metrics histogram buckets, in ascending
+ *                order (default 0,1,2,3,4,5,10,15,20,25,50,100)
+ *   -S, --save SNAPSHOT
+ *                Write the counts to the file SNAPSHOT ("-" for stdout) in a
+ *                compact binary form instead of printing a report
+ *   -M, --merge  Read snapshots written with -S instead of scores, and report
+ *                on (or save) them added together:
+ *                  ./wafreport -M node-*.snap
+ *   --profile    Write a profile of the run to stderr: the time taken to
+ *                read the input, work out the statistics, render and write
+ *                the report, with the CPU cycles and cache misses of each
+ *                where perf_event_open(2) is allowed, the bytes and lines
+ *                parsed, the read throughput and the peak RSS
+ *   -C, --state STATE
+ *                Keep the counts for a single growing FILE (or stdin
+ *                redirected from one) in the snapshot STATE, with how far
+ *                into the file they go. Each run loads them, parses only the
+ *                lines appended since and saves them again, so a cron job
+ *                costs as much as the new lines. A replaced or truncated
+ *                file is read from the start:
+ *                  ./wafreport -F log -C /var/lib/wafreport/access.state \
+ *                      /var/log/apache2/access.log
+ *
+ * Any FILE arguments are read instead of stdin. Regular files are mapped into
+ * memory and parsed in place, which avoids the copy through a pipe:
+ *   ./wafreport scores-1.txt scores-2.txt
+ * Files (and stdin) compressed with gzip or zstd are recognised by their magic
+ * number and decompressed as they are read, so rotated logs need no zcat:
+ *   ./wafreport -F log -j 0 /var/log/apache2/access.log.*.gz
+ * A compressed pipe on stdin is only recognised with -b. Quoted wildcards are
+ * expanded too, for lists of files too long for the command line:
+ *   ./wafreport -j 0 -P '/var/log/waf/scores-*.txt'
  */
 
+#include <ctype.h>
+#include <errno.h>
+#include <getopt.h>
+#include <glob.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <zlib.h>
+#include <linux/perf_event.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define DENSE_SCORES 1024
+#define READ_BLOCK_SIZE (1024 * 1024)
+#ifndef INFLATE_CHUNK_MAX
+#define INFLATE_CHUNK_MAX UINT_MAX  /* made smaller by make check */
+#endif
+#define FILE_TASK_SIZE (4 * 1024 * 1024)
+#define MAX_JOBS 1024
+#define MAX_PERCENTILES 32
+#define OUTBUF_SIZE (64 * 1024)
+#define FOLLOW_INTERVAL 10
+#define FOLLOW_POLL_MS 250
+#define MAX_WINDOWS 8
+#define MAX_WINDOW (7 * 24 * 60 * 60)
+#define WINDOW_SLOTS 3600
+#define JOINT_DENSE 64
+#define MAX_BUCKETS 64
+#define DEFAULT_BUCKETS "0,1,2,3,4,5,10,15,20,25,50,100"
+#define METRICS_TIMEOUT_MS 1000
+#define METRICS_REQUEST_SIZE 4096
+#define MAX_GROUP_FIELDS 4
+#define GROUP_NAME_MAX 64
+#define GROUP_KEY_MAX 256
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define MAX_TOP 1000
+#define TOP_KEY_MAX 128
+#define TOP_COUNTERS_PER_KEY 16
+#define TOP_MIN_COUNTERS 1024
+#define HLL_BITS 12
+#define HLL_REGISTERS (1 << HLL_BITS)
+#define MAX_BANDS 32
+#define OPT_PROFILE 256
+#define PROFILE_COUNTERS 2
+
+#define IS_SPACE(c) ((c) == ' ' || ((c) >= '\t' && (c) <= '\r'))
+#define IS_DIGIT(c) ((unsigned) ((c) - '0') <= 9)
+
+/* Formats of the input lines that can be read in */
+enum input_format {
+	FORMAT_SCORES,   /* INBOUND OUTBOUND, as produced by the grep filter */
+	FORMAT_LOG,      /* Access log lines ending in INBOUND OUTBOUND */
+	FORMAT_JSON      /* JSON audit log records, one per line */
+};
+
+/* Compression of an input, told apart by the magic number at its start */
+enum compression {
+	COMPRESS_NONE,
+	COMPRESS_GZIP,   /* gzip (or zlib) streams, possibly several members */
+	COMPRESS_ZSTD    /* Zstandard frames */
+};
+#define COMPRESS_MAGIC_LEN 4
+
+/* Phases of a run timed by --profile. Rendering includes working out the
+ * statistics, which are also timed on their own */
+enum profile_phase_id {
+	PROFILE_READ,    /* Reading in and parsing the input, or snapshots */
+	PROFILE_STATS,   /* compute_stats() */
+	PROFILE_RENDER,  /* Rendering the reports into the output buffer */
+	PROFILE_WRITE,   /* Writing out the report or snapshot */
+	PROFILE_PHASES
+};
+
+/* Orders of the group summary */
+enum group_order {
+	GROUP_ORDER_MEAN,
+	GROUP_ORDER_P99
+};
+
+/* Key suffixes which identify the scores in a JSON audit log record. Matching
+ * on the suffix, case-insensitively, picks up e.g. "inbound_anomaly_score",
+ * "TX:INBOUND_ANOMALY_SCORE" and CRS 4's "blocking_inbound_anomaly_score" */
+#define JSON_KEY_IN  "inbound_anomaly_score"
+#define JSON_KEY_OUT "outbound_anomaly_score"
+
+/* Stock ModSecurity audit log records have no such keys: the totals are only
+ * in the "message" (or "data") of the CRS rules reporting them, just after
+ * these texts. Those are the blocking evaluation rules 949110 and 959100, CRS
+ * 3's correlation rule 980130 and CRS 4's reporting rule 980170 */
+#define JSON_MSG_IN         "Inbound Anomaly Score Exceeded (Total Score: "
+#define JSON_MSG_OUT        "Outbound Anomaly Score Exceeded (Total Score: "
+#define JSON_MSG_TOTAL_IN   "(Total Inbound Score: "
+#define JSON_MSG_REPORT_IN  "(Inbound Scores: blocking="
+#define JSON_MSG_REPORT_OUT "(Outbound Scores: blocking="
+
+/* Snapshot files hold a tally in a compact binary form, so that tallies made
+ * on different machines can be merged without reading the logs again. Every
+ * number after the header is an unsigned LEB128 varint, which makes the
+ * format independent of byte order and word size:
+ *   SNAPSHOT_MAGIC, SNAPSHOT_VERSION, flags
+ *   scores_read
+ *   inbound histogram, then outbound histogram:
+ *     invalid, number of populated scores, then for each populated score in
+ *     ascending order: its difference from the previous one (the first from
+ *     -1), and its count
+ *   if flags has SNAPSHOT_JOINT, the pairs of the joint histogram in order:
+ *     number of pairs, then for each pair: the difference of its inbound
+ *     score from the previous pair's (the first from -1), the difference of
+ *     its outbound score from the previous one with the same inbound score
+ *     (the first from -1), and its count
+ *   if flags has SNAPSHOT_SOURCE (a state file saved with -C), where the
+ *     counts were read up to: the device and inode numbers of the file, the
+ *     offset just past the last line counted, and the FNV-1a hash of the
+ *     STATE_CHECK_LEN bytes before that offset (fewer at the start)
+ *   FNV-1a hash of all the bytes before it, 4 bytes little-endian */
+#define SNAPSHOT_MAGIC "WAFRSNAP"
+#define SNAPSHOT_MAGIC_LEN 8
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_JOINT 0x01
+#define SNAPSHOT_SOURCE 0x02
+#define STATE_CHECK_LEN 64
+
+/* Count of a score above the dense range of a histogram */
+struct sparse_bin {
+	int score;
+	uint64_t count;
+};
+
+/* Counts of the scores seen in one direction. Scores below DENSE_SCORES are
+ * counted in an array indexed by score, which is only grown as far as the
+ * highest score seen; the long tail above it is kept in an array of bins
+ * sorted by score. min and max bound the scores with a non-zero count (min >
+ * max while nothing has been counted), so that only the populated part of
+ * the dense array ever needs to be looked at */
+struct histogram {
+	uint64_t *dense;
+	int dense_len;
+	struct sparse_bin *sparse;
+	size_t nsparse, sparse_size;
+	uint64_t invalid;
+	int min, max;
+};
+
+/* Position of a walk over the populated scores of a histogram */
+struct histogram_iter {
+	const struct histogram *hist;
+	int dense_pos;
+	size_t sparse_pos;
+};
+
+/* The file a state file's counts were read from, and how far: enough to
+ * tell whether the file has since been replaced or truncated, and if not
+ * where to carry on from */
+struct snapshot_source {
+	uint64_t dev, ino, offset;
+	uint32_t check;
+};
+
+/* Count of a pair of inbound and outbound scores seen on the same line */
+struct joint_bin {
+	int score_in, score_out;
+	uint64_t count;
+};
+
+/* Counts of the inbound and outbound scores seen together, with -1 standing
+ * for an invalid score. Pairs of scores below JOINT_DENSE - 1 are counted in
+ * a grid indexed by score + 1, which covers nearly every line of a typical
+ * log; the remaining pairs are kept in an open-addressed hash table of bins,
+ * where a bin with a zero count is free */
+struct joint_histogram {
+	uint64_t *grid;
+	struct joint_bin *bins;
+	size_t nbins, bins_size;
+};
+
+/* Counts of the scores in one direction for the metrics endpoint: bucket i
+ * counts the valid scores above bound i - 1 and at or below bound i, and the
+ * last bucket those above every bound */
+struct metric_histogram {
+	uint64_t buckets[MAX_BUCKETS + 1];
+	uint64_t count, sum, invalid;
+};
+
+/* State of the metrics endpoint. The buckets are counted into as scores
+ * arrive, so that answering a scrape costs time in proportion to the number
+ * of buckets rather than the number of scores. Scrapes are answered on a
+ * thread of their own, so that a slow client can't hold up the reader, from
+ * the copy of the counts the reader last published under the lock */
+struct metrics {
+	int bounds[MAX_BUCKETS];
+	int nbounds;
+	struct metric_histogram in, out;
+	int listen_fd;
+	pthread_mutex_t lock;
+	struct metric_histogram shown_in, shown_out;
+	uint64_t shown_scores_read;
+	pthread_t thread;
+	int started;
+	int stop_pipe[2];  /* Written to to stop the thread */
+};
+
+/* Everything counted while reading in the scores. Scores are also counted in
+ * the joint histogram, the ring of recent time slots, the metrics buckets,
+ * the group of their line, the heavy-hitter summaries and the distinct-client
+ * sketches, if there are any */
+struct tally {
+	struct histogram in, out;
+	uint64_t scores_read, bytes_read;
+	struct joint_histogram *joint;
+	struct window_ring *ring;
+	struct metrics *metrics;
+	struct group_table *groups;
+	struct top *top;
+	struct distinct *distinct;
+};
+
+/* A key monitored by a Space-Saving summary, with its count, which
+ * overstates the key's true weight by at most error, and its position in
+ * the summary's heap */
+struct top_counter {
+	char key[TOP_KEY_MAX];
+	size_t len, pos;
+	uint32_t hash;
+	uint64_t count, error;
+};
+
+/* A Space-Saving summary of the heaviest keys of a stream, in a fixed
+ * number of counters. The counters are ordered by count in a min-heap of
+ * their indices, so the smallest can be evicted, and found by key through a
+ * linear-probing hash table of their indices (-1 for an empty slot) */
+struct top_summary {
+	struct top_counter *counters;
+	int *heap, *table;
+	size_t size, capacity, table_size;
+	uint64_t total;
+};
+
+/* The heaviest clients and URIs, by requests and by summed inbound score */
+struct top {
+	struct top_summary client_count, client_score, uri_count, uri_score;
+	int k, format;
+};
+
+/* HyperLogLog sketches of HLL_REGISTERS bytes each, found by an int key
+ * through a linear-probing hash table (a NULL sketch marks an empty slot) */
+struct hll_table {
+	int *keys;
+	uint8_t **sketches;
+	size_t nkeys, size;
+};
+
+/* Sketches of the distinct clients seen with each inbound and outbound
+ * score, or in each score band if there are bands (given by their lower
+ * bounds, the first always 0), and of every client seen */
+struct distinct {
+	struct hll_table in, out;
+	uint8_t *all;
+	int bands[MAX_BANDS];
+	int nbands, format;
+};
+
+/* Memory handed out in small pieces from large blocks, and only released
+ * all at once */
+struct arena_block {
+	struct arena_block *next;
+	uint64_t data[];
+};
+
+struct arena {
+	struct arena_block *blocks;
+	char *next;
+	size_t left;
+};
+
+/* Which parts of a line make up its group key: the numbers of its fields
+ * (negative counting from the end) or, for JSON, the suffixes of the keys
+ * whose values are wanted */
+struct group_spec {
+	int fields[MAX_GROUP_FIELDS];
+	char names[MAX_GROUP_FIELDS][GROUP_NAME_MAX];
+	int nfields, format;
+};
+
+/* The lines sharing a group key, and their counts. The key is kept right
+ * after the structure */
+struct group {
+	const char *key;
+	size_t key_len;
+	uint32_t hash;
+	struct tally tally;
+};
+
+/* The groups met so far, found by key through an open-addressed hash table
+ * of pointers. The groups themselves, and their keys, are carved out of an
+ * arena, so that thousands of them take a handful of allocations */
+struct group_table {
+	struct group **slots;
+	size_t nslots, ngroups;
+	const struct group_spec *spec;
+	struct arena arena;
+};
+
+/* A group's row in the summary, with the figures it's sorted by */
+struct group_row {
+	const struct group *group;
+	double mean[2];
+	int p99[2], order;
+};
 
-#define MAX_SCORE 65536
+/* Tallies of the scores seen in each of the most recent ticks of time, used
+ * for the sliding window reports. Slot head_pos holds tick number head (the
+ * time divided by the tick length), the slot before it tick head - 1, and so
+ * on round the ring. A slot is emptied and reused when the ring moves past
+ * it, so old scores age out at a constant cost per tick. Times are taken
+ * from the log lines where they carry one, else from when they were read */
+struct window_ring {
+	struct tally *slots;
+	int nslots, tick, head_pos;
+	int64_t head;
+	int clock_only;
+};
 
-int read_in_scores(int *score_count_in, int *score_count_out, int *invalid_in, int *invalid_out);
-void print_stats (const int *score_count_in, const int *score_count_out, int invalid_in, int invalid_out, int scores_read);
-double avg_mean(const int *score_count_array, int scores_read);
-double avg_median(const int *score_count_array, int scores_read);
-int digit_width(int n);
+/* A populated score, with the number of valid scores up to and including it */
+struct stats_row {
+	int score;
+	uint64_t count, cumulative;
+};
 
-int main(void)
+/* Statistics for one direction, as computed by compute_stats() and rendered
+ * by print_stats() */
+struct score_stats {
+	uint64_t scores_read, invalid;
+	struct stats_row *rows;
+	size_t nrows;
+	double mean, median;
+	int median_known;  /* 0 when invalid scores leave no middle score */
+	int score_width, count_width;
+};
+
+/* Report settings from the command line. Percentiles are held in parts per
+ * million, so that e.g. 99.9 is exact and ranks can be worked out with
+ * integer arithmetic */
+struct report_options {
+	unsigned long percentiles[MAX_PERCENTILES];
+	int npercentiles;
+	int windows[MAX_WINDOWS];
+	int nwindows;
+	int thresholds;
+	int group_order;
+};
+
+/* Text waiting to be written to a file descriptor in one go */
+struct outbuf {
+	char *buf;
+	size_t len, size;
+	int fd;
+};
+
+/* Input read with read(2) that is split into lines as it arrives. A partial
+ * line at the end of a read is carried over until the rest of it turns up */
+struct line_reader {
+	char *buf;
+	size_t carry;
+	int skipping, format;
+};
+
+/* Set by a signal to end follow mode */
+volatile sig_atomic_t follow_stop = 0;
+
+/* Time and hardware counts spent in one phase of a run, in total and since
+ * the phase last started */
+struct profile_phase {
+	double seconds, started;
+	uint64_t counters[PROFILE_COUNTERS], counters_started[PROFILE_COUNTERS];
+};
+
+/* What --profile measures: each phase, plus the perf_event_open(2) counters
+ * of CPU cycles and cache misses (-1 where they aren't allowed) */
+struct profile {
+	struct profile_phase phases[PROFILE_PHASES];
+	double start;
+	int counter_fds[PROFILE_COUNTERS], counter_errno;
+};
+
+/* The profile being kept, or NULL without --profile, in which case timing a
+ * phase costs a single test */
+struct profile *profile = NULL;
+
+/* A piece of work for the file scheduler: a newline-aligned slice of a
+ * mapped file, or the whole of a file that has to be read (buf NULL) or
+ * decompressed from start to end */
+struct file_task {
+	const char *buf;
+	size_t len;
+	int file;
+};
+
+/* One input file of a file_sched. Its tally, if there is one, is for a
+ * per-file report, and is added to under the lock by whichever threads run
+ * the file's tasks */
+struct sched_file {
+	const char *path;
+	void *map;
+	size_t map_len;
+	int fd, compression;
+	struct tally *tally;
+	pthread_mutex_t lock;
+};
+
+/* One thread of a file_sched, with its queue of tasks (those from top up to
+ * bottom) and the tally it counts them in. For per-file reports, the slices
+ * it takes of one file are counted together in part, until it moves on to
+ * another file */
+struct sched_worker {
+	struct file_sched *sched;
+	struct file_task *tasks;
+	int top, bottom;
+	pthread_mutex_t lock;
+	struct tally *tally;
+	struct tally part;
+	int part_file;  /* The file part counts, or -1 */
+	pthread_t thread;
+	int started;
+};
+
+/* The files being read by read_in_scores_files(), and the threads reading
+ * them */
+struct file_sched {
+	struct sched_file *files;
+	struct sched_worker *workers;
+	int nfiles, nworkers, format;
+};
+
+void usage(const char *prog);
+void read_in_scores(struct tally *tally);
+int scan_int(const char *p, const char **rest, int *value);
+void read_in_scores_block(int fd, const char *name, int format, struct tally *tally);
+void read_in_scores_files(char **paths, int npaths, int format, int jobs, struct tally *file_tallies, struct tally *tally);
+void read_in_scores_state(const char *state_path, const char *path, int format, struct tally *tally);
+off_t read_in_scores_tail(int fd, const char *name, int format, off_t offset, off_t size, struct tally *tally);
+uint32_t state_check(int fd, const char *name, off_t offset);
+void save_state(const char *path, const struct tally *tally, const struct snapshot_source *source);
+void sched_plan_file(struct file_sched *sched, int index, int split, struct file_task **tasks, size_t *ntasks, size_t *tasks_size);
+void sched_add_task(struct file_task **tasks, size_t *ntasks, size_t *tasks_size, const struct file_task *task);
+int file_task_cmp(const void *a, const void *b);
+void *sched_worker_run(void *arg);
+int sched_next_task(struct sched_worker *worker, struct file_task *task);
+void sched_run_task(struct sched_worker *worker, const struct file_task *task);
+void sched_flush_part(struct sched_worker *worker);
+int compression_of(const char *p, size_t len);
+int fd_compression(int fd);
+void decompress_scores(const char *name, int kind, int fd, const char *data, size_t len, struct line_reader *lr, struct tally *tally);
+void gunzip_scores(const char *name, int fd, const char *data, size_t len, struct line_reader *lr, struct tally *tally);
+void unzstd_scores(const char *name, int fd, const char *data, size_t len, struct line_reader *lr, struct tally *tally);
+ssize_t read_full(int fd, char *buf, size_t len);
+void line_reader_init(struct line_reader *lr, int format);
+ssize_t line_reader_fill(struct line_reader *lr, int fd, struct tally *tally);
+void line_reader_consume(struct line_reader *lr, size_t n, struct tally *tally);
+void line_reader_finish(struct line_reader *lr, struct tally *tally);
+void line_reader_free(struct line_reader *lr);
+void follow_scores(const char *path, int fd, int format, int interval, const struct report_options *opts, struct tally *tally);
+int follow_watch(int inotify_fd, int fd, const char *path, int *dir_wd);
+int follow_rotation(const char *path, int *fd, struct line_reader *lr, struct tally *tally, int inotify_fd, int *file_wd);
+int follow_truncated(const char *path, int fd, struct line_reader *lr, uint32_t check);
+void print_follow_report(const struct tally *tally, const struct report_options *opts, int reports, struct outbuf *ob);
+void follow_stop_handler(int sig);
+double monotonic_seconds(void);
+void profile_init(struct profile *prof);
+void profile_start(int phase);
+void profile_stop(int phase);
+int perf_counter_open(uint64_t config);
+uint64_t perf_counter_read(int fd);
+void print_profile(const struct profile *prof, const struct tally *tally);
+int parse_interval_arg(const char *arg);
+void parse_scores(const char *buf, size_t len, int format, struct tally *tally);
+int parse_log_line(const char *p, const char *end, int *score_in, int *score_out);
+int parse_log_field(const char *p, const char *end, int *score);
+int parse_json_line(const char *p, const char *end, int *score_in, int *score_out);
+int parse_json_value(const char *p, const char *end, int *score);
+int parse_json_message(const char *p, const char *end, int outbound, int *score);
+int find_score_after(const char *p, const char *end, const char *text, int *score);
+const char *json_string(const char *p, const char *end, const char **str_end);
+const char *json_string_end(const char *p, const char *end);
+int key_has_suffix(const char *key, const char *key_end, const char *suffix);
+int parse_format_arg(const char *arg);
+void parse_group_arg(const char *arg, int format, struct group_spec *spec);
+int parse_group_order_arg(const char *arg);
+int parse_top_arg(const char *arg);
+void parse_bands_arg(const char *arg, int *bands, int *nbands);
+int parse_jobs_arg(const char *arg);
+int parse_score_line(const char *p, const char *end, int *score_in, int *score_out);
+int parse_int(const char **pp, const char *end, int *value);
+int parse_line_time(const char *p, const char *end, int format, time_t *t);
+int parse_time(const char *p, const char *end, time_t *t);
+int parse_clock(const char **pp, const char *end, int *secs);
+int parse_month(const char **pp, const char *end);
+int expect_char(const char **pp, const char *end, char c);
+int64_t days_from_civil(int64_t y, int m, int d);
+int json_next_key(const char **pp, const char *end, const char **key, const char **key_end);
+void tally_init(struct tally *tally);
+void tally_free(struct tally *tally);
+void tally_clear(struct tally *tally);
+void tally_enable_joint(struct tally *tally);
+void tally_enable_groups(struct tally *tally, const struct group_spec *spec);
+void tally_enable_top(struct tally *tally, int k, int format);
+void tally_enable_distinct(struct tally *tally, const int *bands, int nbands, int format);
+void tally_init_like(struct tally *tally, const struct tally *model);
+void tally_add(struct tally *tally, int score_in, int score_out);
+void tally_merge(struct tally *dest, const struct tally *src);
+void histogram_init(struct histogram *hist);
+void histogram_free(struct histogram *hist);
+void histogram_clear(struct histogram *hist);
+void histogram_add(struct histogram *hist, int score);
+void histogram_add_count(struct histogram *hist, int score, uint64_t count);
+void histogram_merge(struct histogram *dest, const struct histogram *src);
+void histogram_iter_init(struct histogram_iter *iter, const struct histogram *hist);
+int histogram_next(struct histogram_iter *iter, int *score, uint64_t *count);
+void joint_init(struct joint_histogram *joint);
+void joint_free(struct joint_histogram *joint);
+void joint_add(struct joint_histogram *joint, int score_in, int score_out);
+void joint_add_count(struct joint_histogram *joint, int score_in, int score_out, uint64_t count);
+void joint_merge(struct joint_histogram *dest, const struct joint_histogram *src);
+size_t joint_pairs(const struct joint_histogram *joint, struct joint_bin **pairs);
+int joint_bin_cmp(const void *a, const void *b);
+void group_table_init(struct group_table *table, const struct group_spec *spec);
+void group_table_free(struct group_table *table);
+void group_add(struct group_table *table, const char *p, const char *end, int score_in, int score_out);
+struct group *group_find(struct group_table *table, const char *key, size_t len);
+void group_table_merge(struct group_table *dest, const struct group_table *src);
+size_t group_key(const struct group_spec *spec, const char *p, const char *end, char *key);
+int line_field(const char *p, const char *end, int n, const char **start, const char **stop);
+int next_field(const char **pp, const char *end, const char **start, const char **stop);
+int json_field(const char *p, const char *end, const char *name, const char **start, const char **stop);
+void arena_init(struct arena *arena);
+void *arena_alloc(struct arena *arena, size_t size);
+void arena_free(struct arena *arena);
+void top_init(struct top *top, int k, int format);
+void top_free(struct top *top);
+void top_add(struct top *top, const char *p, const char *end, int score_in);
+int top_line_keys(const char *p, const char *end, int format, const char **client, const char **client_end, const char **uri, const char **uri_end);
+void top_merge(struct top *dest, const struct top *src);
+void top_summary_init(struct top_summary *summary, size_t capacity);
+void top_summary_free(struct top_summary *summary);
+void top_summary_add(struct top_summary *summary, const char *key, size_t len, uint64_t weight, uint64_t error);
+void top_table_remove(struct top_summary *summary, int c);
+void top_sift_up(struct top_summary *summary, size_t pos);
+void top_sift_down(struct top_summary *summary, size_t pos);
+void top_summary_merge(struct top_summary *dest, const struct top_summary *src);
+void distinct_init(struct distinct *distinct, const int *bands, int nbands, int format);
+void distinct_free(struct distinct *distinct);
+void distinct_add(struct distinct *distinct, const char *p, const char *end, int score_in, int score_out);
+int distinct_key(const struct distinct *distinct, int score);
+uint64_t distinct_estimate(const struct hll_table *table, int key);
+void distinct_merge(struct distinct *dest, const struct distinct *src);
+int line_client(const char *p, const char *end, int format, const char **client, const char **client_end);
+void hll_table_init(struct hll_table *table);
+void hll_table_free(struct hll_table *table);
+uint8_t *hll_table_find(const struct hll_table *table, int key);
+uint8_t *hll_table_get(struct hll_table *table, int key);
+void hll_table_merge(struct hll_table *dest, const struct hll_table *src);
+void hll_add(uint8_t *sketch, uint64_t hash);
+void hll_merge(uint8_t *dest, const uint8_t *src);
+uint64_t hll_estimate(const uint8_t *sketch);
+uint64_t hash64(const char *p, size_t len);
+void window_ring_init(struct window_ring *ring, const struct report_options *opts);
+void window_ring_free(struct window_ring *ring);
+void window_ring_add(struct window_ring *ring, time_t t, int score_in, int score_out);
+void window_ring_advance(struct window_ring *ring, int64_t tick_no);
+void window_ring_collect(const struct window_ring *ring, int seconds, struct tally *dest);
+void parse_windows_arg(const char *arg, struct report_options *opts);
+void print_report(const struct tally *tally, const struct report_options *opts, struct outbuf *ob);
+void print_windows(const struct tally *tally, const struct report_options *opts, struct outbuf *ob);
+void print_groups(const struct tally *tally, const struct report_options *opts, struct outbuf *ob);
+void out_p99(struct outbuf *ob, int score, int width);
+int group_row_cmp(const void *a, const void *b);
+void print_top(const struct top *top, struct outbuf *ob);
+void print_top_list(struct outbuf *ob, const char *title, const char *key_label, const char *count_label, const struct top_summary *summary, int k);
+int top_counter_cmp(const void *a, const void *b);
+void print_distinct_bands(struct outbuf *ob, const char *title, const char *count_label, const struct score_stats *stats, const struct distinct *distinct, const struct hll_table *table);
+void print_joint(const struct tally *tally, struct outbuf *ob);
+void print_joint_table(struct outbuf *ob, const struct joint_bin *pairs, size_t npairs, const int *cols, const uint64_t *col_totals, size_t ncols, int mode);
+void out_score_label(struct outbuf *ob, int score, int width);
+void print_thresholds(const struct tally *tally, struct outbuf *ob);
+void print_threshold_table(struct outbuf *ob, const struct score_stats *stats);
+void print_threshold_matrix(const struct tally *tally, struct outbuf *ob);
+void metrics_init(struct metrics *metrics);
+void parse_buckets_arg(const char *arg, struct metrics *metrics);
+void metrics_add(struct metrics *metrics, int score_in, int score_out);
+void metric_histogram_add(struct metric_histogram *hist, const int *bounds, int nbounds, int score);
+int metrics_listen(const char *addr);
+void metrics_start(struct metrics *metrics);
+void metrics_stop(struct metrics *metrics);
+void metrics_publish(const struct tally *tally);
+void *metrics_run(void *arg);
+void metrics_serve(struct metrics *metrics);
+void print_metrics(const struct metrics *metrics, struct outbuf *ob);
+void print_metric_histogram(struct outbuf *ob, const char *name, const char *help, const struct metrics *metrics, const struct metric_histogram *hist);
+int send_all(int fd, const char *buf, size_t len);
+void save_snapshot(const char *path, const struct tally *tally, const struct snapshot_source *source);
+void snapshot_put_histogram(struct outbuf *ob, const struct histogram *hist);
+void snapshot_put_joint(struct outbuf *ob, const struct joint_histogram *joint);
+int load_snapshot(const char *path, struct tally *tally, struct snapshot_source *source);
+int snapshot_get_histogram(const unsigned char **pp, const unsigned char *end, struct histogram *hist);
+int snapshot_get_joint(const unsigned char **pp, const unsigned char *end, struct joint_histogram *joint);
+int get_varint(const unsigned char **pp, const unsigned char *end, uint64_t *n);
+void out_varint(struct outbuf *ob, uint64_t n);
+uint32_t fnv1a(const unsigned char *p, size_t len);
+void print_stats (const struct tally *tally, const struct report_options *opts, struct outbuf *ob);
+void print_row_counts(struct outbuf *ob, uint64_t count, int count_width, uint64_t running_total, uint64_t scores_read, int64_t distinct);
+void print_percentiles(const struct score_stats *stats, const struct report_options *opts, struct outbuf *ob);
+void compute_stats(const struct histogram *hist, uint64_t scores_read, struct score_stats *stats);
+int stats_percentile(const struct score_stats *stats, unsigned long ppm);
+void free_stats(struct score_stats *stats);
+void parse_percentiles_arg(const char *arg, struct report_options *opts);
+int digit_width(uint64_t n);
+void outbuf_init(struct outbuf *ob, int fd);
+void outbuf_flush(struct outbuf *ob);
+void outbuf_free(struct outbuf *ob);
+char *outbuf_reserve(struct outbuf *ob, size_t n);
+void out_str(struct outbuf *ob, const char *s);
+void out_char(struct outbuf *ob, char c);
+void out_title(struct outbuf *ob, const char *title);
+void out_spaces(struct outbuf *ob, int n);
+void out_zeros(struct outbuf *ob, int n);
+void out_uint(struct outbuf *ob, uint64_t n, int width);
+void out_fixed(struct outbuf *ob, double value, int width, int places);
+
+int main(int argc, char *argv[])
 {
-	int score_count_in[MAX_SCORE+1] = {0},
-	    score_count_out[MAX_SCORE+1] = {0}, invalid_in = 0, invalid_out = 0,
-	    scores_read = 0;
+	struct tally tally;
+	struct window_ring ring;
+	struct metrics metrics;
+	struct report_options opts = { { 0 }, 0, { 0 }, 0, 0, GROUP_ORDER_MEAN };
+	struct tally *file_tallies = NULL;
+	struct outbuf ob;
+	struct profile prof;
+	glob_t globbed;
+	char **paths, title[64];
+	int use_block = 0, jobs = 1, format = FORMAT_SCORES, opt, i, fd;
+	int follow = 0, interval = FOLLOW_INTERVAL, joint = 0, merge = 0;
+	int per_file = 0, npaths, top = 0, distinct = 0;
+	int bands[MAX_BANDS], nbands = 0;
+	const char *save_path = NULL, *metrics_addr = NULL, *group_arg = NULL;
+	const char *state_path = NULL;
+	struct group_spec group_spec;
+
+	static const struct option long_opts[] = {
+		{ "block", no_argument, NULL, 'b' },
+		{ "jobs",  required_argument, NULL, 'j' },
+		{ "format", required_argument, NULL, 'F' },
+		{ "percentiles", required_argument, NULL, 'p' },
+		{ "follow", no_argument, NULL, 'f' },
+		{ "interval", required_argument, NULL, 'i' },
+		{ "windows", required_argument, NULL, 'w' },
+		{ "cross", no_argument, NULL, 'x' },
+		{ "save", required_argument, NULL, 'S' },
+		{ "merge", no_argument, NULL, 'M' },
+		{ "state", required_argument, NULL, 'C' },
+		{ "thresholds", no_argument, NULL, 'T' },
+		{ "metrics", required_argument, NULL, 'm' },
+		{ "buckets", required_argument, NULL, 'B' },
+		{ "per-file", no_argument, NULL, 'P' },
+		{ "group-by", required_argument, NULL, 'g' },
+		{ "group-order", required_argument, NULL, 'O' },
+		{ "top", required_argument, NULL, 'k' },
+		{ "distinct", no_argument, NULL, 'd' },
+		{ "bands", required_argument, NULL, 'D' },
+		{ "profile", no_argument, NULL, OPT_PROFILE },
+		{ "help",  no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	metrics_init(&metrics);
+
+	while ((opt = getopt_long(argc, argv, "B:bC:D:dF:fg:hi:j:k:m:MO:Pp:S:Tw:x", long_opts,
+	                          NULL)) != -1) {
+		switch (opt) {
+		case 'b':
+			use_block = 1;
+			break;
+		case 'j':
+			jobs = parse_jobs_arg(optarg);
+			break;
+		case 'F':
+			format = parse_format_arg(optarg);
+			break;
+		case 'p':
+			parse_percentiles_arg(optarg, &opts);
+			break;
+		case 'f':
+			follow = 1;
+			break;
+		case 'i':
+			interval = parse_interval_arg(optarg);
+			break;
+		case 'w':
+			parse_windows_arg(optarg, &opts);
+			break;
+		case 'x':
+			joint = 1;
+			break;
+		case 'S':
+			save_path = optarg;
+			break;
+		case 'M':
+			merge = 1;
+			break;
+		case 'C':
+			state_path = optarg;
+			break;
+		case 'T':
+			opts.thresholds = 1;
+			break;
+		case 'm':
+			metrics_addr = optarg;
+			follow = 1;
+			break;
+		case 'B':
+			parse_buckets_arg(optarg, &metrics);
+			break;
+		case 'P':
+			per_file = 1;
+			break;
+		case 'g':
+			group_arg = optarg;
+			break;
+		case 'O':
+			opts.group_order = parse_group_order_arg(optarg);
+			break;
+		case 'k':
+			top = parse_top_arg(optarg);
+			break;
+		case 'd':
+			distinct = 1;
+			break;
+		case 'D':
+			parse_bands_arg(optarg, bands, &nbands);
+			distinct = 1;
+			break;
+		case OPT_PROFILE:
+			profile_init(&prof);
+			profile = &prof;
+			break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (profile != NULL && follow) {
+		fprintf(stderr, "wafreport: --profile can't be used when following\n");
+		return 1;
+	}
+	if ((follow || opts.nwindows > 0) &&
+	    (merge || save_path != NULL || state_path != NULL)) {
+		fprintf(stderr, "wafreport: snapshots can't be followed or hold time windows\n");
+		return 1;
+	}
+	if ((group_arg != NULL || top > 0 || distinct) &&
+	    (merge || save_path != NULL || state_path != NULL)) {
+		fprintf(stderr, "wafreport: snapshots can't hold groups, top lists or distinct clients\n");
+		return 1;
+	}
+	if ((top > 0 || distinct) && format == FORMAT_SCORES) {
+		fprintf(stderr, "wafreport: top lists and distinct clients need log or json input (-F)\n");
+		return 1;
+	}
+	if (state_path != NULL && merge) {
+		fprintf(stderr, "wafreport: a state file can't be kept while merging snapshots\n");
+		return 1;
+	}
+	if (per_file && (follow || merge || save_path != NULL ||
+	                 state_path != NULL)) {
+		fprintf(stderr, "wafreport: per-file reports can't be followed or saved\n");
+		return 1;
+	}
+
+	/* Patterns are expanded here too, so that a quoted one can stand for
+	 * more files than fit on a command line. One that matches nothing is
+	 * kept as it is, and fails when it's opened */
+	memset(&globbed, 0, sizeof(globbed));
+	for (i = optind; i < argc; i++)
+		if (glob(argv[i], GLOB_NOCHECK | (i > optind ? GLOB_APPEND : 0),
+		         NULL, &globbed) == GLOB_NOSPACE) {
+			fprintf(stderr, "wafreport: %s: out of memory\n", argv[i]);
+			return 1;
+		}
+	paths = globbed.gl_pathv;
+	npaths = globbed.gl_pathc;
 
-	scores_read = read_in_scores(score_count_in, score_count_out,
-				     &invalid_in, &invalid_out);
+	if (state_path != NULL && npaths > 1) {
+		fprintf(stderr, "wafreport: a state file can only track one FILE\n");
+		return 1;
+	}
+
+	tally_init(&tally);
+	if (joint)
+		tally_enable_joint(&tally);
+	if (group_arg != NULL) {
+		parse_group_arg(group_arg, format, &group_spec);
+		tally_enable_groups(&tally, &group_spec);
+	}
+	if (top > 0)
+		tally_enable_top(&tally, top, format);
+	if (distinct)
+		tally_enable_distinct(&tally, bands, nbands, format);
+
+	if (per_file && npaths > 0) {
+		if ((file_tallies = calloc(npaths, sizeof(*file_tallies))) == NULL) {
+			perror("wafreport: calloc");
+			return 1;
+		}
+		for (i = 0; i < npaths; i++)
+			tally_init_like(&file_tallies[i], &tally);
+	}
+
+	/* Every line has to go through the ring in turn, so the windows are
+	 * filled on a single thread */
+	if (opts.nwindows > 0) {
+		window_ring_init(&ring, &opts);
+		tally.ring = &ring;
+		jobs = 1;
+	}
+
+	if (follow) {
+		if (npaths > 1) {
+			fprintf(stderr, "wafreport: only one FILE can be followed\n");
+			return 1;
+		}
+		if (metrics_addr != NULL) {
+			metrics.listen_fd = metrics_listen(metrics_addr);
+			tally.metrics = &metrics;
+			metrics_start(&metrics);
+		}
+		if (npaths == 0 || strcmp(paths[0], "-") == 0)
+			fd = STDIN_FILENO;
+		else if ((fd = open(paths[0], O_RDONLY)) < 0) {
+			fprintf(stderr, "wafreport: %s: %s\n", paths[0],
+			        strerror(errno));
+			return 1;
+		}
+		follow_scores(fd == STDIN_FILENO ? NULL : paths[0], fd, format,
+		              interval, &opts, &tally);
+		if (tally.metrics != NULL)
+			metrics_stop(&metrics);
+		if (tally.ring != NULL)
+			window_ring_free(tally.ring);
+		tally_free(&tally);
+		globfree(&globbed);
+		return 0;
+	}
+
+	profile_start(PROFILE_READ);
+	if (merge && npaths == 0)
+		load_snapshot("-", &tally, NULL);
+	else if (merge)
+		for (i = 0; i < npaths; i++)
+			load_snapshot(paths[i], &tally, NULL);
+	else if (state_path != NULL)
+		read_in_scores_state(state_path, npaths > 0 ? paths[0] : "-",
+		                     format, &tally);
+	else if (npaths > 0)
+		read_in_scores_files(paths, npaths, format, jobs, file_tallies,
+		                     &tally);
+	/* The legacy reader only understands uncompressed scores, and
+	 * doesn't fill the windows or groups */
+	else if (use_block || format != FORMAT_SCORES || tally.ring != NULL ||
+	         tally.groups != NULL ||
+	         fd_compression(STDIN_FILENO) != COMPRESS_NONE)
+		read_in_scores_block(STDIN_FILENO, "-", format, &tally);
+	else
+		read_in_scores(&tally);
+	profile_stop(PROFILE_READ);
+
+	if (save_path != NULL) {
+		profile_start(PROFILE_WRITE);
+		save_snapshot(save_path, &tally, NULL);
+		profile_stop(PROFILE_WRITE);
+		if (profile != NULL)
+			print_profile(profile, &tally);
+		tally_free(&tally);
+		globfree(&globbed);
+		return 0;
+	}
 
-	print_stats(score_count_in, score_count_out, invalid_in, invalid_out,
-		    scores_read);
+	/* The whole report is rendered into one buffer and written at once,
+	 * after a report for each file if they were asked for */
+	outbuf_init(&ob, STDOUT_FILENO);
+	profile_start(PROFILE_RENDER);
+	if (file_tallies != NULL) {
+		for (i = 0; i < npaths; i++) {
+			out_title(&ob, paths[i]);
+			print_report(&file_tallies[i], &opts, &ob);
+			out_str(&ob, "\n\n\n");
+			tally_free(&file_tallies[i]);
+		}
+		free(file_tallies);
+		snprintf(title, sizeof(title), "All %d files", npaths);
+		out_title(&ob, title);
+	}
+	print_report(&tally, &opts, &ob);
+	profile_stop(PROFILE_RENDER);
+	profile_start(PROFILE_WRITE);
+	outbuf_flush(&ob);
+	profile_stop(PROFILE_WRITE);
+	outbuf_free(&ob);
+	if (profile != NULL)
+		print_profile(profile, &tally);
+	if (tally.ring != NULL)
+		window_ring_free(tally.ring);
+	tally_free(&tally);
+	globfree(&globbed);
 
 	return 0;
 }
 
 
 /******************************************************************************
- * read_in_scores: Reads in lines of anomaly score totals. Stores inbound     *
- *                 score info in an array of int values pointed to by the     *
- *                 first argument, outbound score info in an array pointed to *
- *                 by the second argument, and the number of invalid scores   *
- *                 seen in int values pointed to by the third and fourth      *
- *                 arguments, for inbound and outbound scores, respectively.  *
- *                 Returns the total number of valid score lines read, as an  *
- *                 int value                                                  * 
+ * usage: Prints a short summary of the command line options to stderr        *
+ ******************************************************************************/
+void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [OPTION]... [FILE]...\n", prog);
+	fprintf(stderr, "Read \"INBOUND OUTBOUND\" anomaly score lines from the FILEs (or stdin)\n");
+	fprintf(stderr, "and print a report. Regular files are memory-mapped and parsed in place;\n");
+	fprintf(stderr, "gzip and zstd input is decompressed on the fly.\n\n");
+	fprintf(stderr, "  -b, --block   parse stdin in large blocks (fast path)\n");
+	fprintf(stderr, "  -j, --jobs N  read the FILEs with N threads (0 = one per CPU)\n");
+	fprintf(stderr, "  -P, --per-file\n");
+	fprintf(stderr, "                print a report for each FILE before the combined one\n");
+	fprintf(stderr, "  -g, --group-by FIELDS\n");
+	fprintf(stderr, "                also report per group of lines, keyed by these fields\n");
+	fprintf(stderr, "                (numbers, negative from the end; key names for json)\n");
+	fprintf(stderr, "  -O, --group-order ORDER\n");
+	fprintf(stderr, "                sort the group summary by inbound mean (default) or p99\n");
+	fprintf(stderr, "  -k, --top K   also list the K heaviest clients and URIs by requests and\n");
+	fprintf(stderr, "                by inbound score (log and json input)\n");
+	fprintf(stderr, "  -d, --distinct\n");
+	fprintf(stderr, "                also estimate the distinct clients with each score (log\n");
+	fprintf(stderr, "                and json input)\n");
+	fprintf(stderr, "  -D, --bands LIST\n");
+	fprintf(stderr, "                estimate them per score band instead, given by the lower\n");
+	fprintf(stderr, "                bounds of the bands, e.g. 5,10,25 (implies -d)\n");
+	fprintf(stderr, "  -F, --format FORMAT\n");
+	fprintf(stderr, "                input format: scores (default), log (access log lines\n");
+	fprintf(stderr, "                ending in the inbound and outbound scores) or json (JSON\n");
+	fprintf(stderr, "                audit log records, one per line)\n");
+	fprintf(stderr, "  -p, --percentiles LIST\n");
+	fprintf(stderr, "                also print these percentiles, e.g. 50,90,95,99,99.9\n");
+	fprintf(stderr, "  -f, --follow  keep reading FILE (or stdin) as it grows, like tail -F,\n");
+	fprintf(stderr, "                across log rotation, and print a fresh report every interval\n");
+	fprintf(stderr, "  -i, --interval SECS\n");
+	fprintf(stderr, "                seconds between reports when following (default %d)\n", FOLLOW_INTERVAL);
+	fprintf(stderr, "  -w, --windows LIST\n");
+	fprintf(stderr, "                also report on the most recent scores over these windows\n");
+	fprintf(stderr, "                of time, e.g. 1m,5m,1h\n");
+	fprintf(stderr, "  -x, --cross   also cross-tabulate the inbound and outbound scores\n");
+	fprintf(stderr, "  -T, --thresholds\n");
+	fprintf(stderr, "                also print the block rate for every candidate threshold\n");
+	fprintf(stderr, "  -m, --metrics ADDR\n");
+	fprintf(stderr, "                follow FILE (or stdin) and serve the score histograms as\n");
+	fprintf(stderr, "                OpenMetrics over HTTP on [HOST:]PORT or a Unix socket PATH\n");
+	fprintf(stderr, "  -B, --buckets LIST\n");
+	fprintf(stderr, "                metrics histogram bucket bounds (default %s)\n", DEFAULT_BUCKETS);
+	fprintf(stderr, "  -S, --save SNAPSHOT\n");
+	fprintf(stderr, "                write a binary snapshot of the counts instead of a report\n");
+	fprintf(stderr, "  -M, --merge   the FILEs (or stdin) are snapshots to add together\n");
+	fprintf(stderr, "  -C, --state STATE\n");
+	fprintf(stderr, "                resume from the counts and offset kept in STATE, parse\n");
+	fprintf(stderr, "                only the lines appended to FILE since, and update STATE\n");
+	fprintf(stderr, "      --profile write the time, CPU cycles and cache misses of each phase,\n");
+	fprintf(stderr, "                the throughput and the peak memory use to stderr\n");
+	fprintf(stderr, "  -h, --help    display this help and exit\n");
+}
+
+
+/******************************************************************************
+ * parse_jobs_arg: Converts the argument of the -j option to a number of      *
+ *                 threads, where 0 means one thread per online CPU. Exits    *
+ *                 with an error message if the argument isn't a non-negative *
+ *                 number                                                     *
+ ******************************************************************************/
+int parse_jobs_arg(const char *arg)
+{
+	char *end;
+	long jobs;
+
+	errno = 0;
+	jobs = strtol(arg, &end, 10);
+	if (errno != 0 || end == arg || *end != '\0' || jobs < 0 ||
+	    jobs > MAX_JOBS) {
+		fprintf(stderr, "wafreport: invalid number of jobs: %s\n", arg);
+		exit(EXIT_FAILURE);
+	}
+
+	if (jobs == 0 && (jobs = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		jobs = 1;
+
+	return jobs;
+}
+
+
+/******************************************************************************
+ * parse_interval_arg: Converts the argument of the -i option to a number of  *
+ *                     seconds between reports. Exits with an error message   *
+ *                     if the argument isn't a positive number                *
+ ******************************************************************************/
+int parse_interval_arg(const char *arg)
+{
+	char *end;
+	long interval;
+
+	errno = 0;
+	interval = strtol(arg, &end, 10);
+	if (errno != 0 || end == arg || *end != '\0' || interval < 1 ||
+	    interval > INT_MAX / 1000) {
+		fprintf(stderr, "wafreport: invalid interval: %s\n", arg);
+		exit(EXIT_FAILURE);
+	}
+
+	return interval;
+}
+
+
+/******************************************************************************
+ * parse_format_arg: Converts the argument of the -F option to an input       *
+ *                   format. Exits with an error message if the format isn't  *
+ *                   known                                                    *
+ ******************************************************************************/
+int parse_format_arg(const char *arg)
+{
+	if (strcmp(arg, "scores") == 0)
+		return FORMAT_SCORES;
+	if (strcmp(arg, "log") == 0)
+		return FORMAT_LOG;
+	if (strcmp(arg, "json") == 0)
+		return FORMAT_JSON;
+
+	fprintf(stderr, "wafreport: unknown input format: %s\n", arg);
+	exit(EXIT_FAILURE);
+}
+
+
+/******************************************************************************
+ * parse_group_arg: Converts the argument of the -g option, a comma-separated *
+ *                  list of up to MAX_GROUP_FIELDS fields, into the group     *
+ *                  spec pointed to by the third argument, for the input      *
+ *                  format given by the second argument. For JSON records the *
+ *                  fields are key names, matched by suffix and ignoring case *
+ *                  like the score keys (e.g. host or http_code); for other   *
+ *                  lines they are field numbers, counting from 1 at the      *
+ *                  start of the line or from -1 at its end. Exits with an    *
+ *                  error message if the list can't be interpreted            *
+ ******************************************************************************/
+void parse_group_arg(const char *arg, int format, struct group_spec *spec)
+{
+	const char *p = arg, *start;
+	char *end;
+	long n;
+	size_t i;
+
+	spec->nfields = 0;
+	spec->format = format;
+
+	do {
+		if (spec->nfields == MAX_GROUP_FIELDS) {
+			fprintf(stderr, "wafreport: at most %d fields can make up a group key\n",
+				MAX_GROUP_FIELDS);
+			exit(EXIT_FAILURE);
+		}
+
+		if (format == FORMAT_JSON) {
+			for (start = p; *p != ',' && *p != '\0'; p++)
+				;
+			if (p == start || p - start >= GROUP_NAME_MAX)
+				goto invalid;
+			for (i = 0; start + i < p; i++)
+				spec->names[spec->nfields][i] =
+					tolower((unsigned char) start[i]);
+			spec->names[spec->nfields][i] = '\0';
+		} else {
+			errno = 0;
+			n = strtol(p, &end, 10);
+			if (errno != 0 || end == p || n == 0 || n < INT_MIN ||
+			    n > INT_MAX || (*end != ',' && *end != '\0'))
+				goto invalid;
+			spec->fields[spec->nfields] = n;
+			p = end;
+		}
+		spec->nfields++;
+	} while (*p++ == ',');
+
+	return;
+
+invalid:
+	fprintf(stderr, "wafreport: invalid group fields: %s\n", arg);
+	exit(EXIT_FAILURE);
+}
+
+
+/******************************************************************************
+ * parse_group_order_arg: Converts the argument of the -O option to the order *
+ *                        of the group summary. Exits with an error message   *
+ *                        if the order isn't recognised                       *
+ ******************************************************************************/
+int parse_group_order_arg(const char *arg)
+{
+	if (strcmp(arg, "mean") == 0)
+		return GROUP_ORDER_MEAN;
+	if (strcmp(arg, "p99") == 0)
+		return GROUP_ORDER_P99;
+
+	fprintf(stderr, "wafreport: unknown group order: %s\n", arg);
+	exit(EXIT_FAILURE);
+}
+
+
+/******************************************************************************
+ * parse_top_arg: Converts the argument of the -k option to the number of     *
+ *                heaviest clients and URIs to list. Exits with an error      *
+ *                message if the argument isn't a number from 1 to MAX_TOP    *
+ ******************************************************************************/
+int parse_top_arg(const char *arg)
+{
+	char *end;
+	long k;
+
+	errno = 0;
+	k = strtol(arg, &end, 10);
+	if (errno != 0 || end == arg || *end != '\0' || k < 1 || k > MAX_TOP) {
+		fprintf(stderr, "wafreport: invalid number of top entries: %s\n",
+		        arg);
+		exit(EXIT_FAILURE);
+	}
+
+	return k;
+}
+
+
+/******************************************************************************
+ * parse_bands_arg: Converts the argument of the -D option, a comma-separated *
+ *                  list of the lower bounds of score bands in ascending      *
+ *                  order, into the array pointed to by the second argument,  *
+ *                  storing the number of bands in the int value pointed to   *
+ *                  by the third. A band starting at 0 is added in front if   *
+ *                  the list doesn't start with one. Exits with an error      *
+ *                  message if the list can't be interpreted                  *
+ ******************************************************************************/
+void parse_bands_arg(const char *arg, int *bands, int *nbands)
+{
+	const char *p = arg;
+	char *end;
+	long bound;
+
+	bands[0] = 0;
+	*nbands = 1;
+
+	do {
+		errno = 0;
+		bound = strtol(p, &end, 10);
+		if (errno != 0 || end == p || bound < 0 || bound > INT_MAX ||
+		    (*end != ',' && *end != '\0') ||
+		    (*nbands > 1 && bound <= bands[*nbands - 1]))
+			goto invalid;
+		p = end;
+
+		if (bound == 0)
+			continue;
+		if (*nbands == MAX_BANDS) {
+			fprintf(stderr, "wafreport: at most %d score bands can be given\n",
+				MAX_BANDS);
+			exit(EXIT_FAILURE);
+		}
+		bands[(*nbands)++] = bound;
+	} while (*p++ == ',');
+
+	return;
+
+invalid:
+	fprintf(stderr, "wafreport: invalid score bands: %s\n", arg);
+	exit(EXIT_FAILURE);
+}
+
+
+/******************************************************************************
+ * parse_percentiles_arg: Converts the argument of the -p option, a           *
+ *                        comma-separated list of percentiles between 0 and   *
+ *                        100 with up to four decimal places, to parts per    *
+ *                        million, appending them to the report options       *
+ *                        pointed to by the second argument. Exits with an    *
+ *                        error message if the list can't be interpreted      *
+ ******************************************************************************/
+void parse_percentiles_arg(const char *arg, struct report_options *opts)
+{
+	const char *p = arg;
+	unsigned long ppm, scale;
+
+	do {
+		if (!IS_DIGIT(*p))
+			goto invalid;
+
+		/* Whole percent */
+		for (ppm = 0; IS_DIGIT(*p) && ppm <= 100; p++)
+			ppm = ppm * 10 + (*p - '0');
+		ppm *= 10000;
+
+		/* Fractions of a percent, down to a millionth of the whole */
+		if (*p == '.') {
+			for (p++, scale = 1000; IS_DIGIT(*p) && scale > 0;
+			     p++, scale /= 10)
+				ppm += (*p - '0') * scale;
+		}
+
+		if ((*p != ',' && *p != '\0') || ppm == 0 || ppm > 1000000)
+			goto invalid;
+
+		if (opts->npercentiles == MAX_PERCENTILES) {
+			fprintf(stderr, "wafreport: at most %d percentiles can be printed\n",
+				MAX_PERCENTILES);
+			exit(EXIT_FAILURE);
+		}
+		opts->percentiles[opts->npercentiles++] = ppm;
+	} while (*p++ == ',');
+
+	return;
+
+invalid:
+	fprintf(stderr, "wafreport: invalid percentile list: %s\n", arg);
+	exit(EXIT_FAILURE);
+}
+
+
+/******************************************************************************
+ * parse_windows_arg: Converts the argument of the -w option, a               *
+ *                    comma-separated list of lengths of time, each a number  *
+ *                    of seconds optionally followed by a unit of s, m, h or  *
+ *                    d (e.g. 90s, 5m, 1h), to seconds, appending them to the *
+ *                    report options pointed to by the second argument. Exits *
+ *                    with an error message if the list can't be interpreted  *
+ ******************************************************************************/
+void parse_windows_arg(const char *arg, struct report_options *opts)
+{
+	const char *p = arg;
+	long seconds;
+
+	do {
+		if (!IS_DIGIT(*p))
+			goto invalid;
+
+		for (seconds = 0; IS_DIGIT(*p) && seconds <= MAX_WINDOW; p++)
+			seconds = seconds * 10 + (*p - '0');
+
+		switch (*p) {
+		case 'd':
+			seconds *= 24;
+			/* Fall through */
+		case 'h':
+			seconds *= 60;
+			/* Fall through */
+		case 'm':
+			seconds *= 60;
+			/* Fall through */
+		case 's':
+			p++;
+			break;
+		}
+
+		if ((*p != ',' && *p != '\0') || seconds < 1 ||
+		    seconds > MAX_WINDOW)
+			goto invalid;
+
+		if (opts->nwindows == MAX_WINDOWS) {
+			fprintf(stderr, "wafreport: at most %d windows can be reported\n",
+				MAX_WINDOWS);
+			exit(EXIT_FAILURE);
+		}
+		opts->windows[opts->nwindows++] = seconds;
+	} while (*p++ == ',');
+
+	return;
+
+invalid:
+	fprintf(stderr, "wafreport: invalid window list: %s\n", arg);
+	exit(EXIT_FAILURE);
+}
+
+
+/******************************************************************************
+ * read_in_scores: Reads in lines of anomaly score totals from stdin,         *
+ *                 counting the inbound and outbound scores seen, and the     *
+ *                 number of valid score lines read, in the tally pointed to  *
+ *                 by the argument                                            *
  ******************************************************************************/
-int read_in_scores(int *score_count_in, int *score_count_out, int *invalid_in,
-                   int *invalid_out)
+void read_in_scores(struct tally *tally)
 {
-	int score_in, score_out, count = 0;
-	char line_buf[24];
+	int score_in, score_out;
+	char *line = NULL;
+	const char *rest;
+	size_t size = 0;
+	ssize_t len;
+
+	/* Read in whole lines continuously, until we get EOF (or a read
+	 * error), so that long lines aren't split into extra records */
+	while ((len = getline(&line, &size, stdin)) != -1) {
+		if (profile != NULL)
+			tally->bytes_read += len;
 
-	/* Read in lines continuously, until we get EOF (or a read error) */
-	while (fgets(line_buf, sizeof(line_buf), stdin) != NULL) {
 		/* Try (the expected) line format: 123 456 */
-		if (sscanf(line_buf, "%d%d", &score_in, &score_out) == 2) {
+		if (scan_int(line, &rest, &score_in) &&
+		    scan_int(rest, &rest, &score_out)) {
 			;
 
 		/* Try line format: 123 - */
-		} else if (sscanf(line_buf, "%d", &score_in) == 1) {
+		} else if (scan_int(line, &rest, &score_in)) {
 			/* No outbound score, so mark it as invalid */
 			score_out = -1;
 
 		/* Try line format: - 123 */
-		} else if (sscanf(line_buf, "-%d", &score_out) == 1) {
+		} else if (line[0] == '-' &&
+		           scan_int(line + 1, &rest, &score_out)) {
 			/* No inbound score, so mark it as invalid */
 			score_in = -1;
 
@@ -100,210 +1491,6090 @@ int read_in_scores(int *score_count_in, int *score_count_out, int *invalid_in,
 			continue;
 		}
 
-
-		/* Store the inbound anomaly score that's been seen */
-		if (score_in < 0)
-			(*invalid_in)++;
-		else if (score_in > MAX_SCORE)
-			score_count_in[MAX_SCORE]++;
-		else
-			score_count_in[score_in]++;
-
-		/* Store the outbound anomaly score that's been seen */
-		if (score_out < 0)
-			(*invalid_out)++;
-		else if (score_out > MAX_SCORE)
-			score_count_out[MAX_SCORE]++;
-		else
-			score_count_out[score_out]++;
-
-		count++;
+		tally_add(tally, score_in, score_out);
 	}
 
-	return count;
+	free(line);
 }
 
 
 /******************************************************************************
- * print_stats: Prints statistics based on arrays of score counts, invalid    *
- *              score counts, and the number of scores read, all of which     *
- *              must be provided as arguments                                 *
+ * scan_int: Helper function for read_in_scores() which converts the decimal  *
+ *           integer at the start of the string given by the first argument   *
+ *           like the scanf() %d conversion, but saturating at INT_MAX (and   *
+ *           -INT_MAX) as parse_int() does instead of overflowing. On         *
+ *           success, stores the value in the int pointed to by the third     *
+ *           argument and the position past its digits in the value pointed  *
+ *           to by the second argument, and returns 1, otherwise returns 0    *
  ******************************************************************************/
-void print_stats (const int *score_count_in, const int *score_count_out,
-                  int invalid_in, int invalid_out, int scores_read)
+int scan_int(const char *p, const char **rest, int *value)
 {
-	int i, dig_width_in, dig_width_out, dig_width_scores, running_total;
-	double cumulative;
-
+	char *end;
+	long n;
 
-	/* How many digits in the largest inbound score recorded? */
-	for (i = MAX_SCORE; i > 0; i--)
-		if (score_count_in[i] != 0)
-			break;
-	dig_width_in = digit_width(i);
-
-	/* How many digits in the largest outbound score recorded? */
-	for (i = MAX_SCORE; i > 0; i--)
-		if (score_count_out[i] != 0)
-			break;
-	dig_width_out = digit_width(i);
+	while (IS_SPACE(*p))
+		p++;
+	if (!IS_DIGIT(*p) && !((*p == '-' || *p == '+') && IS_DIGIT(p[1])))
+		return 0;
 
-	/* How many digits in the number of records counted? */
-	dig_width_scores = digit_width(scores_read);
+	n = strtol(p, &end, 10);
+	if (n > INT_MAX)
+		n = INT_MAX;
+	else if (n < -INT_MAX)
+		n = -INT_MAX;
 
+	*value = (int) n;
+	*rest = end;
+	return 1;
+}
 
 
-	/* Print stats on the inbound requests */
-	running_total = invalid_in;
-	printf("Inbound (Requests)\n");
-	printf("------------------%*s# of req. | %% of req. | Cumulative | Outstanding\n",
-		dig_width_in + dig_width_scores + 7, " ");
-	printf("%*sTotal number of requests | %d | 100.0000%% | 100.0000%%  |   0.0000%%\n\n",
-		dig_width_in + 7, " ",
-		scores_read);
-
-	cumulative = 100 * ((double) running_total / scores_read);
-	printf("Empty or invalid inbound score %*s| %*d | %8.4f%% | %8.4f%%  | %8.4f%%\n",
-		dig_width_in + 1, " ",
-		dig_width_scores, invalid_in,
-		100 * ((double) invalid_in / scores_read),
-		cumulative,
-		100 - cumulative);
-
-	/* Print out the non-empty inbound scores from the score count array */
-	for (i = 0; i <= MAX_SCORE; i++)
-		if (score_count_in[i] != 0) {
-			running_total += score_count_in[i];
-			cumulative = 100 * ((double) running_total / scores_read);
-			printf("Requests with inbound score of %*d | %*d | %8.4f%% | %8.4f%%  | %8.4f%%\n",
-				dig_width_in, i,
-				dig_width_scores, score_count_in[i],
-				100 * ((double) score_count_in[i] / scores_read),
-				cumulative,
-				100 - cumulative);
-		}
-	putchar('\n');
-
-	/* Calculate and print averages */
-	printf("Mean: %.2f    ", avg_mean(score_count_in, scores_read));
-	printf("Median: %.2f\n", avg_median(score_count_in, scores_read));
-
-	putchar('\n');
-	putchar('\n');
-	putchar('\n');
+/******************************************************************************
+ * read_in_scores_block: Block-buffered alternative to read_in_scores().      *
+ *                       Reads the file descriptor given by the first         *
+ *                       argument, named by the second argument in any error  *
+ *                       message, in READ_BLOCK_SIZE chunks with a            *
+ *                       line_reader until end of file, interpreting the      *
+ *                       lines according to the input format given by the     *
+ *                       third argument and counting the scores in the tally  *
+ *                       pointed to by the fourth argument. Input starting    *
+ *                       with the magic number of a gzip or zstd stream is    *
+ *                       decompressed on the way in                           *
+ ******************************************************************************/
+void read_in_scores_block(int fd, const char *name, int format,
+                          struct tally *tally)
+{
+	struct line_reader lr;
+	ssize_t n;
+	int kind;
 
+	line_reader_init(&lr, format);
 
+	/* Look at the start of the input for a magic number */
+	if ((n = read_full(fd, lr.buf, COMPRESS_MAGIC_LEN)) < 0) {
+		fprintf(stderr, "wafreport: %s: %s\n", name, strerror(errno));
+		n = 0;
+	}
+	if ((kind = compression_of(lr.buf, n)) != COMPRESS_NONE) {
+		decompress_scores(name, kind, fd, lr.buf, n, &lr, tally);
+		line_reader_finish(&lr, tally);
+		line_reader_free(&lr);
+		return;
+	}
+	if (n > 0)
+		line_reader_consume(&lr, n, tally);
 
-	/* Print stats on the outbound responses */
-	running_total = invalid_out;
-	printf("Outbound (Responses)\n");
-	printf("--------------------%*s# of res. | %% of res. | Cumulative | Outstanding\n",
-		dig_width_out + dig_width_scores + 6, " ");
-	printf("%*sTotal number of responses | %d | 100.0000%% | 100.0000%%  |   0.0000%%\n\n",
-		dig_width_out + 7, " ",
-		scores_read);
+	while ((n = line_reader_fill(&lr, fd, tally)) != 0) {
+		if (n < 0 && errno != EINTR) {
+			perror("wafreport: read");
+			break;
+		}
+	}
 
-	cumulative = 100 * ((double) running_total / scores_read);
-	printf("Empty or invalid outbound score %*s| %*d | %8.4f%% | %8.4f%%  | %8.4f%%\n",
-		dig_width_out + 1, " ",
-		dig_width_scores, invalid_out,
-		100 * ((double) invalid_out / scores_read),
-		cumulative,
-		100 - cumulative);
+	/* Input which doesn't end with a newline still has a final line */
+	line_reader_finish(&lr, tally);
+	line_reader_free(&lr);
+}
 
-	/* Print out the non-empty outbound scores from the score count array */
-	for (i = 0; i <= MAX_SCORE; i++)
-		if (score_count_out[i] != 0) {
-			running_total += score_count_out[i];
-			cumulative = 100 * ((double) running_total / scores_read);
-			printf("Responses with inbound score of %*d | %*d | %8.4f%% | %8.4f%%  | %8.4f%%\n",
-				dig_width_out, i,
-				dig_width_scores, score_count_out[i],
-				100 * ((double) score_count_out[i] / scores_read),
-				cumulative,
-				100 - cumulative);
-		}
-	putchar('\n');
 
-	/* Calculate and print averages */
-	printf("Mean: %.2f    ", avg_mean(score_count_out, scores_read));
-	printf("Median: %.2f\n", avg_median(score_count_out, scores_read));
+/******************************************************************************
+ * line_reader_init: Prepares the line reader pointed to by the first         *
+ *                   argument for reading lines in the input format given by  *
+ *                   the second argument. Exits on failure                    *
+ ******************************************************************************/
+void line_reader_init(struct line_reader *lr, int format)
+{
+	if ((lr->buf = malloc(READ_BLOCK_SIZE)) == NULL) {
+		perror("wafreport: malloc");
+		exit(EXIT_FAILURE);
+	}
+	lr->carry = 0;
+	lr->skipping = 0;
+	lr->format = format;
 }
 
 
 /******************************************************************************
- * avg_mean: Take an array of scores and the number of scores read, and from  *
- *           that calculate and return the mean score                         *
+ * line_reader_fill: Makes one read(2) call on the file descriptor given by   *
+ *                   the second argument into the line reader pointed to by   *
+ *                   the first argument, and hands every line completed by it *
+ *                   to parse_scores(), counting the scores in the tally      *
+ *                   pointed to by the third argument. A trailing partial     *
+ *                   line is carried over to the next call. Returns the       *
+ *                   number of bytes read, 0 at end of file or -1 on error    *
+ *                   (with errno set, which may be EINTR)                     *
  ******************************************************************************/
-double avg_mean(const int *score_count_array, int scores_read)
+ssize_t line_reader_fill(struct line_reader *lr, int fd, struct tally *tally)
 {
-	int i;
-	double mean = 0.0;
+	ssize_t n;
 
-	for (i = 0; i <= MAX_SCORE; i++)
-		mean += i * score_count_array[i];
-	mean /= scores_read;
+	n = read(fd, lr->buf + lr->carry, READ_BLOCK_SIZE - lr->carry);
+	if (n > 0)
+		line_reader_consume(lr, n, tally);
 
-	return mean;
+	return n;
 }
 
 
 /******************************************************************************
- * avg_median: Take an array of scores and the number of scores read, and     *
- *             from that calculate and return the median score                *
+ * line_reader_consume: Takes the number of bytes given by the second         *
+ *                      argument, which have just been placed in the free     *
+ *                      space of the line reader pointed to by the first      *
+ *                      argument (after any carried-over partial line), and   *
+ *                      hands every line they complete to parse_scores(),     *
+ *                      counting the scores in the tally pointed to by the    *
+ *                      third argument. A trailing partial line is carried    *
+ *                      over, as for line_reader_fill()                       *
  ******************************************************************************/
-double avg_median(const int *score_count_array, int scores_read)
+void line_reader_consume(struct line_reader *lr, size_t n, struct tally *tally)
 {
-	int i, lower_value;
-	double median = 0.0;
+	char *buf = lr->buf, *eol;
+	size_t avail, end;
 
-	/* Median: case: odd number of elements */
-	if (scores_read % 2) {
-		for (i = 0; i <= MAX_SCORE; i++) {
-			median += score_count_array[i];
-			if (median >= (scores_read + 1) / 2)
-				break;
-		}
-		median = i;
-		return median;
+	avail = lr->carry + n;
 
-	/* Median: case: even number of elements - take an average */
-	} else {
-		for (i = 0; i <= MAX_SCORE; i++) {
-			median += score_count_array[i];
-			if (median >= scores_read / 2)
-				break;
+	/* Drop the rest of an overlong line whose start was parsed already */
+	if (lr->skipping) {
+		if ((eol = memchr(buf, '\n', avail)) == NULL) {
+			lr->carry = 0;
+			return;
 		}
-		lower_value = i;
+		avail -= eol + 1 - buf;
+		memmove(buf, eol + 1, avail);
+		lr->skipping = 0;
+	}
 
-		median = 0.0;
-		for (i = 0; i <= MAX_SCORE; i++) {
-			median += score_count_array[i];
-			if (median >= (scores_read / 2) + 1)
-				break;
-		}
-		median = (double) (lower_value + i) / 2;
-		return median;
+	/* Find the end of the last complete line in the block */
+	for (end = avail; end > 0; end--)
+		if (buf[end - 1] == '\n')
+			break;
+
+	if (end == 0 && avail == READ_BLOCK_SIZE) {
+		/* A single line fills the whole block: only its start can
+		 * hold the scores, so parse that and skip the rest */
+		parse_scores(buf, avail, lr->format, tally);
+		lr->skipping = 1;
+		lr->carry = 0;
+		return;
 	}
+
+	parse_scores(buf, end, lr->format, tally);
+
+	/* Move the trailing partial line to the front of the buffer */
+	memmove(buf, buf + end, avail - end);
+	lr->carry = avail - end;
 }
 
 
 /******************************************************************************
- * digit_width: Helper function which returns the number of digits required   *
- *              to display a given integer, as an int value                   *
+ * line_reader_finish: Parses the partial line left in the line reader        *
+ *                     pointed to by the first argument, if any, into the     *
+ *                     tally pointed to by the second argument. Only called   *
+ *                     once the input has really ended, since a partial line  *
+ *                     may otherwise still be being written                   *
  ******************************************************************************/
-int digit_width(int n)
+void line_reader_finish(struct line_reader *lr, struct tally *tally)
 {
-	int width = 1;
+	if (lr->carry > 0 && !lr->skipping)
+		parse_scores(lr->buf, lr->carry, lr->format, tally);
+	lr->carry = 0;
+	lr->skipping = 0;
+}
 
-	/* In case the argument is negative, for some reason, make positive */
-	if (n < 0)
-		n *= -1;
 
-	while (n > 9) {
-		n /= 10;
-		width++;
-	}
+/******************************************************************************
+ * line_reader_free: Frees the buffer of the line reader pointed to by the    *
+ *                   argument                                                 *
+ ******************************************************************************/
+void line_reader_free(struct line_reader *lr)
+{
+	free(lr->buf);
+	lr->buf = NULL;
+}
+
+
+/******************************************************************************
+ * follow_scores: Reads the scores from the file descriptor given by the      *
+ *                second argument like tail -F, in the input format given by  *
+ *                the third argument, counting them in the tally pointed to   *
+ *                by the last argument. A report using the options pointed to *
+ *                by the fifth argument is printed every interval given in    *
+ *                seconds by the fourth argument, whenever new scores have    *
+ *                been counted since the last one. When a regular file has    *
+ *                been read to its end, inotify(7) wakes the loop when it is  *
+ *                written to, or, if the file is named by the first argument  *
+ *                (NULL for stdin), when it is renamed or a file is created   *
+ *                in its place; without inotify it is polled every            *
+ *                FOLLOW_POLL_MS milliseconds. Either way, a file that has    *
+ *                been truncated is read again from the start, even when it   *
+ *                has since grown past where it was left (see                 *
+ *                follow_truncated()), and one that has been replaced is read *
+ *                to its end before switching to the new one (see             *
+ *                follow_rotation()). A pipe is waited on with poll(2) and    *
+ *                following ends when its writer goes away. SIGINT and        *
+ *                SIGTERM also end following. A final report is printed       *
+ *                before returning. When the tally has metrics, no reports    *
+ *                are printed; instead the counts are published for the       *
+ *                metrics thread to answer scrapes from as they are read, and *
+ *                it carries on after a pipe ends until a signal arrives. The *
+ *                file descriptor in use at the end is closed, unless it's    *
+ *                stdin                                                       *
+ ******************************************************************************/
+void follow_scores(const char *path, int fd, int format, int interval,
+                   const struct report_options *opts, struct tally *tally)
+{
+	struct line_reader lr;
+	struct outbuf ob;
+	struct stat st;
+	struct pollfd pfd[2];
+	struct sigaction sa;
+	char events[4096];
+	double now, next_refresh;
+	uint64_t reported = 0;
+	int regular, reports = 0, timeout_ms, wait_ms, nfds, at_eof = 0;
+	int serving = tally->metrics != NULL;
+	int input_done = 0, inotify_fd = -1, file_wd = -1, dir_wd = -1;
+	int in_pos = -1, inotify_pos = -1, eof_checked = 0;
+	uint32_t eof_check = 0;
+	ssize_t n;
+
+	/* No SA_RESTART, so that a signal interrupts a blocking read(2) or
+	 * poll(2) and the loop below notices it straight away */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = follow_stop_handler;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+	if (regular && (inotify_fd = inotify_init1(IN_NONBLOCK |
+	                                           IN_CLOEXEC)) >= 0)
+		file_wd = follow_watch(inotify_fd, fd, path, &dir_wd);
+	if (inotify_fd >= 0 && file_wd < 0) {
+		close(inotify_fd);
+		inotify_fd = -1;
+	}
+	line_reader_init(&lr, format);
+	outbuf_init(&ob, STDOUT_FILENO);
+	next_refresh = monotonic_seconds() + interval;
+
+	while (!follow_stop) {
+		now = monotonic_seconds();
+		timeout_ms = -1;
+		if (serving) {
+			metrics_publish(tally);
+		} else {
+			if (now >= next_refresh) {
+				if (tally->scores_read != reported ||
+				    reports == 0) {
+					print_follow_report(tally, opts,
+					                    reports++, &ob);
+					reported = tally->scores_read;
+				}
+				next_refresh = now + interval;
+			}
+
+			/* With nothing new to report, there's no need to
+			 * wake up until more input arrives */
+			if (tally->scores_read != reported || reports == 0)
+				timeout_ms = (int) ((next_refresh - now) *
+				                    1000) + 1;
+		}
+
+		/* Only read from a pipe once there is something to read, so
+		 * that a quiet writer can't hold up the refresh. A regular
+		 * file is read
+		 * straight away unless it was at its end last time, in which
+		 * case it's waited on with inotify, or polled without it */
+		nfds = 0;
+		in_pos = inotify_pos = -1;
+		if (!regular && !input_done) {
+			pfd[nfds].fd = fd;
+			pfd[nfds].events = POLLIN;
+			pfd[nfds].revents = 0;
+			in_pos = nfds++;
+		}
+		if (inotify_fd >= 0) {
+			pfd[nfds].fd = inotify_fd;
+			pfd[nfds].events = POLLIN;
+			pfd[nfds].revents = 0;
+			inotify_pos = nfds++;
+		}
+		wait_ms = timeout_ms;
+		if (regular && !at_eof)
+			wait_ms = 0;
+		else if (regular && inotify_fd < 0 &&
+		         (wait_ms < 0 || wait_ms > FOLLOW_POLL_MS))
+			wait_ms = FOLLOW_POLL_MS;
+
+		if (poll(nfds ? pfd : NULL, nfds, wait_ms) < 0)
+			continue;
+
+		/* The events only say that it's worth looking again, so they
+		 * are just drained */
+		if (inotify_pos >= 0 && (pfd[inotify_pos].revents & POLLIN)) {
+			while (read(inotify_fd, events, sizeof(events)) > 0)
+				;
+			at_eof = 0;
+		}
+		if (input_done || (in_pos >= 0 && pfd[in_pos].revents == 0))
+			continue;
+		if (regular && at_eof && inotify_fd >= 0)
+			continue;
+
+		/* Copytruncate followed by enough writes to grow the file past
+		 * where it was left leaves no trace in its size, so the bytes
+		 * before that point are checked first after every wait */
+		if (eof_checked) {
+			eof_checked = 0;
+			follow_truncated(path, fd, &lr, eof_check);
+		}
+
+		n = line_reader_fill(&lr, fd, tally);
+		at_eof = n == 0;
+		if (n > 0)
+			continue;
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("wafreport: read");
+			break;
+		}
+
+		/* End of input: a regular file may still grow, be truncated
+		 * or be replaced, but a pipe's writer has gone for good. The
+		 * metrics stay up */
+		if (regular) {
+			if (follow_rotation(path, &fd, &lr, tally, inotify_fd,
+			                    &file_wd)) {
+				at_eof = 0;
+			} else {
+				eof_check = state_check(fd, path ? path : "-",
+				                        lseek(fd, 0, SEEK_CUR));
+				eof_checked = 1;
+			}
+			if (inotify_fd >= 0 && file_wd < 0) {
+				close(inotify_fd);
+				inotify_fd = -1;
+			}
+			continue;
+		}
+		line_reader_finish(&lr, tally);
+		if (!serving)
+			break;
+		input_done = 1;
+	}
+
+	line_reader_finish(&lr, tally);
+	if (!serving && (tally->scores_read != reported || reports == 0))
+		print_follow_report(tally, opts, reports, &ob);
+
+	if (inotify_fd >= 0)
+		close(inotify_fd);
+	if (fd != STDIN_FILENO)
+		close(fd);
+	outbuf_free(&ob);
+	line_reader_free(&lr);
+}
+
+
+/******************************************************************************
+ * follow_watch: Adds inotify watches to the instance given by the first      *
+ *               argument for writes to the file open on the second argument, *
+ *               its being renamed or deleted and, if its name is given by    *
+ *               the third argument (else NULL), for files being created or   *
+ *               moved into its directory, storing that watch descriptor in   *
+ *               the int pointed to by the last argument. The file is watched *
+ *               through /proc/self/fd, so that it's the open file which is   *
+ *               watched even if the name has moved on. Returns the file's    *
+ *               watch descriptor, or -1 if it can't be watched               *
+ ******************************************************************************/
+int follow_watch(int inotify_fd, int fd, const char *path, int *dir_wd)
+{
+	char name[64], *dir;
+	const char *slash;
+	int wd;
+
+	snprintf(name, sizeof(name), "/proc/self/fd/%d", fd);
+	if ((wd = inotify_add_watch(inotify_fd, name, IN_MODIFY |
+	                            IN_MOVE_SELF | IN_DELETE_SELF)) < 0 &&
+	    path != NULL)
+		wd = inotify_add_watch(inotify_fd, path, IN_MODIFY |
+		                       IN_MOVE_SELF | IN_DELETE_SELF);
+
+	if (path == NULL || *dir_wd >= 0)
+		return wd;
+
+	if ((slash = strrchr(path, '/')) == NULL) {
+		*dir_wd = inotify_add_watch(inotify_fd, ".",
+		                            IN_CREATE | IN_MOVED_TO);
+		return wd;
+	}
+	if ((dir = strdup(path)) == NULL) {
+		perror("wafreport: strdup");
+		exit(EXIT_FAILURE);
+	}
+	dir[slash == path ? 1 : slash - path] = '\0';
+	*dir_wd = inotify_add_watch(inotify_fd, dir, IN_CREATE | IN_MOVED_TO);
+	free(dir);
+
+	return wd;
+}
+
+
+/******************************************************************************
+ * follow_rotation: Checks whether the followed file open on the file         *
+ *                  descriptor pointed to by the second argument, which has   *
+ *                  just been read to its end, has been rotated. If it has    *
+ *                  been truncated in place (copytruncate), any partial line  *
+ *                  is dropped and it's read again from the start. If the     *
+ *                  name given by the first argument (NULL for stdin) now     *
+ *                  belongs to another file (rename and create), the final    *
+ *                  line of the old one is counted in the tally pointed to by *
+ *                  the fourth argument and the new file is opened in its     *
+ *                  place, with the line reader pointed to by the third       *
+ *                  argument and the inotify watch whose descriptor is        *
+ *                  pointed to by the last argument moved over to it (if the  *
+ *                  inotify instance given by the fifth argument is open).    *
+ *                  Since the old file was drained first, no line is lost or  *
+ *                  counted twice. Returns 1 if the file was rotated, else 0  *
+ ******************************************************************************/
+int follow_rotation(const char *path, int *fd, struct line_reader *lr,
+                    struct tally *tally, int inotify_fd, int *file_wd)
+{
+	struct stat cur, st;
+	int new_fd, dir_wd = 0;	/* The directory is watched already */
+
+	if (fstat(*fd, &cur) < 0)
+		return 0;
+
+	if (lseek(*fd, 0, SEEK_CUR) > cur.st_size) {
+		lr->carry = 0;
+		lr->skipping = 0;
+		lseek(*fd, 0, SEEK_SET);
+		return 1;
+	}
+
+	if (path == NULL || stat(path, &st) < 0 ||
+	    (st.st_dev == cur.st_dev && st.st_ino == cur.st_ino) ||
+	    (new_fd = open(path, O_RDONLY)) < 0)
+		return 0;
+
+	line_reader_finish(lr, tally);
+	if (inotify_fd >= 0 && *file_wd >= 0)
+		inotify_rm_watch(inotify_fd, *file_wd);
+	close(*fd);
+	*fd = new_fd;
+	if (inotify_fd >= 0)
+		*file_wd = follow_watch(inotify_fd, new_fd, path, &dir_wd);
+
+	return 1;
+}
+
+
+/******************************************************************************
+ * follow_truncated: Checks whether the followed file open on the file        *
+ *                   descriptor given by the second argument, named by the    *
+ *                   first (NULL for stdin), has been truncated in place      *
+ *                   since it was last read to its end: if it's now shorter   *
+ *                   than the current offset, or the bytes before the offset  *
+ *                   no longer hash to the state_check() given by the last    *
+ *                   argument, as when it has been truncated and written past *
+ *                   that point again. If so, any partial line in the line    *
+ *                   reader pointed to by the third argument is dropped and   *
+ *                   the file is read again from the start. Returns 1 if the  *
+ *                   file was truncated, else 0                               *
+ ******************************************************************************/
+int follow_truncated(const char *path, int fd, struct line_reader *lr,
+                     uint32_t check)
+{
+	struct stat st;
+	off_t offset = lseek(fd, 0, SEEK_CUR);
+
+	if (offset < 0 || fstat(fd, &st) < 0 ||
+	    (offset <= st.st_size &&
+	     state_check(fd, path ? path : "-", offset) == check))
+		return 0;
+
+	lr->carry = 0;
+	lr->skipping = 0;
+	lseek(fd, 0, SEEK_SET);
+	return 1;
+}
+
+
+/******************************************************************************
+ * print_follow_report: Renders the report for the tally pointed to by the    *
+ *                      first argument, using the report options pointed to   *
+ *                      by the second, into the output buffer pointed to by   *
+ *                      the fourth argument and writes it out straight away.  *
+ *                      The number of reports printed before it, given by the *
+ *                      third argument, decides whether it is separated from  *
+ *                      the previous one                                      *
+ ******************************************************************************/
+void print_follow_report(const struct tally *tally,
+                         const struct report_options *opts, int reports,
+                         struct outbuf *ob)
+{
+	/* Without timestamps from the log, the windows end at the present
+	 * moment, so scores age out even while nothing new arrives */
+	if (tally->ring != NULL && tally->ring->clock_only &&
+	    tally->ring->head >= 0)
+		window_ring_advance(tally->ring, time(NULL) / tally->ring->tick);
+
+	if (reports > 0)
+		out_str(ob, "\n\n\n");
+	print_report(tally, opts, ob);
+	outbuf_flush(ob);
+}
+
+
+/******************************************************************************
+ * follow_stop_handler: Signal handler which asks follow_scores() to stop     *
+ *                      following and print its final report                  *
+ ******************************************************************************/
+void follow_stop_handler(int sig)
+{
+	(void) sig;
+	follow_stop = 1;
+}
+
+
+/******************************************************************************
+ * monotonic_seconds: Returns the time of the monotonic clock in seconds      *
+ ******************************************************************************/
+double monotonic_seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/******************************************************************************
+ * profile_init: Sets up the profile pointed to by the argument, with the     *
+ *               clock started and, where the kernel allows it, counters of   *
+ *               the CPU cycles and cache misses of this process and the      *
+ *               threads it goes on to start                                  *
+ ******************************************************************************/
+void profile_init(struct profile *prof)
+{
+	memset(prof, 0, sizeof(*prof));
+	prof->start = monotonic_seconds();
+	prof->counter_fds[0] = perf_counter_open(PERF_COUNT_HW_CPU_CYCLES);
+	prof->counter_fds[1] = perf_counter_open(PERF_COUNT_HW_CACHE_MISSES);
+	if (prof->counter_fds[0] < 0)
+		prof->counter_errno = errno;
+}
+
+
+/******************************************************************************
+ * profile_start: Marks the start of the phase given by the argument in the   *
+ *                profile being kept, if there is one                         *
+ ******************************************************************************/
+void profile_start(int phase)
+{
+	struct profile_phase *p;
+	int c;
+
+	if (profile == NULL)
+		return;
+
+	p = &profile->phases[phase];
+	p->started = monotonic_seconds();
+	for (c = 0; c < PROFILE_COUNTERS; c++)
+		p->counters_started[c] =
+			perf_counter_read(profile->counter_fds[c]);
+}
+
+
+/******************************************************************************
+ * profile_stop: Marks the end of the phase given by the argument in the      *
+ *               profile being kept, if there is one, adding the time and     *
+ *               counts since its start to the phase's totals                 *
+ ******************************************************************************/
+void profile_stop(int phase)
+{
+	struct profile_phase *p;
+	int c;
+
+	if (profile == NULL)
+		return;
+
+	p = &profile->phases[phase];
+	p->seconds += monotonic_seconds() - p->started;
+	for (c = 0; c < PROFILE_COUNTERS; c++)
+		p->counters[c] += perf_counter_read(profile->counter_fds[c]) -
+		                  p->counters_started[c];
+}
+
+
+/******************************************************************************
+ * perf_counter_open: Returns a file descriptor counting the hardware event   *
+ *                    given by the argument in user space, for this process   *
+ *                    and the threads it starts later, or -1 (with errno set) *
+ *                    if perf_event_open(2) isn't allowed or supported        *
+ ******************************************************************************/
+int perf_counter_open(uint64_t config)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = config;
+	attr.inherit = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1,
+	               PERF_FLAG_FD_CLOEXEC);
+}
+
+
+/******************************************************************************
+ * perf_counter_read: Returns the count of the counter open on the file       *
+ *                    descriptor given by the argument, or 0 if it isn't open *
+ *                    or can't be read. The counts of threads are included    *
+ *                    once they have exited                                   *
+ ******************************************************************************/
+uint64_t perf_counter_read(int fd)
+{
+	uint64_t count;
+
+	if (fd < 0 || read(fd, &count, sizeof(count)) != sizeof(count))
+		return 0;
+
+	return count;
+}
+
+
+/******************************************************************************
+ * print_profile: Writes the profile pointed to by the first argument to      *
+ *                stderr: the seconds, cycles and cache misses of each phase  *
+ *                and of the whole run, the bytes and score lines parsed into *
+ *                the tally pointed to by the second argument and how fast,   *
+ *                and the peak resident set size. Rendering is shown without  *
+ *                the statistics worked out during it                         *
+ ******************************************************************************/
+void print_profile(const struct profile *prof, const struct tally *tally)
+{
+	static const char *const names[PROFILE_PHASES] = {
+		"read", "stats", "render", "write"
+	};
+	struct profile_phase phases[PROFILE_PHASES + 1], *p;
+	double read_secs = prof->phases[PROFILE_READ].seconds;
+	struct rusage usage;
+	struct outbuf ob;
+	int i, c;
+
+	memcpy(phases, prof->phases, sizeof(prof->phases));
+	phases[PROFILE_RENDER].seconds -= phases[PROFILE_STATS].seconds;
+	for (c = 0; c < PROFILE_COUNTERS; c++)
+		phases[PROFILE_RENDER].counters[c] -=
+			phases[PROFILE_STATS].counters[c];
+
+	/* The run as a whole, counted from the start of the profile */
+	p = &phases[PROFILE_PHASES];
+	p->seconds = monotonic_seconds() - prof->start;
+	for (c = 0; c < PROFILE_COUNTERS; c++)
+		p->counters[c] = perf_counter_read(prof->counter_fds[c]);
+
+	outbuf_init(&ob, STDERR_FILENO);
+	out_str(&ob, "\n");
+	out_title(&ob, "Profile");
+	out_str(&ob, "Phase       Seconds           Cycles     Cache misses\n");
+	for (i = 0; i <= PROFILE_PHASES; i++) {
+		out_str(&ob, i < PROFILE_PHASES ? names[i] : "total");
+		out_spaces(&ob, 7 - strlen(i < PROFILE_PHASES ? names[i] :
+		                            "total"));
+		out_fixed(&ob, phases[i].seconds, 12, 6);
+		for (c = 0; c < PROFILE_COUNTERS; c++) {
+			out_char(&ob, ' ');
+			if (prof->counter_fds[c] >= 0)
+				out_uint(&ob, phases[i].counters[c], 16);
+			else {
+				out_spaces(&ob, 15);
+				out_char(&ob, '-');
+			}
+		}
+		out_char(&ob, '\n');
+	}
+	if (prof->counter_fds[0] < 0) {
+		out_str(&ob, "(no hardware counters: perf_event_open: ");
+		out_str(&ob, strerror(prof->counter_errno));
+		out_str(&ob, ")\n");
+	}
+
+	out_str(&ob, "\nBytes parsed: ");
+	out_uint(&ob, tally->bytes_read, 0);
+	out_str(&ob, "\nScore lines:  ");
+	out_uint(&ob, tally->scores_read, 0);
+	if (read_secs > 0) {
+		out_str(&ob, "\nRead speed:   ");
+		out_fixed(&ob, tally->bytes_read / read_secs / 1e6, 0, 2);
+		out_str(&ob, " MB/s, ");
+		out_uint(&ob, (uint64_t) (tally->scores_read / read_secs), 0);
+		out_str(&ob, " lines/s");
+	}
+	if (getrusage(RUSAGE_SELF, &usage) == 0) {
+		out_str(&ob, "\nPeak RSS:     ");
+		out_uint(&ob, usage.ru_maxrss, 0);
+		out_str(&ob, " KB");
+	}
+	out_char(&ob, '\n');
+
+	outbuf_flush(&ob);
+	outbuf_free(&ob);
+}
+
+
+/******************************************************************************
+ * read_in_scores_state: Reads in the anomaly scores appended to the file     *
+ *                       named by the second argument ("-" for stdin), in the *
+ *                       input format given by the third argument, since the  *
+ *                       state file named by the first argument was saved,    *
+ *                       then saves it again. The counts in the state file    *
+ *                       are loaded into the tally pointed to by the last     *
+ *                       argument first, and parsing starts where they left   *
+ *                       off, unless the file has been replaced or truncated  *
+ *                       since, in which case it's read from the start. Exits *
+ *                       on failure                                           *
+ ******************************************************************************/
+void read_in_scores_state(const char *state_path, const char *path,
+                          int format, struct tally *tally)
+{
+	struct snapshot_source source;
+	struct stat st;
+	int fd;
+
+	if (strcmp(path, "-") == 0)
+		fd = STDIN_FILENO;
+	else if ((fd = open(path, O_RDONLY)) < 0) {
+		fprintf(stderr, "wafreport: %s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if (fstat(fd, &st) < 0) {
+		fprintf(stderr, "wafreport: %s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	/* Only a plain file can be picked up from part way through */
+	if (!S_ISREG(st.st_mode) || fd_compression(fd) != COMPRESS_NONE) {
+		fprintf(stderr, "wafreport: %s: a state file needs a regular, uncompressed file\n",
+		        path);
+		exit(EXIT_FAILURE);
+	}
+
+	source.offset = 0;
+	if (access(state_path, F_OK) == 0) {
+		if (!load_snapshot(state_path, tally, &source)) {
+			fprintf(stderr, "wafreport: %s: not a state file (saved with -S, not -C)\n",
+			        state_path);
+			exit(EXIT_FAILURE);
+		}
+
+		/* The bytes just before the offset are checked too, to catch a
+		 * file that has been truncated and grown again since */
+		if (source.dev != (uint64_t) st.st_dev ||
+		    source.ino != (uint64_t) st.st_ino ||
+		    source.offset > (uint64_t) st.st_size ||
+		    source.check != state_check(fd, path, source.offset)) {
+			fprintf(stderr, "wafreport: %s: replaced or truncated since %s was saved, reading it from the start\n",
+			        path, state_path);
+			tally_clear(tally);
+			source.offset = 0;
+		}
+	} else if (errno != ENOENT) {
+		fprintf(stderr, "wafreport: %s: %s\n", state_path,
+		        strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	source.offset = read_in_scores_tail(fd, path, format, source.offset,
+	                                    st.st_size, tally);
+	source.dev = st.st_dev;
+	source.ino = st.st_ino;
+	source.check = state_check(fd, path, source.offset);
+	if (fd != STDIN_FILENO)
+		close(fd);
+
+	save_state(state_path, tally, &source);
+}
+
+
+/******************************************************************************
+ * read_in_scores_tail: Parses the complete lines of the regular file open on *
+ *                      the first argument (named by the second, for error    *
+ *                      messages) from the offset given by the fourth         *
+ *                      argument up to the size given by the fifth, in the    *
+ *                      input format given by the third, into the tally       *
+ *                      pointed to by the last argument. The part is mapped   *
+ *                      into memory and parsed in place. Returns the offset   *
+ *                      just past the last line parsed. Exits on failure      *
+ ******************************************************************************/
+off_t read_in_scores_tail(int fd, const char *name, int format, off_t offset,
+                          off_t size, struct tally *tally)
+{
+	off_t start = offset - offset % sysconf(_SC_PAGESIZE);
+	const char *map, *p, *last;
+
+	if (offset >= size)
+		return offset;
+
+	/* Mappings have to start on a page boundary */
+	map = mmap(NULL, size - start, PROT_READ, MAP_PRIVATE, fd, start);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "wafreport: %s: %s\n", name, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	madvise((void *) map, size - start, MADV_SEQUENTIAL);
+
+	/* A last line without a newline may still be being written, so it's
+	 * left for the next run */
+	p = map + (offset - start);
+	for (last = map + (size - start); last > p && last[-1] != '\n'; last--)
+		;
+	if (last > p) {
+		parse_scores(p, last - p, format, tally);
+		offset += last - p;
+	}
+
+	munmap((void *) map, size - start);
+	return offset;
+}
+
+
+/******************************************************************************
+ * state_check: Returns the FNV-1a hash of the STATE_CHECK_LEN bytes (or as   *
+ *              many as there are) before the offset given by the third       *
+ *              argument in the file open on the first argument, named by the *
+ *              second for error messages. Exits on failure                   *
+ ******************************************************************************/
+uint32_t state_check(int fd, const char *name, off_t offset)
+{
+	unsigned char buf[STATE_CHECK_LEN];
+	size_t len = offset < STATE_CHECK_LEN ? offset : STATE_CHECK_LEN;
+	ssize_t n;
+
+	while ((n = pread(fd, buf, len, offset - len)) < 0 && errno == EINTR)
+		;
+	if (n < 0) {
+		fprintf(stderr, "wafreport: %s: %s\n", name, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	return fnv1a(buf, n);
+}
+
+
+/******************************************************************************
+ * read_in_scores_files: Reads in the anomaly scores held in the files named  *
+ *                       in the array given by the first argument, of the     *
+ *                       length given by the second, as the input format      *
+ *                       given by the third argument and using up to the      *
+ *                       number of threads given by the fourth argument. The  *
+ *                       scores are counted in the tally pointed to by the    *
+ *                       sixth argument and, unless the fifth argument is     *
+ *                       NULL, also in the element of the array of tallies it *
+ *                       points to that matches each file. Regular files are  *
+ *                       mapped into memory with mmap(2) and parsed in place; *
+ *                       anything else (pipes, terminals, "-" for stdin) is   *
+ *                       read with read_in_scores_block(). Files compressed   *
+ *                       with gzip or zstd are decompressed as they are       *
+ *                       parsed. Exits on failure to open a file              *
+ *                                                                            *
+ *                       With more than one thread, the files are cut into    *
+ *                       tasks (newline-aligned slices of about               *
+ *                       FILE_TASK_SIZE bytes, or whole files where they have *
+ *                       to be read from start to end), which are dealt out   *
+ *                       largest first to the threads' queues. A thread that  *
+ *                       runs out of tasks steals from the others, so one big *
+ *                       file among many small ones doesn't leave the other   *
+ *                       cores idle                                           *
+ ******************************************************************************/
+void read_in_scores_files(char **paths, int npaths, int format, int jobs,
+                          struct tally *file_tallies, struct tally *tally)
+{
+	struct file_sched sched;
+	struct sched_file *file;
+	struct sched_worker *worker;
+	struct file_task *tasks = NULL;
+	size_t ntasks = 0, tasks_size = 0;
+	int i, nworkers;
+
+	if ((sched.files = calloc(npaths, sizeof(*sched.files))) == NULL) {
+		perror("wafreport: calloc");
+		exit(EXIT_FAILURE);
+	}
+	sched.nfiles = npaths;
+	sched.format = format;
+
+	for (i = 0; i < npaths; i++) {
+		file = &sched.files[i];
+		file->path = paths[i];
+		file->tally = file_tallies != NULL ? &file_tallies[i] : NULL;
+		pthread_mutex_init(&file->lock, NULL);
+		sched_plan_file(&sched, i, jobs > 1, &tasks, &ntasks,
+		                &tasks_size);
+	}
+
+	/* With a single thread the files are read in the order given, which
+	 * keeps the time windows filling from oldest to newest */
+	nworkers = (size_t) jobs < ntasks ? jobs : (int) ntasks;
+	if (nworkers < 1)
+		nworkers = 1;
+	if (nworkers > 1)
+		qsort(tasks, ntasks, sizeof(*tasks), file_task_cmp);
+
+	if ((worker = calloc(nworkers, sizeof(*worker))) == NULL) {
+		perror("wafreport: calloc");
+		exit(EXIT_FAILURE);
+	}
+	sched.workers = worker;
+	sched.nworkers = nworkers;
+
+	/* Deal the tasks round the queues like cards, so each thread starts
+	 * with its share of the big ones and the small ones */
+	for (i = 0; i < nworkers; i++) {
+		worker[i].sched = &sched;
+		worker[i].part_file = -1;
+		if ((worker[i].tasks = malloc((ntasks / nworkers + 1) *
+		                              sizeof(*worker[i].tasks))) == NULL) {
+			perror("wafreport: malloc");
+			exit(EXIT_FAILURE);
+		}
+		pthread_mutex_init(&worker[i].lock, NULL);
+	}
+	for (i = 0; (size_t) i < ntasks; i++) {
+		struct sched_worker *w = &worker[i % nworkers];
+		w->tasks[w->bottom++] = tasks[i];
+	}
+	free(tasks);
+
+	/* This thread is the first worker, counting straight into the
+	 * caller's tally; the others get a private tally each */
+	worker[0].tally = tally;
+	for (i = 1; i < nworkers; i++) {
+		if ((worker[i].tally = malloc(sizeof(struct tally))) == NULL) {
+			perror("wafreport: malloc");
+			exit(EXIT_FAILURE);
+		}
+		tally_init_like(worker[i].tally, tally);
+		worker[i].started = pthread_create(&worker[i].thread, NULL,
+		                                   sched_worker_run,
+		                                   &worker[i]) == 0;
+	}
+
+	/* The tasks of any thread which couldn't be started are stolen by
+	 * those that were, or failing that, by this one */
+	sched_worker_run(&worker[0]);
+
+	for (i = 1; i < nworkers; i++) {
+		if (worker[i].started)
+			pthread_join(worker[i].thread, NULL);
+		tally_merge(tally, worker[i].tally);
+		tally_free(worker[i].tally);
+		free(worker[i].tally);
+	}
+
+	for (i = 0; i < nworkers; i++) {
+		pthread_mutex_destroy(&worker[i].lock);
+		free(worker[i].tasks);
+	}
+	for (i = 0; i < npaths; i++) {
+		file = &sched.files[i];
+		if (file->map != NULL)
+			munmap(file->map, file->map_len);
+		pthread_mutex_destroy(&file->lock);
+	}
+	free(worker);
+	free(sched.files);
+}
+
+
+/******************************************************************************
+ * sched_plan_file: Opens the file with the index given by the second         *
+ *                  argument in the file scheduler pointed to by the first    *
+ *                  argument, maps it into memory if it can, and appends the  *
+ *                  tasks it takes to read it to the growing array pointed to *
+ *                  by the fourth argument, whose length and allocated size   *
+ *                  are pointed to by the fifth and sixth. A mapped,          *
+ *                  uncompressed file is split into slices if the third       *
+ *                  argument is non-zero; anything else is a single task.     *
+ *                  Exits on failure to open the file                         *
+ ******************************************************************************/
+void sched_plan_file(struct file_sched *sched, int index, int split,
+                     struct file_task **tasks, size_t *ntasks,
+                     size_t *tasks_size)
+{
+	struct sched_file *file = &sched->files[index];
+	struct file_task task;
+	struct stat st;
+	const char *start, *cut, *end;
+	void *map = MAP_FAILED;
+
+	file->fd = -1;
+	task.file = index;
+	task.buf = NULL;
+	task.len = 0;
+
+	if (strcmp(file->path, "-") == 0) {
+		file->fd = STDIN_FILENO;
+	} else {
+		if ((file->fd = open(file->path, O_RDONLY)) < 0 ||
+		    fstat(file->fd, &st) < 0) {
+			fprintf(stderr, "wafreport: %s: %s\n", file->path,
+			        strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+
+		/* Nothing to map, or to read, in an empty file */
+		if (S_ISREG(st.st_mode) && st.st_size == 0) {
+			close(file->fd);
+			file->fd = -1;
+			return;
+		}
+
+		if (S_ISREG(st.st_mode)) {
+			task.len = st.st_size;
+			map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+			           file->fd, 0);
+		}
+	}
+
+	/* Not a regular file, or it couldn't be mapped: it's read instead */
+	if (map == MAP_FAILED) {
+		sched_add_task(tasks, ntasks, tasks_size, &task);
+		return;
+	}
+	close(file->fd);
+	file->fd = -1;
+	file->map = map;
+	file->map_len = st.st_size;
+
+	/* The file is parsed front to back exactly once, so ask for
+	 * aggressive read-ahead (a hint only, so failure doesn't matter) */
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	/* A compressed stream can't be cut into slices, so it's inflated
+	 * from start to end by a single task */
+	task.buf = map;
+	if ((file->compression = compression_of(map, st.st_size)) !=
+	    COMPRESS_NONE || !split) {
+		sched_add_task(tasks, ntasks, tasks_size, &task);
+		return;
+	}
+
+	/* Cut the mapping into slices, moving each cut forward to just past
+	 * the next newline so no line is split in two */
+	end = (const char *) map + st.st_size;
+	for (start = map; start < end; start = cut) {
+		if ((size_t) (end - start) <= FILE_TASK_SIZE ||
+		    (cut = memchr(start + FILE_TASK_SIZE, '\n',
+		                  end - start - FILE_TASK_SIZE)) == NULL)
+			cut = end;
+		else
+			cut++;
+		task.buf = start;
+		task.len = cut - start;
+		sched_add_task(tasks, ntasks, tasks_size, &task);
+	}
+}
+
+
+/******************************************************************************
+ * sched_add_task: Helper function which appends the task pointed to by the   *
+ *                 fourth argument to the growing array pointed to by the     *
+ *                 first argument, whose length and allocated size are        *
+ *                 pointed to by the second and third. Exits on failure to    *
+ *                 allocate memory                                            *
+ ******************************************************************************/
+void sched_add_task(struct file_task **tasks, size_t *ntasks,
+                    size_t *tasks_size, const struct file_task *task)
+{
+	struct file_task *grown;
+
+	if (*ntasks == *tasks_size) {
+		*tasks_size = *tasks_size ? *tasks_size * 2 : 64;
+		if ((grown = realloc(*tasks, *tasks_size * sizeof(**tasks))) ==
+		    NULL) {
+			perror("wafreport: realloc");
+			exit(EXIT_FAILURE);
+		}
+		*tasks = grown;
+	}
+	(*tasks)[(*ntasks)++] = *task;
+}
+
+
+/******************************************************************************
+ * file_task_cmp: qsort() comparison function which orders file tasks from    *
+ *                the largest to the smallest, and tasks of the same size by  *
+ *                file and position, so the order doesn't depend on qsort()   *
+ ******************************************************************************/
+int file_task_cmp(const void *a, const void *b)
+{
+	const struct file_task *x = a, *y = b;
+
+	if (x->len != y->len)
+		return x->len < y->len ? 1 : -1;
+	if (x->file != y->file)
+		return x->file < y->file ? -1 : 1;
+
+	return (x->buf > y->buf) - (x->buf < y->buf);
+}
+
+
+/******************************************************************************
+ * sched_worker_run: Thread entry point for read_in_scores_files(). Runs the  *
+ *                   tasks of the sched_worker structure pointed to by the    *
+ *                   argument, then those it can steal from the other         *
+ *                   workers, until there are none left anywhere              *
+ ******************************************************************************/
+void *sched_worker_run(void *arg)
+{
+	struct sched_worker *worker = arg;
+	struct file_task task;
+
+	while (sched_next_task(worker, &task))
+		sched_run_task(worker, &task);
+	sched_flush_part(worker);
+
+	return NULL;
+}
+
+
+/******************************************************************************
+ * sched_next_task: Takes the next task for the worker pointed to by the      *
+ *                  first argument and stores it in the file task pointed to  *
+ *                  by the second argument. The worker's own tasks come off   *
+ *                  the top of its queue, largest first; once they run out,   *
+ *                  tasks are stolen off the bottom of the other workers'     *
+ *                  queues, smallest first, so that a thief gets in the       *
+ *                  owner's way as little as possible. No tasks are added     *
+ *                  once the workers have started, so finding every queue     *
+ *                  empty means the work is done. Returns 1 if a task was     *
+ *                  taken, 0 if there are none left                           *
+ ******************************************************************************/
+int sched_next_task(struct sched_worker *worker, struct file_task *task)
+{
+	struct file_sched *sched = worker->sched;
+	struct sched_worker *victim;
+	int self = worker - sched->workers, found, i;
+
+	pthread_mutex_lock(&worker->lock);
+	if ((found = worker->top < worker->bottom))
+		*task = worker->tasks[worker->top++];
+	pthread_mutex_unlock(&worker->lock);
+
+	for (i = 1; !found && i < sched->nworkers; i++) {
+		victim = &sched->workers[(self + i) % sched->nworkers];
+		pthread_mutex_lock(&victim->lock);
+		if ((found = victim->top < victim->bottom))
+			*task = victim->tasks[--victim->bottom];
+		pthread_mutex_unlock(&victim->lock);
+	}
+
+	return found;
+}
+
+
+/******************************************************************************
+ * sched_run_task: Reads the input described by the file task pointed to by   *
+ *                 the second argument for the worker pointed to by the first *
+ *                 argument, counting its scores in the worker's tally or,    *
+ *                 for per-file reports, in the worker's part for the task's  *
+ *                 file                                                       *
+ ******************************************************************************/
+void sched_run_task(struct sched_worker *worker, const struct file_task *task)
+{
+	struct file_sched *sched = worker->sched;
+	struct sched_file *file = &sched->files[task->file];
+	struct tally *tally = worker->tally;
+	struct line_reader lr;
+
+	/* Slices of one file can be parsed by several threads at once, so
+	 * for a per-file report each thread counts its slices apart, and
+	 * only adds them to the file's tally when it moves on */
+	if (file->tally != NULL) {
+		if (worker->part_file != task->file) {
+			sched_flush_part(worker);
+			tally_init_like(&worker->part, tally);
+			worker->part.ring = tally->ring;
+			worker->part_file = task->file;
+		}
+		tally = &worker->part;
+	}
+
+	if (task->buf == NULL) {
+		read_in_scores_block(file->fd, file->path, sched->format, tally);
+		if (file->fd != STDIN_FILENO)
+			close(file->fd);
+	} else if (file->compression != COMPRESS_NONE) {
+		line_reader_init(&lr, sched->format);
+		decompress_scores(file->path, file->compression, -1,
+		                  task->buf, task->len, &lr, tally);
+		line_reader_finish(&lr, tally);
+		line_reader_free(&lr);
+	} else {
+		parse_scores(task->buf, task->len, sched->format, tally);
+	}
+}
+
+
+/******************************************************************************
+ * sched_flush_part: Adds the part of the worker pointed to by the argument,  *
+ *                   if it has one, to its file's tally, under the file's     *
+ *                   lock, and to the worker's own tally, and releases it     *
+ ******************************************************************************/
+void sched_flush_part(struct sched_worker *worker)
+{
+	struct sched_file *file;
+
+	if (worker->part_file < 0)
+		return;
+
+	file = &worker->sched->files[worker->part_file];
+	pthread_mutex_lock(&file->lock);
+	tally_merge(file->tally, &worker->part);
+	pthread_mutex_unlock(&file->lock);
+	tally_merge(worker->tally, &worker->part);
+	tally_free(&worker->part);
+	worker->part_file = -1;
+}
+
+
+/******************************************************************************
+ * compression_of: Returns the compression of the data pointed to by the      *
+ *                 first argument, of the length given by the second, as      *
+ *                 told by the magic number at its start                      *
+ ******************************************************************************/
+int compression_of(const char *p, size_t len)
+{
+	if (len >= 2 && memcmp(p, "\x1f\x8b", 2) == 0)
+		return COMPRESS_GZIP;
+	if (len >= 4 && memcmp(p, "\x28\xb5\x2f\xfd", 4) == 0)
+		return COMPRESS_ZSTD;
+
+	return COMPRESS_NONE;
+}
+
+
+/******************************************************************************
+ * fd_compression: Returns the compression of the regular file open on the    *
+ *                 file descriptor given by the argument, from its current    *
+ *                 offset, without moving the offset. Anything else, which    *
+ *                 can't be looked at without consuming it, is reported as    *
+ *                 COMPRESS_NONE                                              *
+ ******************************************************************************/
+int fd_compression(int fd)
+{
+	char magic[COMPRESS_MAGIC_LEN];
+	struct stat st;
+	off_t offset;
+	ssize_t n;
+
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+	    (offset = lseek(fd, 0, SEEK_CUR)) < 0 ||
+	    (n = pread(fd, magic, sizeof(magic), offset)) < 0)
+		return COMPRESS_NONE;
+
+	return compression_of(magic, n);
+}
+
+
+/******************************************************************************
+ * decompress_scores: Decompresses the input named by the first argument,     *
+ *                    compressed as given by the second argument, into the    *
+ *                    line reader pointed to by the sixth argument, counting  *
+ *                    the scores in the tally pointed to by the seventh. The  *
+ *                    input starts with the data given by the fourth and      *
+ *                    fifth arguments and, unless the file descriptor given   *
+ *                    by the third argument is -1, goes on with whatever can  *
+ *                    be read from it. Errors in the compressed data are      *
+ *                    reported, keeping the scores read up to that point      *
+ ******************************************************************************/
+void decompress_scores(const char *name, int kind, int fd, const char *data,
+                       size_t len, struct line_reader *lr,
+                       struct tally *tally)
+{
+	if (kind == COMPRESS_GZIP)
+		gunzip_scores(name, fd, data, len, lr, tally);
+	else
+		unzstd_scores(name, fd, data, len, lr, tally);
+}
+
+
+/******************************************************************************
+ * gunzip_scores: Does the work of decompress_scores() for gzip input with    *
+ *                zlib, one member after another, inflating straight into the *
+ *                free space of the line reader                               *
+ ******************************************************************************/
+void gunzip_scores(const char *name, int fd, const char *data, size_t len,
+                   struct line_reader *lr, struct tally *tally)
+{
+	z_stream z;
+	char *in = NULL;
+	size_t space, left, take;
+	ssize_t n;
+	int ret = Z_OK, more_output = 0;
+
+	memset(&z, 0, sizeof(z));
+	if (inflateInit2(&z, 15 + 32) != Z_OK) {
+		fprintf(stderr, "wafreport: %s: inflateInit2 failed\n", name);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Data still to come from the file descriptor goes through a
+	 * buffer of our own, since the line reader's is the output */
+	if (fd >= 0) {
+		if ((in = malloc(READ_BLOCK_SIZE)) == NULL) {
+			perror("wafreport: malloc");
+			exit(EXIT_FAILURE);
+		}
+		memcpy(in, data, len);
+		data = in;
+	}
+
+	/* avail_in is only a uInt, so a mapped file larger than that is fed
+	 * to inflate() INFLATE_CHUNK_MAX bytes at a time, with left counting
+	 * the bytes of data not fed to it yet */
+	left = len;
+
+	for (;;) {
+		if (z.avail_in == 0 && left > 0) {
+			take = left < INFLATE_CHUNK_MAX ? left : INFLATE_CHUNK_MAX;
+			z.next_in = (Bytef *) data;
+			z.avail_in = take;
+			data += take;
+			left -= take;
+		}
+
+		/* Only read more once the last output has all been taken */
+		if (z.avail_in == 0 && !more_output) {
+			if (fd < 0)
+				break;
+			n = read(fd, in, READ_BLOCK_SIZE);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0) {
+				fprintf(stderr, "wafreport: %s: %s\n", name,
+				        strerror(errno));
+				break;
+			}
+			if (n == 0)
+				break;
+			z.next_in = (Bytef *) in;
+			z.avail_in = n;
+		}
+
+		/* Concatenated gzip files carry on with another member */
+		if (ret == Z_STREAM_END) {
+			if (z.avail_in == 0) {
+				more_output = 0;
+				continue;
+			}
+			inflateReset(&z);
+		}
+
+		space = READ_BLOCK_SIZE - lr->carry;
+		z.next_out = (Bytef *) lr->buf + lr->carry;
+		z.avail_out = space;
+		ret = inflate(&z, Z_NO_FLUSH);
+		if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+			fprintf(stderr, "wafreport: %s: %s\n", name,
+			        z.msg ? z.msg : "corrupt gzip data");
+			break;
+		}
+		more_output = z.avail_out == 0;
+		if (space > z.avail_out)
+			line_reader_consume(lr, space - z.avail_out, tally);
+
+		/* No progress and nothing more to come: cut off mid-member */
+		if (ret == Z_BUF_ERROR && z.avail_in == 0 && left == 0 && fd < 0)
+			break;
+	}
+
+	if (ret != Z_STREAM_END && (ret == Z_OK || ret == Z_BUF_ERROR))
+		fprintf(stderr, "wafreport: %s: unexpected end of compressed data\n",
+		        name);
+
+	inflateEnd(&z);
+	free(in);
+}
+
+
+/******************************************************************************
+ * unzstd_scores: Does the work of decompress_scores() for zstd input, one    *
+ *                frame after another, decompressing straight into the free   *
+ *                space of the line reader. Only available when built with    *
+ *                libzstd (HAVE_ZSTD); otherwise the input is reported as     *
+ *                unsupported                                                 *
+ ******************************************************************************/
+void unzstd_scores(const char *name, int fd, const char *data, size_t len,
+                   struct line_reader *lr, struct tally *tally)
+{
+#ifdef HAVE_ZSTD
+	ZSTD_DStream *ds;
+	ZSTD_inBuffer zin;
+	ZSTD_outBuffer zout;
+	char *in = NULL;
+	size_t ret = 0;
+	ssize_t n;
+	int more_output = 0;
+
+	if ((ds = ZSTD_createDStream()) == NULL ||
+	    ZSTD_isError(ZSTD_initDStream(ds))) {
+		fprintf(stderr, "wafreport: %s: ZSTD_initDStream failed\n", name);
+		exit(EXIT_FAILURE);
+	}
+
+	if (fd >= 0) {
+		if ((in = malloc(READ_BLOCK_SIZE)) == NULL) {
+			perror("wafreport: malloc");
+			exit(EXIT_FAILURE);
+		}
+		memcpy(in, data, len);
+		data = in;
+	}
+	zin.src = data;
+	zin.size = len;
+	zin.pos = 0;
+
+	for (;;) {
+		if (zin.pos == zin.size && !more_output) {
+			if (fd < 0)
+				break;
+			n = read(fd, in, READ_BLOCK_SIZE);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0) {
+				fprintf(stderr, "wafreport: %s: %s\n", name,
+				        strerror(errno));
+				break;
+			}
+			if (n == 0)
+				break;
+			zin.src = in;
+			zin.size = n;
+			zin.pos = 0;
+		}
+
+		zout.dst = lr->buf + lr->carry;
+		zout.size = READ_BLOCK_SIZE - lr->carry;
+		zout.pos = 0;
+		ret = ZSTD_decompressStream(ds, &zout, &zin);
+		if (ZSTD_isError(ret)) {
+			fprintf(stderr, "wafreport: %s: %s\n", name,
+			        ZSTD_getErrorName(ret));
+			ret = 0;
+			break;
+		}
+		more_output = zout.pos == zout.size;
+		if (zout.pos > 0)
+			line_reader_consume(lr, zout.pos, tally);
+	}
+
+	/* A non-zero hint means a frame was left unfinished */
+	if (ret != 0)
+		fprintf(stderr, "wafreport: %s: unexpected end of compressed data\n",
+		        name);
+
+	ZSTD_freeDStream(ds);
+	free(in);
+#else
+	(void) fd;
+	(void) data;
+	(void) len;
+	(void) lr;
+	(void) tally;
+	fprintf(stderr, "wafreport: %s: zstd support not compiled in\n", name);
+#endif
+}
+
+
+/******************************************************************************
+ * read_full: Helper function which reads from the file descriptor given by   *
+ *            the first argument into the buffer pointed to by the second     *
+ *            argument until it holds the number of bytes given by the third  *
+ *            argument or the input ends, retrying short reads such as those  *
+ *            from a pipe. Returns the number of bytes read, or -1 on error   *
+ ******************************************************************************/
+ssize_t read_full(int fd, char *buf, size_t len)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < len) {
+		n = read(fd, buf + done, len - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		if (n == 0)
+			break;
+		done += n;
+	}
+
+	return done;
+}
+
+
+/******************************************************************************
+ * parse_scores: Parses every line in the buffer pointed to by the first      *
+ *               argument, of the length given by the second argument, as the *
+ *               input format given by the third argument, and counts the     *
+ *               scores found in the tally pointed to by the fourth argument. *
+ *               A final line without a trailing newline is parsed too. When  *
+ *               the tally has a ring of time windows, each line's scores go  *
+ *               into it at the time logged on the line, or failing that the  *
+ *               time the buffer was parsed                                   *
+ ******************************************************************************/
+void parse_scores(const char *buf, size_t len, int format, struct tally *tally)
+{
+	const char *p = buf, *end = buf + len, *eol;
+	int score_in, score_out, ok;
+	time_t now = 0, t;
+
+	if (tally->ring != NULL)
+		now = time(NULL);
+	tally->bytes_read += len;
+
+	while (p < end) {
+		if ((eol = memchr(p, '\n', end - p)) == NULL)
+			eol = end;
+
+		switch (format) {
+		case FORMAT_LOG:
+			ok = parse_log_line(p, eol, &score_in, &score_out);
+			break;
+		case FORMAT_JSON:
+			ok = parse_json_line(p, eol, &score_in, &score_out);
+			break;
+		default:
+			ok = parse_score_line(p, eol, &score_in, &score_out);
+			break;
+		}
+
+		if (ok) {
+			tally_add(tally, score_in, score_out);
+			if (tally->groups != NULL)
+				group_add(tally->groups, p, eol, score_in,
+				          score_out);
+			if (tally->top != NULL)
+				top_add(tally->top, p, eol, score_in);
+			if (tally->distinct != NULL)
+				distinct_add(tally->distinct, p, eol, score_in,
+				             score_out);
+			if (tally->ring != NULL) {
+				if (parse_line_time(p, eol, format, &t))
+					tally->ring->clock_only = 0;
+				else
+					t = now;
+				window_ring_add(tally->ring, t, score_in,
+				                score_out);
+			}
+		}
+
+		p = eol + 1;
+	}
+}
+
+
+/******************************************************************************
+ * parse_score_line: Single-pass equivalent of the three scan_int() tries in  *
+ *                   read_in_scores(). Parses the line running from the first *
+ *                   argument up to (but not including) the second argument   *
+ *                   in one of the forms "IN OUT", "IN -" or "- OUT", storing *
+ *                   the scores in the int values pointed to by the third and *
+ *                   fourth arguments (-1 when a score is missing). Returns 1 *
+ *                   if the line could be interpreted, else 0                 *
+ ******************************************************************************/
+int parse_score_line(const char *p, const char *end, int *score_in,
+                     int *score_out)
+{
+	const char *start = p;
+
+	/* Line format: 123 456, or 123 - (no outbound score) */
+	if (parse_int(&p, end, score_in)) {
+		if (!parse_int(&p, end, score_out))
+			*score_out = -1;
+		return 1;
+	}
+
+	/* Line format: - 123 (no inbound score). As with sscanf("-%d"), the
+	 * dash has to be the very first character of the line */
+	p = start + 1;
+	if (start < end && *start == '-' && parse_int(&p, end, score_out)) {
+		*score_in = -1;
+		return 1;
+	}
+
+	return 0;
+}
+
+
+/******************************************************************************
+ * parse_int: Parses an optionally signed decimal integer starting at the     *
+ *            position pointed to by the first argument, skipping leading     *
+ *            whitespace like the scanf() %d conversion. Values too large for *
+ *            an int saturate at INT_MAX instead of overflowing. On success,  *
+ *            stores the value, advances the position past the digits and     *
+ *            returns 1, otherwise returns 0                                  *
+ ******************************************************************************/
+int parse_int(const char **pp, const char *end, int *value)
+{
+	const char *p = *pp;
+	int negative = 0, n = 0;
+
+	while (p < end && IS_SPACE(*p))
+		p++;
+
+	if (p < end && (*p == '-' || *p == '+'))
+		negative = (*p++ == '-');
+
+	if (p == end || !IS_DIGIT(*p))
+		return 0;
+
+	do {
+		if (n > (INT_MAX - (*p - '0')) / 10)
+			n = INT_MAX;
+		else
+			n = n * 10 + (*p - '0');
+		p++;
+	} while (p < end && IS_DIGIT(*p));
+
+	*value = negative ? -n : n;
+	*pp = p;
+	return 1;
+}
+
+
+/******************************************************************************
+ * parse_log_line: Fast path for native access log lines which end in the     *
+ *                 inbound and outbound anomaly scores, as matched by the     *
+ *                 grep pre-filter in the usage notes. Rather than running a  *
+ *                 regex, looks backwards from the end of the line (the       *
+ *                 second argument) for the last two whitespace-separated     *
+ *                 fields, each of which must be a number or "-". Stores the  *
+ *                 scores and returns a value in the same way as              *
+ *                 parse_score_line()                                         *
+ ******************************************************************************/
+int parse_log_line(const char *p, const char *end, int *score_in,
+                   int *score_out)
+{
+	const char *out_start, *out_end, *in_start, *in_end;
+
+	/* Outbound score: the last field on the line */
+	for (out_end = end; out_end > p && IS_SPACE(out_end[-1]); out_end--)
+		;
+	for (out_start = out_end; out_start > p && !IS_SPACE(out_start[-1]);
+	     out_start--)
+		;
+
+	/* Inbound score: the field before it */
+	for (in_end = out_start; in_end > p && IS_SPACE(in_end[-1]); in_end--)
+		;
+	for (in_start = in_end; in_start > p && !IS_SPACE(in_start[-1]);
+	     in_start--)
+		;
+
+	if (in_start == in_end ||
+	    !parse_log_field(in_start, in_end, score_in) ||
+	    !parse_log_field(out_start, out_end, score_out))
+		return 0;
+
+	/* Both fields "-": no score present, so not a line we can
+	 * interpret (much as sscanf() can't make sense of "- -") */
+	if (in_end - in_start == 1 && *in_start == '-' &&
+	    out_end - out_start == 1 && *out_start == '-')
+		return 0;
+
+	return 1;
+}
+
+
+/******************************************************************************
+ * parse_log_field: Parses a single score field running from the first        *
+ *                  argument up to the second argument. Stores the number in  *
+ *                  the int value pointed to by the third argument, or -1 if  *
+ *                  the field is a lone "-". Returns 1 if the whole field     *
+ *                  could be interpreted, else 0                              *
+ ******************************************************************************/
+int parse_log_field(const char *p, const char *end, int *score)
+{
+	if (end - p == 1 && *p == '-') {
+		*score = -1;
+		return 1;
+	}
+
+	return parse_int(&p, end, score) && p == end;
+}
+
+
+/******************************************************************************
+ * parse_json_line: Pulls the anomaly scores out of a JSON audit log record   *
+ *                  held on a single line, running from the first argument up *
+ *                  to the second argument, without building any              *
+ *                  representation of the record. Hops from string to string  *
+ *                  with memchr(), and whenever a string turns out to be an   *
+ *                  object key ending in JSON_KEY_IN or JSON_KEY_OUT, parses  *
+ *                  the value that follows it (a number, or a string holding  *
+ *                  one). The value of a "message" or "data" key is searched  *
+ *                  for the texts of the CRS rules reporting the totals       *
+ *                  instead, as in stock ModSecurity records. The first score *
+ *                  found in each direction wins. Records with neither, e.g.  *
+ *                  logged for a score below the blocking threshold, hold no  *
+ *                  score. Stores the scores and returns a value in the same  *
+ *                  way as parse_score_line()                                 *
+ ******************************************************************************/
+int parse_json_line(const char *p, const char *end, int *score_in,
+                    int *score_out)
+{
+	const char *key, *q, *msg, *msg_end;
+	int found_in = 0, found_out = 0;
+
+	*score_in = *score_out = -1;
+
+	while (json_next_key(&p, end, &key, &q)) {
+		if (!found_in && key_has_suffix(key, q, JSON_KEY_IN))
+			found_in = parse_json_value(p, end, score_in);
+		else if (!found_out && key_has_suffix(key, q, JSON_KEY_OUT))
+			found_out = parse_json_value(p, end, score_out);
+		else if (((q - key == 7 && memcmp(key, "message", 7) == 0) ||
+		          (q - key == 4 && memcmp(key, "data", 4) == 0)) &&
+		         (msg = json_string(p, end, &msg_end)) != NULL) {
+			if (!found_in)
+				found_in = parse_json_message(msg, msg_end, 0,
+				                              score_in);
+			if (!found_out)
+				found_out = parse_json_message(msg, msg_end, 1,
+				                               score_out);
+		}
+
+		if (found_in && found_out)
+			break;
+	}
+
+	return found_in || found_out;
+}
+
+
+/******************************************************************************
+ * json_next_key: Finds the next object key in the JSON text running from the *
+ *                position pointed to by the first argument up to the second  *
+ *                argument. Hops from string to string with memchr(),         *
+ *                stepping over escaped quotes, until it finds one followed   *
+ *                by a colon. Stores the start and end of the key (without    *
+ *                its quotes) in the values pointed to by the third and       *
+ *                fourth arguments and moves the position to just past the    *
+ *                colon. Returns 1 if a key was found, else 0                 *
+ ******************************************************************************/
+int json_next_key(const char **pp, const char *end, const char **key,
+                  const char **key_end)
+{
+	const char *p = *pp, *q;
+
+	while (p < end && (q = memchr(p, '"', end - p)) != NULL) {
+		*key = ++q;
+		if ((q = json_string_end(q, end)) == NULL)
+			break;
+
+		/* Only a string followed by a colon is a key */
+		for (p = q + 1; p < end && IS_SPACE(*p); p++)
+			;
+		if (p == end || *p != ':')
+			continue;
+
+		*key_end = q;
+		*pp = p + 1;
+		return 1;
+	}
+
+	*pp = end;
+	return 0;
+}
+
+
+/******************************************************************************
+ * parse_json_value: Parses the JSON value starting at the first argument     *
+ *                   (just after the colon following its key) as an anomaly   *
+ *                   score, accepting a bare number or a number in a string.  *
+ *                   Stores the score in the int value pointed to by the      *
+ *                   third argument. Returns 1 if the value held a score,     *
+ *                   else 0 (e.g. for null or an empty string)                *
+ ******************************************************************************/
+int parse_json_value(const char *p, const char *end, int *score)
+{
+	int quoted;
+
+	while (p < end && IS_SPACE(*p))
+		p++;
+
+	if ((quoted = (p < end && *p == '"')))
+		p++;
+
+	/* parse_int() would skip whitespace inside a string too, which
+	 * isn't a number by JSON's rules, so insist on a sign or digit */
+	if (p == end || !(IS_DIGIT(*p) || *p == '-') ||
+	    !parse_int(&p, end, score))
+		return 0;
+
+	return !quoted || (p < end && *p == '"');
+}
+
+
+/******************************************************************************
+ * parse_json_message: Looks for the inbound (third argument 0) or outbound   *
+ *                     (1) anomaly score total reported by a CRS rule in the  *
+ *                     JSON string running from the first argument up to the  *
+ *                     second argument, storing it in the int value pointed   *
+ *                     to by the fourth argument. Returns 1 if a score was    *
+ *                     found, else 0                                          *
+ ******************************************************************************/
+int parse_json_message(const char *p, const char *end, int outbound,
+                       int *score)
+{
+	if (outbound)
+		return find_score_after(p, end, JSON_MSG_OUT, score) ||
+		       find_score_after(p, end, JSON_MSG_REPORT_OUT, score);
+
+	return find_score_after(p, end, JSON_MSG_IN, score) ||
+	       find_score_after(p, end, JSON_MSG_TOTAL_IN, score) ||
+	       find_score_after(p, end, JSON_MSG_REPORT_IN, score);
+}
+
+
+/******************************************************************************
+ * find_score_after: Helper function which looks for the text given by the    *
+ *                   third argument in the one running from the first         *
+ *                   argument up to the second argument, and parses the score *
+ *                   just after it into the int value pointed to by the       *
+ *                   fourth argument. Returns 1 if a score was found, else 0  *
+ ******************************************************************************/
+int find_score_after(const char *p, const char *end, const char *text,
+                     int *score)
+{
+	size_t len = strlen(text);
+
+	while ((size_t) (end - p) >= len &&
+	       (p = memchr(p, text[0], end - p - len + 1)) != NULL) {
+		if (memcmp(p, text, len) == 0) {
+			p += len;
+			return p < end && IS_DIGIT(*p) &&
+			       parse_int(&p, end, score);
+		}
+		p++;
+	}
+
+	return 0;
+}
+
+
+/******************************************************************************
+ * json_string: Returns the start of the JSON string value starting at the    *
+ *              first argument (just after the colon following its key),      *
+ *              inside its quotes, and stores the position of its closing     *
+ *              quote in the value pointed to by the third argument. Returns  *
+ *              NULL if the value isn't a string                              *
+ ******************************************************************************/
+const char *json_string(const char *p, const char *end, const char **str_end)
+{
+	while (p < end && IS_SPACE(*p))
+		p++;
+
+	if (p == end || *p != '"' ||
+	    (*str_end = json_string_end(++p, end)) == NULL)
+		return NULL;
+
+	return p;
+}
+
+
+/******************************************************************************
+ * json_string_end: Returns the closing quote of the JSON string whose        *
+ *                  contents start at the first argument, stepping over       *
+ *                  escaped quotes, or NULL if it isn't closed before the     *
+ *                  second argument                                           *
+ ******************************************************************************/
+const char *json_string_end(const char *p, const char *end)
+{
+	const char *q, *start = p;
+
+	for (; (q = memchr(p, '"', end - p)) != NULL; p = q + 1) {
+		for (p = q; p > start && p[-1] == '\\'; p--)
+			;
+		if ((q - p) % 2 == 0)
+			return q;
+	}
+
+	return NULL;
+}
+
+
+/******************************************************************************
+ * key_has_suffix: Helper function which returns 1 if the JSON key running    *
+ *                 from the first argument up to the second argument ends in  *
+ *                 the string given by the third argument, ignoring case,     *
+ *                 else 0                                                     *
+ ******************************************************************************/
+int key_has_suffix(const char *key, const char *key_end, const char *suffix)
+{
+	size_t len = strlen(suffix);
+
+	if ((size_t) (key_end - key) < len)
+		return 0;
+
+	for (key = key_end - len; *suffix != '\0'; key++, suffix++)
+		if (tolower((unsigned char) *key) != *suffix)
+			return 0;
+
+	return 1;
+}
+
+
+/******************************************************************************
+ * parse_line_time: Looks for the time at which the line running from the     *
+ *                  first argument up to the second argument was logged, in   *
+ *                  the input format given by the third argument: the first   *
+ *                  bracketed time on an access or error log line, or the     *
+ *                  value of a "time" or "time_stamp" key in a JSON record.   *
+ *                  Stores the time in the value pointed to by the fourth     *
+ *                  argument. Returns 1 if a time was found, else 0 (plain    *
+ *                  score lines never carry one)                              *
+ ******************************************************************************/
+int parse_line_time(const char *p, const char *end, int format, time_t *t)
+{
+	const char *key, *key_end;
+
+	switch (format) {
+	case FORMAT_LOG:
+		while (p < end && (p = memchr(p, '[', end - p)) != NULL)
+			if (parse_time(++p, end, t))
+				return 1;
+		return 0;
+	case FORMAT_JSON:
+		while (json_next_key(&p, end, &key, &key_end)) {
+			if ((key_end - key != 4 || memcmp(key, "time", 4) != 0) &&
+			    (key_end - key != 10 ||
+			     memcmp(key, "time_stamp", 10) != 0))
+				continue;
+			while (p < end && IS_SPACE(*p))
+				p++;
+			if (p < end && *p == '"' && parse_time(p + 1, end, t))
+				return 1;
+		}
+		return 0;
+	default:
+		return 0;
+	}
+}
+
+
+/******************************************************************************
+ * parse_time: Parses a time starting at the first argument, in either the    *
+ *             access log form "10/Oct/2000:13:55:36 -0700" or the error log  *
+ *             (and ctime()) form "Tue Oct 10 13:55:36.123456 2000", and      *
+ *             stores it as seconds since the epoch in the value pointed to   *
+ *             by the third argument. Times without a zone are taken to be    *
+ *             UTC, and fractions of a second are ignored. Returns 1 on       *
+ *             success, else 0                                                *
+ ******************************************************************************/
+int parse_time(const char *p, const char *end, time_t *t)
+{
+	int day, mon, year, secs, zone = 0;
+
+	if (p < end && IS_DIGIT(*p)) {
+		if (!parse_int(&p, end, &day) || !expect_char(&p, end, '/') ||
+		    (mon = parse_month(&p, end)) < 0 ||
+		    !expect_char(&p, end, '/') || !parse_int(&p, end, &year) ||
+		    !expect_char(&p, end, ':') || !parse_clock(&p, end, &secs))
+			return 0;
+
+		/* The zone is given as hours and minutes east of UTC */
+		while (p < end && IS_SPACE(*p))
+			p++;
+		if (p < end && (*p == '+' || *p == '-') &&
+		    parse_int(&p, end, &zone))
+			zone = zone / 100 * 3600 + zone % 100 * 60;
+		else
+			zone = 0;
+	} else {
+		/* Skip the day of the week */
+		while (p < end && isalpha((unsigned char) *p))
+			p++;
+		while (p < end && IS_SPACE(*p))
+			p++;
+		if ((mon = parse_month(&p, end)) < 0 ||
+		    !parse_int(&p, end, &day) || !parse_clock(&p, end, &secs) ||
+		    !parse_int(&p, end, &year))
+			return 0;
+	}
+
+	if (day < 1 || day > 31 || year < 1970 || year > 9999)
+		return 0;
+
+	*t = (time_t) (days_from_civil(year, mon + 1, day) * 86400 + secs -
+	               zone);
+	return 1;
+}
+
+
+/******************************************************************************
+ * parse_clock: Parses a time of day "HH:MM:SS", optionally followed by a     *
+ *              fraction of a second which is skipped, starting at the        *
+ *              position pointed to by the first argument. Stores the number  *
+ *              of seconds since midnight in the value pointed to by the      *
+ *              third argument and advances the position past it. Returns 1   *
+ *              on success, else 0                                            *
+ ******************************************************************************/
+int parse_clock(const char **pp, const char *end, int *secs)
+{
+	const char *p = *pp;
+	int hour, min, sec;
+
+	if (!parse_int(&p, end, &hour) || !expect_char(&p, end, ':') ||
+	    !parse_int(&p, end, &min) || !expect_char(&p, end, ':') ||
+	    !parse_int(&p, end, &sec) || hour < 0 || hour > 23 ||
+	    min < 0 || min > 59 || sec < 0 || sec > 60)
+		return 0;
+
+	if (p < end && *p == '.')
+		for (p++; p < end && IS_DIGIT(*p); p++)
+			;
+
+	*secs = hour * 3600 + min * 60 + sec;
+	*pp = p;
+	return 1;
+}
+
+
+/******************************************************************************
+ * parse_month: Parses the English abbreviation of a month, e.g. "Oct", at    *
+ *              the position pointed to by the first argument, advancing the  *
+ *              position past it. Returns the month from 0 to 11, or -1 if    *
+ *              there isn't one                                               *
+ ******************************************************************************/
+int parse_month(const char **pp, const char *end)
+{
+	static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+	int i;
+
+	if (end - *pp < 3)
+		return -1;
+
+	for (i = 0; i < 12; i++)
+		if (memcmp(*pp, months + i * 3, 3) == 0) {
+			*pp += 3;
+			return i;
+		}
+
+	return -1;
+}
+
+
+/******************************************************************************
+ * expect_char: Helper function which steps the position pointed to by the    *
+ *              first argument over the character given by the third          *
+ *              argument, returning 1 if it was there, else 0                 *
+ ******************************************************************************/
+int expect_char(const char **pp, const char *end, char c)
+{
+	if (*pp == end || **pp != c)
+		return 0;
+
+	(*pp)++;
+	return 1;
+}
+
+
+/******************************************************************************
+ * days_from_civil: Helper function which returns the number of days from     *
+ *                  1970-01-01 to the date given by the year, month (1 to 12) *
+ *                  and day, in the proleptic Gregorian calendar. Unlike      *
+ *                  mktime(), doesn't depend on the local time zone           *
+ ******************************************************************************/
+int64_t days_from_civil(int64_t y, int m, int d)
+{
+	int64_t era, yoe, doy, doe;
+
+	y -= m <= 2;
+	era = (y >= 0 ? y : y - 399) / 400;
+	yoe = y - era * 400;
+	doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+	return era * 146097 + doe - 719468;
+}
+
+
+/******************************************************************************
+ * tally_init: Prepares the tally pointed to by the argument for counting,    *
+ *             with no scores seen yet                                        *
+ ******************************************************************************/
+void tally_init(struct tally *tally)
+{
+	histogram_init(&tally->in);
+	histogram_init(&tally->out);
+	tally->scores_read = tally->bytes_read = 0;
+	tally->joint = NULL;
+	tally->ring = NULL;
+	tally->metrics = NULL;
+	tally->groups = NULL;
+	tally->top = NULL;
+	tally->distinct = NULL;
+}
+
+
+/******************************************************************************
+ * tally_free: Releases the memory held by the tally pointed to by the        *
+ *             argument                                                       *
+ ******************************************************************************/
+void tally_free(struct tally *tally)
+{
+	histogram_free(&tally->in);
+	histogram_free(&tally->out);
+	if (tally->joint != NULL) {
+		joint_free(tally->joint);
+		free(tally->joint);
+		tally->joint = NULL;
+	}
+	if (tally->groups != NULL) {
+		group_table_free(tally->groups);
+		free(tally->groups);
+		tally->groups = NULL;
+	}
+	if (tally->top != NULL) {
+		top_free(tally->top);
+		free(tally->top);
+		tally->top = NULL;
+	}
+	if (tally->distinct != NULL) {
+		distinct_free(tally->distinct);
+		free(tally->distinct);
+		tally->distinct = NULL;
+	}
+}
+
+
+/******************************************************************************
+ * tally_clear: Empties the tally pointed to by the argument, keeping the     *
+ *              memory of its histograms for reuse                            *
+ ******************************************************************************/
+void tally_clear(struct tally *tally)
+{
+	histogram_clear(&tally->in);
+	histogram_clear(&tally->out);
+	tally->scores_read = tally->bytes_read = 0;
+	if (tally->joint != NULL)
+		joint_free(tally->joint);
+}
+
+
+/******************************************************************************
+ * tally_enable_joint: Gives the tally pointed to by the argument a joint     *
+ *                     histogram, so that the inbound and outbound scores of  *
+ *                     each line are also counted as a pair. Exits on failure *
+ ******************************************************************************/
+void tally_enable_joint(struct tally *tally)
+{
+	if ((tally->joint = malloc(sizeof(*tally->joint))) == NULL) {
+		perror("wafreport: malloc");
+		exit(EXIT_FAILURE);
+	}
+	joint_init(tally->joint);
+}
+
+
+/******************************************************************************
+ * tally_enable_groups: Gives the tally pointed to by the first argument a    *
+ *                      group table, so that the scores of each line are also *
+ *                      counted in the group picked out by the group spec     *
+ *                      pointed to by the second argument. Exits on failure   *
+ ******************************************************************************/
+void tally_enable_groups(struct tally *tally, const struct group_spec *spec)
+{
+	if ((tally->groups = malloc(sizeof(*tally->groups))) == NULL) {
+		perror("wafreport: malloc");
+		exit(EXIT_FAILURE);
+	}
+	group_table_init(tally->groups, spec);
+}
+
+
+/******************************************************************************
+ * tally_enable_top: Gives the tally pointed to by the first argument         *
+ *                   heavy-hitter summaries, so that the client and URI of    *
+ *                   each line (in the input format given by the third        *
+ *                   argument) are also counted, to report the number of      *
+ *                   heaviest ones given by the second. Exits on failure      *
+ ******************************************************************************/
+void tally_enable_top(struct tally *tally, int k, int format)
+{
+	if ((tally->top = malloc(sizeof(*tally->top))) == NULL) {
+		perror("wafreport: malloc");
+		exit(EXIT_FAILURE);
+	}
+	top_init(tally->top, k, format);
+}
+
+
+/******************************************************************************
+ * tally_enable_distinct: Gives the tally pointed to by the first argument    *
+ *                        distinct-client sketches, so that the client of     *
+ *                        each line (in the input format given by the fourth  *
+ *                        argument) is also counted under its scores, or      *
+ *                        their bands if the second argument lists any lower  *
+ *                        bounds (the number given by the third). Exits on    *
+ *                        failure                                             *
+ ******************************************************************************/
+void tally_enable_distinct(struct tally *tally, const int *bands, int nbands,
+                           int format)
+{
+	if ((tally->distinct = malloc(sizeof(*tally->distinct))) == NULL) {
+		perror("wafreport: malloc");
+		exit(EXIT_FAILURE);
+	}
+	distinct_init(tally->distinct, bands, nbands, format);
+}
+
+
+/******************************************************************************
+ * tally_init_like: Empties the tally pointed to by the first argument, and   *
+ *                  gives it a joint histogram, group table, heavy-hitter     *
+ *                  summaries and distinct-client sketches if the tally       *
+ *                  pointed to by the second argument has them, ready to be   *
+ *                  merged into it                                            *
+ ******************************************************************************/
+void tally_init_like(struct tally *tally, const struct tally *model)
+{
+	tally_init(tally);
+	if (model->joint != NULL)
+		tally_enable_joint(tally);
+	if (model->groups != NULL)
+		tally_enable_groups(tally, model->groups->spec);
+	if (model->top != NULL)
+		tally_enable_top(tally, model->top->k, model->top->format);
+	if (model->distinct != NULL)
+		tally_enable_distinct(tally, model->distinct->bands,
+		                      model->distinct->nbands,
+		                      model->distinct->format);
+}
+
+
+/******************************************************************************
+ * tally_add: Counts one valid score line in the tally pointed to by the      *
+ *            first argument, with the inbound and outbound scores given by   *
+ *            the second and third arguments (negative if missing or invalid) *
+ ******************************************************************************/
+void tally_add(struct tally *tally, int score_in, int score_out)
+{
+	histogram_add(&tally->in, score_in);
+	histogram_add(&tally->out, score_out);
+	if (tally->joint != NULL)
+		joint_add(tally->joint, score_in, score_out);
+	if (tally->metrics != NULL)
+		metrics_add(tally->metrics, score_in, score_out);
+	tally->scores_read++;
+}
+
+
+/******************************************************************************
+ * tally_merge: Adds the counts from the tally pointed to by the second       *
+ *              argument into the tally pointed to by the first argument,     *
+ *              visiting only the populated scores of each histogram. Pairs   *
+ *              of scores are merged when both tallies count them             *
+ ******************************************************************************/
+void tally_merge(struct tally *dest, const struct tally *src)
+{
+	histogram_merge(&dest->in, &src->in);
+	histogram_merge(&dest->out, &src->out);
+	if (dest->joint != NULL && src->joint != NULL)
+		joint_merge(dest->joint, src->joint);
+	if (dest->groups != NULL && src->groups != NULL)
+		group_table_merge(dest->groups, src->groups);
+	if (dest->top != NULL && src->top != NULL)
+		top_merge(dest->top, src->top);
+	if (dest->distinct != NULL && src->distinct != NULL)
+		distinct_merge(dest->distinct, src->distinct);
+	dest->scores_read += src->scores_read;
+	dest->bytes_read += src->bytes_read;
+}
+
+
+/******************************************************************************
+ * histogram_init: Empties the histogram pointed to by the argument. No       *
+ *                 memory is allocated until scores are counted               *
+ ******************************************************************************/
+void histogram_init(struct histogram *hist)
+{
+	hist->dense = NULL;
+	hist->dense_len = 0;
+	hist->sparse = NULL;
+	hist->nsparse = hist->sparse_size = 0;
+	hist->invalid = 0;
+	hist->min = INT_MAX;
+	hist->max = -1;
+}
+
+
+/******************************************************************************
+ * histogram_free: Releases the memory held by the histogram pointed to by    *
+ *                 the argument, leaving it empty                             *
+ ******************************************************************************/
+void histogram_free(struct histogram *hist)
+{
+	free(hist->dense);
+	free(hist->sparse);
+	histogram_init(hist);
+}
+
+
+/******************************************************************************
+ * histogram_clear: Empties the histogram pointed to by the argument, keeping *
+ *                  its memory for reuse. Only the populated part of the      *
+ *                  dense array is zeroed                                     *
+ ******************************************************************************/
+void histogram_clear(struct histogram *hist)
+{
+	int end = hist->max < hist->dense_len ? hist->max + 1 : hist->dense_len;
+
+	if (hist->min < end)
+		memset(hist->dense + hist->min, 0,
+		       (end - hist->min) * sizeof(uint64_t));
+	hist->nsparse = 0;
+	hist->invalid = 0;
+	hist->min = INT_MAX;
+	hist->max = -1;
+}
+
+
+/******************************************************************************
+ * histogram_add: Counts the score given by the second argument in the        *
+ *                histogram pointed to by the first argument. Negative scores *
+ *                are counted as invalid                                      *
+ ******************************************************************************/
+void histogram_add(struct histogram *hist, int score)
+{
+	if (score < 0) {
+		hist->invalid++;
+		return;
+	}
+
+	/* The common case: a low score that already has a slot */
+	if (score < hist->dense_len) {
+		hist->dense[score]++;
+		if (score < hist->min)
+			hist->min = score;
+		if (score > hist->max)
+			hist->max = score;
+		return;
+	}
+
+	histogram_add_count(hist, score, 1);
+}
+
+
+/******************************************************************************
+ * histogram_add_count: Adds the count given by the third argument to the     *
+ *                      valid score given by the second argument in the       *
+ *                      histogram pointed to by the first argument. Grows the *
+ *                      dense array to make room for scores below             *
+ *                      DENSE_SCORES, and keeps any higher scores in the      *
+ *                      sorted sparse array                                   *
+ ******************************************************************************/
+void histogram_add_count(struct histogram *hist, int score, uint64_t count)
+{
+	struct sparse_bin *bin;
+	size_t lo, hi, mid;
+	int len;
+
+	if (count == 0)
+		return;
+
+	if (score < DENSE_SCORES) {
+		if (score >= hist->dense_len) {
+			for (len = hist->dense_len ? hist->dense_len : 64;
+			     len <= score; len *= 2)
+				;
+			hist->dense = realloc(hist->dense,
+					      len * sizeof(uint64_t));
+			if (hist->dense == NULL) {
+				perror("wafreport: realloc");
+				exit(EXIT_FAILURE);
+			}
+			memset(hist->dense + hist->dense_len, 0,
+			       (len - hist->dense_len) * sizeof(uint64_t));
+			hist->dense_len = len;
+		}
+		hist->dense[score] += count;
+	} else {
+		/* Find the score's bin, or where it belongs */
+		for (lo = 0, hi = hist->nsparse; lo < hi; ) {
+			mid = lo + (hi - lo) / 2;
+			if (hist->sparse[mid].score < score)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		if (lo == hist->nsparse || hist->sparse[lo].score != score) {
+			if (hist->nsparse == hist->sparse_size) {
+				hist->sparse_size = hist->sparse_size ?
+						    hist->sparse_size * 2 : 16;
+				hist->sparse = realloc(hist->sparse,
+						       hist->sparse_size *
+						       sizeof(*hist->sparse));
+				if (hist->sparse == NULL) {
+					perror("wafreport: realloc");
+					exit(EXIT_FAILURE);
+				}
+			}
+			bin = &hist->sparse[lo];
+			memmove(bin + 1, bin, (hist->nsparse - lo) *
+				sizeof(struct sparse_bin));
+			bin->score = score;
+			bin->count = 0;
+			hist->nsparse++;
+		}
+		hist->sparse[lo].count += count;
+	}
+
+	if (score < hist->min)
+		hist->min = score;
+	if (score > hist->max)
+		hist->max = score;
+}
+
+
+/******************************************************************************
+ * histogram_merge: Adds the counts from the histogram pointed to by the      *
+ *                  second argument into the histogram pointed to by the      *
+ *                  first argument                                            *
+ ******************************************************************************/
+void histogram_merge(struct histogram *dest, const struct histogram *src)
+{
+	struct histogram_iter iter;
+	uint64_t count;
+	int score;
+
+	histogram_iter_init(&iter, src);
+	while (histogram_next(&iter, &score, &count))
+		histogram_add_count(dest, score, count);
+
+	dest->invalid += src->invalid;
+}
+
+
+/******************************************************************************
+ * histogram_iter_init: Sets up the iterator pointed to by the first argument *
+ *                      to visit the populated scores of the histogram        *
+ *                      pointed to by the second argument                     *
+ ******************************************************************************/
+void histogram_iter_init(struct histogram_iter *iter,
+                         const struct histogram *hist)
+{
+	iter->hist = hist;
+	iter->dense_pos = hist->min;
+	iter->sparse_pos = 0;
+}
+
+
+/******************************************************************************
+ * histogram_next: Advances the iterator pointed to by the first argument to  *
+ *                 the next populated score, in ascending order, storing the  *
+ *                 score and its count in the values pointed to by the second *
+ *                 and third arguments. Only the populated range of the dense *
+ *                 array is looked at. Returns 1 if there was another score,  *
+ *                 else 0                                                     *
+ ******************************************************************************/
+int histogram_next(struct histogram_iter *iter, int *score, uint64_t *count)
+{
+	const struct histogram *hist = iter->hist;
+	int end = hist->max < hist->dense_len ? hist->max + 1 : hist->dense_len;
+
+	for (; iter->dense_pos < end; iter->dense_pos++)
+		if (hist->dense[iter->dense_pos] != 0) {
+			*score = iter->dense_pos;
+			*count = hist->dense[iter->dense_pos++];
+			return 1;
+		}
+
+	if (iter->sparse_pos < hist->nsparse) {
+		*score = hist->sparse[iter->sparse_pos].score;
+		*count = hist->sparse[iter->sparse_pos++].count;
+		return 1;
+	}
+
+	return 0;
+}
+
+
+/******************************************************************************
+ * joint_init: Empties the joint histogram pointed to by the argument. No     *
+ *             memory is allocated until scores are counted                   *
+ ******************************************************************************/
+void joint_init(struct joint_histogram *joint)
+{
+	joint->grid = NULL;
+	joint->bins = NULL;
+	joint->nbins = joint->bins_size = 0;
+}
+
+
+/******************************************************************************
+ * joint_free: Releases the memory held by the joint histogram pointed to by  *
+ *             the argument, leaving it empty                                 *
+ ******************************************************************************/
+void joint_free(struct joint_histogram *joint)
+{
+	free(joint->grid);
+	free(joint->bins);
+	joint_init(joint);
+}
+
+
+/******************************************************************************
+ * joint_add: Counts the pair of inbound and outbound scores given by the     *
+ *            second and third arguments in the joint histogram pointed to by *
+ *            the first argument                                              *
+ ******************************************************************************/
+void joint_add(struct joint_histogram *joint, int score_in, int score_out)
+{
+	/* The common case: both scores low, with the grid already there */
+	if (joint->grid != NULL && score_in < JOINT_DENSE - 1 &&
+	    score_out < JOINT_DENSE - 1 && score_in >= -1 && score_out >= -1) {
+		joint->grid[(score_in + 1) * JOINT_DENSE + score_out + 1]++;
+		return;
+	}
+
+	joint_add_count(joint, score_in, score_out, 1);
+}
+
+
+/******************************************************************************
+ * joint_add_count: Adds the count given by the fourth argument to the pair   *
+ *                  of scores given by the second and third arguments in the  *
+ *                  joint histogram pointed to by the first argument. Any     *
+ *                  negative score is counted as invalid (-1). Allocates the  *
+ *                  grid on first use, and grows the hash table of bins to    *
+ *                  keep it at most 70% full. Exits on failure                *
+ ******************************************************************************/
+void joint_add_count(struct joint_histogram *joint, int score_in,
+                     int score_out, uint64_t count)
+{
+	struct joint_bin *old;
+	size_t old_size, i, mask;
+	uint64_t key;
+
+	if (count == 0)
+		return;
+	if (score_in < 0)
+		score_in = -1;
+	if (score_out < 0)
+		score_out = -1;
+
+	if (score_in < JOINT_DENSE - 1 && score_out < JOINT_DENSE - 1) {
+		if (joint->grid == NULL &&
+		    (joint->grid = calloc(JOINT_DENSE * JOINT_DENSE,
+		                          sizeof(uint64_t))) == NULL) {
+			perror("wafreport: calloc");
+			exit(EXIT_FAILURE);
+		}
+		joint->grid[(score_in + 1) * JOINT_DENSE + score_out + 1] +=
+			count;
+		return;
+	}
+
+	if ((joint->nbins + 1) * 10 > joint->bins_size * 7) {
+		old = joint->bins;
+		old_size = joint->bins_size;
+		joint->bins_size = old_size ? old_size * 2 : 64;
+		joint->bins = calloc(joint->bins_size, sizeof(*joint->bins));
+		if (joint->bins == NULL) {
+			perror("wafreport: calloc");
+			exit(EXIT_FAILURE);
+		}
+		joint->nbins = 0;
+		for (i = 0; i < old_size; i++)
+			if (old[i].count != 0)
+				joint_add_count(joint, old[i].score_in,
+				                old[i].score_out, old[i].count);
+		free(old);
+	}
+
+	/* Linear probing from a multiplicative hash of the pair */
+	key = (uint64_t) (uint32_t) score_in << 32 | (uint32_t) score_out;
+	mask = joint->bins_size - 1;
+	for (i = (key * UINT64_C(0x9e3779b97f4a7c15)) >> 32 & mask;
+	     joint->bins[i].count != 0; i = (i + 1) & mask)
+		if (joint->bins[i].score_in == score_in &&
+		    joint->bins[i].score_out == score_out)
+			break;
+
+	if (joint->bins[i].count == 0) {
+		joint->bins[i].score_in = score_in;
+		joint->bins[i].score_out = score_out;
+		joint->nbins++;
+	}
+	joint->bins[i].count += count;
+}
+
+
+/******************************************************************************
+ * joint_merge: Adds the counts from the joint histogram pointed to by the    *
+ *              second argument into the joint histogram pointed to by the    *
+ *              first argument                                                *
+ ******************************************************************************/
+void joint_merge(struct joint_histogram *dest,
+                 const struct joint_histogram *src)
+{
+	size_t i;
+
+	if (src->grid != NULL)
+		for (i = 0; i < JOINT_DENSE * JOINT_DENSE; i++)
+			joint_add_count(dest, (int) (i / JOINT_DENSE) - 1,
+			                (int) (i % JOINT_DENSE) - 1,
+			                src->grid[i]);
+
+	for (i = 0; i < src->bins_size; i++)
+		joint_add_count(dest, src->bins[i].score_in,
+		                src->bins[i].score_out, src->bins[i].count);
+}
+
+
+/******************************************************************************
+ * joint_pairs: Collects the populated pairs of the joint histogram pointed   *
+ *              to by the first argument into a newly allocated array, sorted *
+ *              by inbound and then outbound score, and stores it in the      *
+ *              pointer pointed to by the second argument (NULL if there are  *
+ *              none). Returns the number of pairs. The array must be freed   *
+ *              by the caller                                                 *
+ ******************************************************************************/
+size_t joint_pairs(const struct joint_histogram *joint,
+                   struct joint_bin **pairs)
+{
+	size_t i, n = joint->nbins;
+
+	if (joint->grid != NULL)
+		for (i = 0; i < JOINT_DENSE * JOINT_DENSE; i++)
+			n += joint->grid[i] != 0;
+
+	*pairs = NULL;
+	if (n == 0)
+		return 0;
+	if ((*pairs = malloc(n * sizeof(**pairs))) == NULL) {
+		perror("wafreport: malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	n = 0;
+	if (joint->grid != NULL)
+		for (i = 0; i < JOINT_DENSE * JOINT_DENSE; i++)
+			if (joint->grid[i] != 0) {
+				(*pairs)[n].score_in = (int) (i / JOINT_DENSE) - 1;
+				(*pairs)[n].score_out = (int) (i % JOINT_DENSE) - 1;
+				(*pairs)[n++].count = joint->grid[i];
+			}
+	for (i = 0; i < joint->bins_size; i++)
+		if (joint->bins[i].count != 0)
+			(*pairs)[n++] = joint->bins[i];
+
+	qsort(*pairs, n, sizeof(**pairs), joint_bin_cmp);
+
+	return n;
+}
+
+
+/******************************************************************************
+ * joint_bin_cmp: qsort() comparison function which orders joint bins by      *
+ *                inbound score, then by outbound score                       *
+ ******************************************************************************/
+int joint_bin_cmp(const void *a, const void *b)
+{
+	const struct joint_bin *x = a, *y = b;
+
+	if (x->score_in != y->score_in)
+		return x->score_in < y->score_in ? -1 : 1;
+	if (x->score_out != y->score_out)
+		return x->score_out < y->score_out ? -1 : 1;
+	return 0;
+}
+
+
+/******************************************************************************
+ * group_table_init: Empties the group table pointed to by the first          *
+ *                   argument, which picks out group keys as described by the *
+ *                   group spec pointed to by the second argument             *
+ ******************************************************************************/
+void group_table_init(struct group_table *table, const struct group_spec *spec)
+{
+	table->slots = NULL;
+	table->nslots = table->ngroups = 0;
+	table->spec = spec;
+	arena_init(&table->arena);
+}
+
+
+/******************************************************************************
+ * group_table_free: Releases the memory held by the group table pointed to   *
+ *                   by the argument, leaving it empty                        *
+ ******************************************************************************/
+void group_table_free(struct group_table *table)
+{
+	size_t i;
+
+	for (i = 0; i < table->nslots; i++)
+		if (table->slots[i] != NULL)
+			tally_free(&table->slots[i]->tally);
+	free(table->slots);
+	arena_free(&table->arena);
+	group_table_init(table, table->spec);
+}
+
+
+/******************************************************************************
+ * group_add: Counts the inbound and outbound scores given by the fourth and  *
+ *            fifth arguments in the group of the line running from the       *
+ *            second argument up to the third, in the group table pointed to  *
+ *            by the first argument                                           *
+ ******************************************************************************/
+void group_add(struct group_table *table, const char *p, const char *end,
+               int score_in, int score_out)
+{
+	char key[GROUP_KEY_MAX];
+	size_t len;
+
+	len = group_key(table->spec, p, end, key);
+	tally_add(&group_find(table, key, len)->tally, score_in, score_out);
+}
+
+
+/******************************************************************************
+ * group_find: Returns the group with the key given by the second argument,   *
+ *             of the length given by the third, in the group table pointed   *
+ *             to by the first argument, adding an empty one if there isn't   *
+ *             one yet. Grows the hash table to keep it at most 70% full.     *
+ *             Exits on failure                                               *
+ ******************************************************************************/
+struct group *group_find(struct group_table *table, const char *key,
+                         size_t len)
+{
+	struct group *group, **old;
+	size_t old_size, i, j, mask;
+	uint32_t hash = fnv1a((const unsigned char *) key, len);
+	char *copy;
+
+	if ((table->ngroups + 1) * 10 > table->nslots * 7) {
+		old = table->slots;
+		old_size = table->nslots;
+		table->nslots = old_size ? old_size * 2 : 64;
+		table->slots = calloc(table->nslots, sizeof(*table->slots));
+		if (table->slots == NULL) {
+			perror("wafreport: calloc");
+			exit(EXIT_FAILURE);
+		}
+		mask = table->nslots - 1;
+		for (i = 0; i < old_size; i++) {
+			if (old[i] == NULL)
+				continue;
+			for (j = old[i]->hash & mask; table->slots[j] != NULL;
+			     j = (j + 1) & mask)
+				;
+			table->slots[j] = old[i];
+		}
+		free(old);
+	}
+
+	/* Linear probing from the key's hash */
+	mask = table->nslots - 1;
+	for (i = hash & mask; (group = table->slots[i]) != NULL;
+	     i = (i + 1) & mask)
+		if (group->hash == hash && group->key_len == len &&
+		    memcmp(group->key, key, len) == 0)
+			return group;
+
+	/* A new group, with its key stored right after it */
+	group = arena_alloc(&table->arena, sizeof(*group) + len + 1);
+	copy = (char *) (group + 1);
+	memcpy(copy, key, len);
+	copy[len] = '\0';
+	group->key = copy;
+	group->key_len = len;
+	group->hash = hash;
+	tally_init(&group->tally);
+
+	table->slots[i] = group;
+	table->ngroups++;
+	return group;
+}
+
+
+/******************************************************************************
+ * group_table_merge: Adds the groups and counts from the group table pointed *
+ *                    to by the second argument into the group table pointed  *
+ *                    to by the first argument                                *
+ ******************************************************************************/
+void group_table_merge(struct group_table *dest, const struct group_table *src)
+{
+	const struct group *group;
+	size_t i;
+
+	for (i = 0; i < src->nslots; i++)
+		if ((group = src->slots[i]) != NULL)
+			tally_merge(&group_find(dest, group->key,
+			                        group->key_len)->tally,
+			            &group->tally);
+}
+
+
+/******************************************************************************
+ * group_key: Builds the group key of the line running from the second        *
+ *            argument up to the third, as described by the group spec        *
+ *            pointed to by the first argument, in the buffer of              *
+ *            GROUP_KEY_MAX bytes pointed to by the fourth argument. The      *
+ *            fields are joined with spaces, a missing or empty one standing  *
+ *            as "-", and the key is cut short if it would overflow. Returns  *
+ *            the length of the key, which isn't terminated                   *
+ ******************************************************************************/
+size_t group_key(const struct group_spec *spec, const char *p,
+                 const char *end, char *key)
+{
+	const char *start, *stop;
+	size_t len = 0, n;
+	int i, found;
+
+	for (i = 0; i < spec->nfields; i++) {
+		if (spec->format == FORMAT_JSON)
+			found = json_field(p, end, spec->names[i], &start,
+			                   &stop);
+		else
+			found = line_field(p, end, spec->fields[i], &start,
+			                   &stop);
+		if (!found || start == stop) {
+			start = "-";
+			stop = start + 1;
+		}
+
+		if (i > 0 && len < GROUP_KEY_MAX)
+			key[len++] = ' ';
+		n = stop - start;
+		if (n > GROUP_KEY_MAX - len)
+			n = GROUP_KEY_MAX - len;
+		memcpy(key + len, start, n);
+		len += n;
+	}
+
+	return len;
+}
+
+
+/******************************************************************************
+ * line_field: Finds the field with the number given by the third argument    *
+ *             (counting from 1 at the start of the line, or from -1 at its   *
+ *             end) on the line running from the first argument up to the     *
+ *             second, as split up by next_field(). Stores the start and end  *
+ *             of the field in the values pointed to by the fourth and fifth  *
+ *             arguments. Returns 1 if the line has the field, else 0         *
+ ******************************************************************************/
+int line_field(const char *p, const char *end, int n, const char **start,
+               const char **stop)
+{
+	const char *q;
+	int count = 0;
+
+	/* Counting from the end takes a first pass to count the fields */
+	if (n < 0) {
+		for (q = p; next_field(&q, end, start, stop); count++)
+			;
+		if ((n += count + 1) < 1)
+			return 0;
+	}
+
+	while (next_field(&p, end, start, stop))
+		if (--n == 0)
+			return 1;
+
+	return 0;
+}
+
+
+/******************************************************************************
+ * next_field: Finds the next field of a log line, from the position pointed  *
+ *             to by the first argument up to the second argument. Fields are *
+ *             separated by whitespace, except that one opening with a double *
+ *             quote or a square bracket, like the request line and the time  *
+ *             of an access log, runs to the matching (unescaped) quote or    *
+ *             bracket. Stores the start and end of the field, without its    *
+ *             quotes or brackets, in the values pointed to by the third and  *
+ *             fourth arguments and moves the position past it. Returns 1 if  *
+ *             a field was found, else 0                                      *
+ ******************************************************************************/
+int next_field(const char **pp, const char *end, const char **start,
+               const char **stop)
+{
+	const char *p = *pp, *q;
+	char close;
+
+	while (p < end && IS_SPACE(*p))
+		p++;
+	if (p == end) {
+		*pp = p;
+		return 0;
+	}
+
+	if (*p == '"' || *p == '[') {
+		close = *p == '"' ? '"' : ']';
+		for (q = p + 1; q < end && *q != close; q++)
+			if (*q == '\\' && q + 1 < end)
+				q++;
+		if (q < end) {
+			*start = p + 1;
+			*stop = q;
+			*pp = q + 1;
+			return 1;
+		}
+	}
+
+	/* A plain field, or an opening quote that's never closed */
+	for (*start = p; p < end && !IS_SPACE(*p); p++)
+		;
+	*stop = p;
+	*pp = p;
+	return 1;
+}
+
+
+/******************************************************************************
+ * json_field: Finds the value of the first key ending in the string given by *
+ *             the third argument (in lower case, and matched ignoring case)  *
+ *             in the JSON record running from the first argument up to the   *
+ *             second. Stores the start and end of the value, without the     *
+ *             quotes of a string (or any unescaping), in the values pointed  *
+ *             to by the fourth and fifth arguments. Keys whose values are    *
+ *             objects or arrays are passed over. Returns 1 if a value was    *
+ *             found, else 0                                                  *
+ ******************************************************************************/
+int json_field(const char *p, const char *end, const char *name,
+               const char **start, const char **stop)
+{
+	const char *key, *key_end;
+
+	while (json_next_key(&p, end, &key, &key_end)) {
+		if (!key_has_suffix(key, key_end, name))
+			continue;
+
+		while (p < end && IS_SPACE(*p))
+			p++;
+		if (p == end || *p == '{' || *p == '[')
+			continue;
+
+		if (*p == '"') {
+			for (*start = ++p; p < end && *p != '"'; p++)
+				if (*p == '\\' && p + 1 < end)
+					p++;
+			if (p >= end)
+				return 0;
+		} else {
+			for (*start = p; p < end && *p != ',' && *p != '}' &&
+			     *p != ']' && !IS_SPACE(*p); p++)
+				;
+		}
+		*stop = p;
+		return 1;
+	}
+
+	return 0;
+}
+
+
+/******************************************************************************
+ * arena_init: Empties the arena pointed to by the argument. No memory is     *
+ *             allocated until something is carved out of it                 *
+ ******************************************************************************/
+void arena_init(struct arena *arena)
+{
+	arena->blocks = NULL;
+	arena->next = NULL;
+	arena->left = 0;
+}
+
+
+/******************************************************************************
+ * arena_alloc: Carves the number of bytes given by the second argument out   *
+ *              of the arena pointed to by the first argument, aligned for    *
+ *              any of the structures kept there, starting a new block of     *
+ *              ARENA_BLOCK_SIZE bytes (or more, for a big request) when the  *
+ *              current one is used up. Exits on failure                      *
+ ******************************************************************************/
+void *arena_alloc(struct arena *arena, size_t size)
+{
+	struct arena_block *block;
+	size_t block_size;
+	void *p;
+
+	size = (size + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+
+	if (size > arena->left) {
+		block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+		if ((block = malloc(sizeof(*block) + block_size)) == NULL) {
+			perror("wafreport: malloc");
+			exit(EXIT_FAILURE);
+		}
+		block->next = arena->blocks;
+		arena->blocks = block;
+		arena->next = (char *) block->data;
+		arena->left = block_size;
+	}
+
+	p = arena->next;
+	arena->next += size;
+	arena->left -= size;
+	return p;
+}
+
+
+/******************************************************************************
+ * arena_free: Releases every block of the arena pointed to by the argument,  *
+ *             leaving it empty                                               *
+ ******************************************************************************/
+void arena_free(struct arena *arena)
+{
+	struct arena_block *block, *next;
+
+	for (block = arena->blocks; block != NULL; block = next) {
+		next = block->next;
+		free(block);
+	}
+	arena_init(arena);
+}
+
+
+/******************************************************************************
+ * top_init: Sets up the heavy-hitter summaries pointed to by the first       *
+ *           argument to report the number of keys given by the second        *
+ *           argument, taken from lines of the input format given by the      *
+ *           third argument. Each summary gets a fixed number of counters:    *
+ *           TOP_COUNTERS_PER_KEY for every key reported, but at least        *
+ *           TOP_MIN_COUNTERS                                                 *
+ ******************************************************************************/
+void top_init(struct top *top, int k, int format)
+{
+	size_t capacity = (size_t) k * TOP_COUNTERS_PER_KEY;
+
+	if (capacity < TOP_MIN_COUNTERS)
+		capacity = TOP_MIN_COUNTERS;
+
+	top->k = k;
+	top->format = format;
+	top_summary_init(&top->client_count, capacity);
+	top_summary_init(&top->client_score, capacity);
+	top_summary_init(&top->uri_count, capacity);
+	top_summary_init(&top->uri_score, capacity);
+}
+
+
+/******************************************************************************
+ * top_free: Releases the memory held by the heavy-hitter summaries pointed   *
+ *           to by the argument                                               *
+ ******************************************************************************/
+void top_free(struct top *top)
+{
+	top_summary_free(&top->client_count);
+	top_summary_free(&top->client_score);
+	top_summary_free(&top->uri_count);
+	top_summary_free(&top->uri_score);
+}
+
+
+/******************************************************************************
+ * top_add: Counts the line running from the second argument up to the third, *
+ *          with the inbound score given by the fourth argument, in the       *
+ *          heavy-hitter summaries pointed to by the first argument: once for *
+ *          its client and its URI by number of requests, and again weighted  *
+ *          by the inbound score. Lines whose client or URI can't be found    *
+ *          count towards "-"                                                 *
+ ******************************************************************************/
+void top_add(struct top *top, const char *p, const char *end, int score_in)
+{
+	const char *client, *client_end, *uri, *uri_end;
+
+	if (!top_line_keys(p, end, top->format, &client, &client_end, &uri,
+	                   &uri_end)) {
+		client = uri = "-";
+		client_end = uri_end = client + 1;
+	}
+
+	top_summary_add(&top->client_count, client, client_end - client, 1, 0);
+	top_summary_add(&top->uri_count, uri, uri_end - uri, 1, 0);
+	top->client_count.total++;
+	top->uri_count.total++;
+
+	if (score_in > 0) {
+		top_summary_add(&top->client_score, client,
+		                client_end - client, score_in, 0);
+		top_summary_add(&top->uri_score, uri, uri_end - uri,
+		                score_in, 0);
+		top->client_score.total += score_in;
+		top->uri_score.total += score_in;
+	}
+}
+
+
+/******************************************************************************
+ * top_line_keys: Finds the client address and the URI of the request on the  *
+ *                line running from the first argument up to the second, in   *
+ *                the input format given by the third argument: the first     *
+ *                field and the target of the quoted request line of an       *
+ *                access log line, or the values of the client_ip and uri     *
+ *                keys of a JSON audit log record. The query string is left   *
+ *                off the URI, so that requests for one path count together.  *
+ *                Stores the start and end of each in the values pointed to   *
+ *                by the remaining arguments, a missing one as "-". Returns 1 *
+ *                if either was found, else 0                                 *
+ ******************************************************************************/
+int top_line_keys(const char *p, const char *end, int format,
+                  const char **client, const char **client_end,
+                  const char **uri, const char **uri_end)
+{
+	const char *q, *r;
+	int found_client, found_uri = 0;
+
+	found_client = line_client(p, end, format, client, client_end);
+
+	if (format == FORMAT_JSON)
+		found_uri = json_field(p, end, "uri", uri, uri_end);
+	else {
+		/* The target is the second word of the request line */
+		if ((q = memchr(p, '"', end - p)) != NULL) {
+			for (q++; q < end && *q != ' ' && *q != '"'; q++)
+				;
+			if (q < end && *q == ' ') {
+				for (r = ++q; r < end && *r != ' ' && *r != '"';
+				     r++)
+					;
+				*uri = q;
+				*uri_end = r;
+				found_uri = r > q;
+			}
+		}
+	}
+
+	if (found_uri && (q = memchr(*uri, '?', *uri_end - *uri)) != NULL)
+		*uri_end = q;
+
+	if (!found_client || *client == *client_end) {
+		*client = "-";
+		*client_end = *client + 1;
+	}
+	if (!found_uri || *uri == *uri_end) {
+		*uri = "-";
+		*uri_end = *uri + 1;
+	}
+
+	return found_client || found_uri;
+}
+
+
+/******************************************************************************
+ * top_merge: Adds the heavy-hitter summaries pointed to by the second        *
+ *            argument into those pointed to by the first argument            *
+ ******************************************************************************/
+void top_merge(struct top *dest, const struct top *src)
+{
+	top_summary_merge(&dest->client_count, &src->client_count);
+	top_summary_merge(&dest->client_score, &src->client_score);
+	top_summary_merge(&dest->uri_count, &src->uri_count);
+	top_summary_merge(&dest->uri_score, &src->uri_score);
+}
+
+
+/******************************************************************************
+ * top_summary_init: Sets up the Space-Saving summary pointed to by the first *
+ *                   argument with the number of counters given by the second *
+ *                   argument, and a hash table at most half full to find     *
+ *                   them by key. All the memory it will ever use is          *
+ *                   allocated here. Exits on failure                         *
+ ******************************************************************************/
+void top_summary_init(struct top_summary *summary, size_t capacity)
+{
+	size_t i;
+
+	summary->capacity = capacity;
+	summary->size = 0;
+	summary->total = 0;
+	for (summary->table_size = 1; summary->table_size < capacity * 2;
+	     summary->table_size *= 2)
+		;
+
+	summary->counters = malloc(capacity * sizeof(*summary->counters));
+	summary->heap = malloc(capacity * sizeof(*summary->heap));
+	summary->table = malloc(summary->table_size * sizeof(*summary->table));
+	if (summary->counters == NULL || summary->heap == NULL ||
+	    summary->table == NULL) {
+		perror("wafreport: malloc");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < summary->table_size; i++)
+		summary->table[i] = -1;
+}
+
+
+/******************************************************************************
+ * top_summary_free: Releases the memory held by the Space-Saving summary     *
+ *                   pointed to by the argument                               *
+ ******************************************************************************/
+void top_summary_free(struct top_summary *summary)
+{
+	free(summary->counters);
+	free(summary->heap);
+	free(summary->table);
+}
+
+
+/******************************************************************************
+ * top_summary_add: Adds the weight given by the fourth argument to the key   *
+ *                  given by the second argument, of the length given by the  *
+ *                  third (cut short to TOP_KEY_MAX - 1 bytes), in the        *
+ *                  Space-Saving summary pointed to by the first argument,    *
+ *                  along with the possible overcount given by the fifth      *
+ *                  argument (0 for a fresh observation). A key that isn't    *
+ *                  monitored yet takes over a free counter or, once they are *
+ *                  all in use, the one with the smallest count, inheriting   *
+ *                  that count as its overcount. Any key whose true weight is *
+ *                  more than the total over the number of counters is sure   *
+ *                  to be monitored. The caller keeps the summary's total     *
+ ******************************************************************************/
+void top_summary_add(struct top_summary *summary, const char *key, size_t len,
+                     uint64_t weight, uint64_t error)
+{
+	struct top_counter *counter;
+	size_t i, mask = summary->table_size - 1;
+	uint32_t hash;
+	uint64_t floor;
+	int c;
+
+	if (weight == 0)
+		return;
+	if (len > TOP_KEY_MAX - 1)
+		len = TOP_KEY_MAX - 1;
+	hash = fnv1a((const unsigned char *) key, len);
+
+	for (i = hash & mask; (c = summary->table[i]) >= 0; i = (i + 1) & mask) {
+		counter = &summary->counters[c];
+		if (counter->hash == hash && counter->len == len &&
+		    memcmp(counter->key, key, len) == 0) {
+			counter->count += weight;
+			counter->error += error;
+			top_sift_down(summary, counter->pos);
+			return;
+		}
+	}
+
+	if (summary->size < summary->capacity) {
+		/* A free counter: the key is counted exactly from here */
+		c = summary->size++;
+		floor = 0;
+		summary->heap[c] = c;
+		summary->counters[c].pos = c;
+	} else {
+		/* Evict the smallest counter, and look for the new key's
+		 * slot again, as removing the old key may have moved it */
+		c = summary->heap[0];
+		floor = summary->counters[c].count;
+		top_table_remove(summary, c);
+		for (i = hash & mask; summary->table[i] >= 0;
+		     i = (i + 1) & mask)
+			;
+	}
+
+	counter = &summary->counters[c];
+	memcpy(counter->key, key, len);
+	counter->key[len] = '\0';
+	counter->len = len;
+	counter->hash = hash;
+	counter->count = floor + weight;
+	counter->error = floor + error;
+	summary->table[i] = c;
+
+	top_sift_up(summary, counter->pos);
+	top_sift_down(summary, counter->pos);
+}
+
+
+/******************************************************************************
+ * top_table_remove: Takes the counter with the index given by the second     *
+ *                   argument out of the hash table of the Space-Saving       *
+ *                   summary pointed to by the first argument. Later entries  *
+ *                   of its probe run are shifted back into the gap, so no    *
+ *                   tombstones are needed                                    *
+ ******************************************************************************/
+void top_table_remove(struct top_summary *summary, int c)
+{
+	size_t i, j, home, mask = summary->table_size - 1;
+
+	for (i = summary->counters[c].hash & mask; summary->table[i] != c;
+	     i = (i + 1) & mask)
+		;
+
+	for (j = (i + 1) & mask; summary->table[j] >= 0; j = (j + 1) & mask) {
+		/* The entry at j can fill the gap at i unless its home
+		 * slot lies cyclically after i, up to j */
+		home = summary->counters[summary->table[j]].hash & mask;
+		if ((j > i && (home <= i || home > j)) ||
+		    (j < i && home <= i && home > j)) {
+			summary->table[i] = summary->table[j];
+			i = j;
+		}
+	}
+	summary->table[i] = -1;
+}
+
+
+/******************************************************************************
+ * top_sift_up: Moves the counter at the heap position given by the second    *
+ *              argument up the min-heap of the Space-Saving summary pointed  *
+ *              to by the first argument while it's smaller than its parent   *
+ ******************************************************************************/
+void top_sift_up(struct top_summary *summary, size_t pos)
+{
+	size_t parent;
+	int c = summary->heap[pos];
+
+	while (pos > 0) {
+		parent = (pos - 1) / 2;
+		if (summary->counters[summary->heap[parent]].count <=
+		    summary->counters[c].count)
+			break;
+		summary->heap[pos] = summary->heap[parent];
+		summary->counters[summary->heap[pos]].pos = pos;
+		pos = parent;
+	}
+	summary->heap[pos] = c;
+	summary->counters[c].pos = pos;
+}
+
+
+/******************************************************************************
+ * top_sift_down: Moves the counter at the heap position given by the second  *
+ *                argument down the min-heap of the Space-Saving summary      *
+ *                pointed to by the first argument while it's larger than the *
+ *                smaller of its children                                     *
+ ******************************************************************************/
+void top_sift_down(struct top_summary *summary, size_t pos)
+{
+	size_t child;
+	int c = summary->heap[pos];
+
+	while ((child = pos * 2 + 1) < summary->size) {
+		if (child + 1 < summary->size &&
+		    summary->counters[summary->heap[child + 1]].count <
+		    summary->counters[summary->heap[child]].count)
+			child++;
+		if (summary->counters[c].count <=
+		    summary->counters[summary->heap[child]].count)
+			break;
+		summary->heap[pos] = summary->heap[child];
+		summary->counters[summary->heap[pos]].pos = pos;
+		pos = child;
+	}
+	summary->heap[pos] = c;
+	summary->counters[c].pos = pos;
+}
+
+
+/******************************************************************************
+ * top_summary_merge: Adds every counter of the Space-Saving summary pointed  *
+ *                    to by the second argument, overcount and all, into the  *
+ *                    Space-Saving summary pointed to by the first argument,  *
+ *                    whose counts stay upper bounds of the true weights      *
+ ******************************************************************************/
+void top_summary_merge(struct top_summary *dest, const struct top_summary *src)
+{
+	const struct top_counter *counter;
+	size_t i;
+
+	for (i = 0; i < src->size; i++) {
+		counter = &src->counters[i];
+		top_summary_add(dest, counter->key, counter->len,
+		                counter->count, counter->error);
+	}
+	dest->total += src->total;
+}
+
+
+/******************************************************************************
+ * distinct_init: Sets up the distinct-client sketches pointed to by the      *
+ *                first argument for lines of the input format given by the   *
+ *                fourth argument, with a sketch per score, or per score band *
+ *                if the array of band lower bounds given by the second       *
+ *                argument has any entries (the number given by the third).   *
+ *                Exits on failure                                            *
+ ******************************************************************************/
+void distinct_init(struct distinct *distinct, const int *bands, int nbands,
+                   int format)
+{
+	hll_table_init(&distinct->in);
+	hll_table_init(&distinct->out);
+	if ((distinct->all = calloc(HLL_REGISTERS, 1)) == NULL) {
+		perror("wafreport: calloc");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(distinct->bands, bands, nbands * sizeof(*bands));
+	distinct->nbands = nbands;
+	distinct->format = format;
+}
+
+
+/******************************************************************************
+ * distinct_free: Releases the memory held by the distinct-client sketches    *
+ *                pointed to by the argument                                  *
+ ******************************************************************************/
+void distinct_free(struct distinct *distinct)
+{
+	hll_table_free(&distinct->in);
+	hll_table_free(&distinct->out);
+	free(distinct->all);
+}
+
+
+/******************************************************************************
+ * distinct_add: Counts the client of the line running from the second        *
+ *               argument up to the third in the sketches pointed to by the   *
+ *               first argument: in the sketch of its inbound score (the      *
+ *               fourth argument) or band, in that of its outbound score (the *
+ *               fifth argument) or band, and in the sketch of every client.  *
+ *               Lines without a client are left out                          *
+ ******************************************************************************/
+void distinct_add(struct distinct *distinct, const char *p, const char *end,
+                  int score_in, int score_out)
+{
+	const char *client, *client_end;
+	uint64_t hash;
+
+	if (!line_client(p, end, distinct->format, &client, &client_end))
+		return;
+
+	hash = hash64(client, client_end - client);
+	hll_add(hll_table_get(&distinct->in, distinct_key(distinct, score_in)),
+	        hash);
+	hll_add(hll_table_get(&distinct->out,
+	                      distinct_key(distinct, score_out)), hash);
+	hll_add(distinct->all, hash);
+}
+
+
+/******************************************************************************
+ * distinct_key: Returns the key of the sketch which the score given by the   *
+ *               second argument is counted under in the distinct-client      *
+ *               sketches pointed to by the first argument: -1 for an invalid *
+ *               score, else the score itself or, with bands, the index of    *
+ *               the last band starting at or below it                        *
+ ******************************************************************************/
+int distinct_key(const struct distinct *distinct, int score)
+{
+	int lo = 0, hi = distinct->nbands - 1, mid;
+
+	if (score < 0)
+		return -1;
+	if (distinct->nbands == 0)
+		return score;
+
+	/* The first band always starts at 0 */
+	while (lo < hi) {
+		mid = (lo + hi + 1) / 2;
+		if (distinct->bands[mid] <= score)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	return lo;
+}
+
+
+/******************************************************************************
+ * distinct_estimate: Returns the estimated number of distinct clients        *
+ *                    counted under the key given by the second argument in   *
+ *                    the sketch table pointed to by the first argument       *
+ ******************************************************************************/
+uint64_t distinct_estimate(const struct hll_table *table, int key)
+{
+	const uint8_t *sketch = hll_table_find(table, key);
+
+	return sketch != NULL ? hll_estimate(sketch) : 0;
+}
+
+
+/******************************************************************************
+ * distinct_merge: Adds the distinct-client sketches pointed to by the second *
+ *                 argument into those pointed to by the first argument, by   *
+ *                 taking the larger of each pair of registers                *
+ ******************************************************************************/
+void distinct_merge(struct distinct *dest, const struct distinct *src)
+{
+	hll_table_merge(&dest->in, &src->in);
+	hll_table_merge(&dest->out, &src->out);
+	hll_merge(dest->all, src->all);
+}
+
+
+/******************************************************************************
+ * line_client: Finds the client address on the line running from the first  *
+ *              argument up to the second, in the input format given by the   *
+ *              third argument: the first field of an access log line, or the *
+ *              value of the client_ip key of a JSON audit log record. Stores *
+ *              its start and end in the values pointed to by the fourth and  *
+ *              fifth arguments. Returns 1 if it was found, else 0            *
+ ******************************************************************************/
+int line_client(const char *p, const char *end, int format,
+                const char **client, const char **client_end)
+{
+	if (format == FORMAT_JSON)
+		return json_field(p, end, "client_ip", client, client_end) &&
+		       *client < *client_end;
+
+	return next_field(&p, end, client, client_end);
+}
+
+
+/******************************************************************************
+ * hll_table_init: Empties the table of HyperLogLog sketches pointed to by    *
+ *                 the argument                                               *
+ ******************************************************************************/
+void hll_table_init(struct hll_table *table)
+{
+	table->keys = NULL;
+	table->sketches = NULL;
+	table->nkeys = table->size = 0;
+}
+
+
+/******************************************************************************
+ * hll_table_free: Releases the memory held by the table of HyperLogLog       *
+ *                 sketches pointed to by the argument, leaving it empty      *
+ ******************************************************************************/
+void hll_table_free(struct hll_table *table)
+{
+	size_t i;
+
+	for (i = 0; i < table->size; i++)
+		free(table->sketches[i]);
+	free(table->keys);
+	free(table->sketches);
+	hll_table_init(table);
+}
+
+
+/******************************************************************************
+ * hll_table_find: Returns the HyperLogLog sketch for the key given by the    *
+ *                 second argument in the table pointed to by the first       *
+ *                 argument, or NULL if there isn't one                       *
+ ******************************************************************************/
+uint8_t *hll_table_find(const struct hll_table *table, int key)
+{
+	size_t i, mask;
+
+	if (table->size == 0)
+		return NULL;
+
+	mask = table->size - 1;
+	for (i = (uint32_t) key * UINT32_C(0x9e3779b1) & mask;
+	     table->sketches[i] != NULL; i = (i + 1) & mask)
+		if (table->keys[i] == key)
+			return table->sketches[i];
+
+	return NULL;
+}
+
+
+/******************************************************************************
+ * hll_table_get: Returns the HyperLogLog sketch for the key given by the     *
+ *                second argument in the table pointed to by the first        *
+ *                argument, adding an empty one if there isn't one yet. Grows *
+ *                the table to keep it at most 70% full. Exits on failure     *
+ ******************************************************************************/
+uint8_t *hll_table_get(struct hll_table *table, int key)
+{
+	uint8_t **old_sketches, *sketch;
+	int *old_keys;
+	size_t old_size, i, j, mask;
+
+	if ((sketch = hll_table_find(table, key)) != NULL)
+		return sketch;
+
+	if ((table->nkeys + 1) * 10 > table->size * 7) {
+		old_keys = table->keys;
+		old_sketches = table->sketches;
+		old_size = table->size;
+		table->size = old_size ? old_size * 2 : 16;
+		table->keys = malloc(table->size * sizeof(*table->keys));
+		table->sketches = calloc(table->size,
+		                         sizeof(*table->sketches));
+		if (table->keys == NULL || table->sketches == NULL) {
+			perror("wafreport: malloc");
+			exit(EXIT_FAILURE);
+		}
+		mask = table->size - 1;
+		for (i = 0; i < old_size; i++) {
+			if (old_sketches[i] == NULL)
+				continue;
+			for (j = (uint32_t) old_keys[i] * UINT32_C(0x9e3779b1) &
+			         mask;
+			     table->sketches[j] != NULL; j = (j + 1) & mask)
+				;
+			table->keys[j] = old_keys[i];
+			table->sketches[j] = old_sketches[i];
+		}
+		free(old_keys);
+		free(old_sketches);
+	}
+
+	mask = table->size - 1;
+	for (i = (uint32_t) key * UINT32_C(0x9e3779b1) & mask;
+	     table->sketches[i] != NULL; i = (i + 1) & mask)
+		;
+	if ((table->sketches[i] = calloc(HLL_REGISTERS, 1)) == NULL) {
+		perror("wafreport: calloc");
+		exit(EXIT_FAILURE);
+	}
+	table->keys[i] = key;
+	table->nkeys++;
+
+	return table->sketches[i];
+}
+
+
+/******************************************************************************
+ * hll_table_merge: Merges every HyperLogLog sketch of the table pointed to   *
+ *                  by the second argument into the sketch with the same key  *
+ *                  in the table pointed to by the first argument             *
+ ******************************************************************************/
+void hll_table_merge(struct hll_table *dest, const struct hll_table *src)
+{
+	size_t i;
+
+	for (i = 0; i < src->size; i++)
+		if (src->sketches[i] != NULL)
+			hll_merge(hll_table_get(dest, src->keys[i]),
+			          src->sketches[i]);
+}
+
+
+/******************************************************************************
+ * hll_add: Counts the item with the 64-bit hash given by the second argument *
+ *          in the HyperLogLog sketch pointed to by the first argument. The   *
+ *          top HLL_BITS bits of the hash pick a register, which keeps the    *
+ *          highest rank (position of the first set bit) seen in the rest     *
+ ******************************************************************************/
+void hll_add(uint8_t *sketch, uint64_t hash)
+{
+	size_t index = hash >> (64 - HLL_BITS);
+	uint64_t rest = hash << HLL_BITS | UINT64_C(1) << (HLL_BITS - 1);
+	uint8_t rank = 1;
+
+	while (!(rest & UINT64_C(1) << 63)) {
+		rest <<= 1;
+		rank++;
+	}
+	if (rank > sketch[index])
+		sketch[index] = rank;
+}
+
+
+/******************************************************************************
+ * hll_merge: Merges the HyperLogLog sketch pointed to by the second argument *
+ *            into the sketch pointed to by the first argument, which then    *
+ *            counts the union of the two                                     *
+ ******************************************************************************/
+void hll_merge(uint8_t *dest, const uint8_t *src)
+{
+	size_t i;
+
+	for (i = 0; i < HLL_REGISTERS; i++)
+		if (src[i] > dest[i])
+			dest[i] = src[i];
+}
+
+
+/******************************************************************************
+ * hll_estimate: Returns the estimated number of distinct items counted in    *
+ *               the HyperLogLog sketch pointed to by the argument: the       *
+ *               harmonic mean of the registers, scaled, or for small counts  *
+ *               (while some registers are still empty) the linear counting   *
+ *               estimate, which is more accurate there. The standard error   *
+ *               is about 1.04 / sqrt(HLL_REGISTERS)                          *
+ ******************************************************************************/
+uint64_t hll_estimate(const uint8_t *sketch)
+{
+	double m = HLL_REGISTERS, sum = 0, estimate;
+	size_t i, zeros = 0;
+
+	for (i = 0; i < HLL_REGISTERS; i++) {
+		sum += ldexp(1.0, -sketch[i]);
+		if (sketch[i] == 0)
+			zeros++;
+	}
+
+	estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+	if (estimate <= 2.5 * m && zeros > 0)
+		estimate = m * log(m / zeros);
+
+	return (uint64_t) (estimate + 0.5);
+}
+
+
+/******************************************************************************
+ * hash64: Returns a 64-bit hash of the bytes pointed to by the first         *
+ *         argument, of the length given by the second: 64-bit FNV-1a, with   *
+ *         a final mix so that every bit depends on every input bit, as the   *
+ *         HyperLogLog sketches need                                          *
+ ******************************************************************************/
+uint64_t hash64(const char *p, size_t len)
+{
+	uint64_t hash = UINT64_C(0xcbf29ce484222325);
+
+	while (len-- > 0) {
+		hash ^= (unsigned char) *p++;
+		hash *= UINT64_C(0x100000001b3);
+	}
+
+	hash ^= hash >> 33;
+	hash *= UINT64_C(0xff51afd7ed558ccd);
+	hash ^= hash >> 33;
+	hash *= UINT64_C(0xc4ceb9fe1a85ec53);
+	hash ^= hash >> 33;
+
+	return hash;
+}
+
+
+/******************************************************************************
+ * window_ring_init: Sets up the ring pointed to by the first argument with   *
+ *                   enough slots to cover the longest window in the report   *
+ *                   options pointed to by the second argument. The tick, the *
+ *                   length of time covered by a slot, is the longest window  *
+ *                   divided into at most WINDOW_SLOTS slots (one second for  *
+ *                   windows up to an hour). Exits on failure                 *
+ ******************************************************************************/
+void window_ring_init(struct window_ring *ring,
+                      const struct report_options *opts)
+{
+	int i, longest = 0;
+
+	for (i = 0; i < opts->nwindows; i++)
+		if (opts->windows[i] > longest)
+			longest = opts->windows[i];
+
+	ring->tick = (longest + WINDOW_SLOTS - 1) / WINDOW_SLOTS;
+	ring->nslots = (longest + ring->tick - 1) / ring->tick;
+	if ((ring->slots = calloc(ring->nslots, sizeof(*ring->slots))) == NULL) {
+		perror("wafreport: calloc");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < ring->nslots; i++)
+		tally_init(&ring->slots[i]);
+
+	ring->head = -1;
+	ring->head_pos = 0;
+	ring->clock_only = 1;
+}
+
+
+/******************************************************************************
+ * window_ring_free: Releases the memory held by the ring pointed to by the   *
+ *                   argument                                                 *
+ ******************************************************************************/
+void window_ring_free(struct window_ring *ring)
+{
+	int i;
+
+	for (i = 0; i < ring->nslots; i++)
+		tally_free(&ring->slots[i]);
+	free(ring->slots);
+	ring->slots = NULL;
+	ring->nslots = 0;
+}
+
+
+/******************************************************************************
+ * window_ring_add: Counts a score line, with the inbound and outbound scores *
+ *                  given by the third and fourth arguments, in the slot of   *
+ *                  the ring pointed to by the first argument for the time    *
+ *                  given by the second argument. A time after the newest     *
+ *                  slot moves the ring on; a time before the oldest slot is  *
+ *                  too old to be in any window and isn't counted             *
+ ******************************************************************************/
+void window_ring_add(struct window_ring *ring, time_t t, int score_in,
+                     int score_out)
+{
+	int64_t tick_no = (int64_t) t / ring->tick;
+	int pos;
+
+	if (ring->head < 0)
+		ring->head = tick_no;
+	else if (tick_no > ring->head)
+		window_ring_advance(ring, tick_no);
+	else if (ring->head - tick_no >= ring->nslots)
+		return;
+
+	pos = (ring->head_pos - (int) (ring->head - tick_no) + ring->nslots) %
+	      ring->nslots;
+	tally_add(&ring->slots[pos], score_in, score_out);
+}
+
+
+/******************************************************************************
+ * window_ring_advance: Moves the ring pointed to by the first argument on so *
+ *                      that its newest slot is for the tick number given by  *
+ *                      the second argument, emptying the slots it passes     *
+ *                      over. Each tick costs one slot clear, and a jump of   *
+ *                      more than the whole ring clears every slot just once  *
+ ******************************************************************************/
+void window_ring_advance(struct window_ring *ring, int64_t tick_no)
+{
+	int64_t steps = tick_no - ring->head;
+
+	if (steps <= 0)
+		return;
+	if (steps > ring->nslots)
+		steps = ring->nslots;
+
+	while (steps-- > 0) {
+		ring->head_pos = (ring->head_pos + 1) % ring->nslots;
+		tally_clear(&ring->slots[ring->head_pos]);
+	}
+	ring->head = tick_no;
+}
+
+
+/******************************************************************************
+ * window_ring_collect: Adds up the slots of the ring pointed to by the first *
+ *                      argument which fall within the window given in        *
+ *                      seconds by the second argument, counting back from    *
+ *                      the newest slot, into the tally pointed to by the     *
+ *                      third argument. Windows are rounded up to whole ticks *
+ ******************************************************************************/
+void window_ring_collect(const struct window_ring *ring, int seconds,
+                         struct tally *dest)
+{
+	int i, n = (seconds + ring->tick - 1) / ring->tick;
+
+	if (ring->head < 0)
+		return;
+	if (n > ring->nslots)
+		n = ring->nslots;
+
+	for (i = 0; i < n; i++)
+		tally_merge(dest, &ring->slots[(ring->head_pos - i +
+		                                ring->nslots) % ring->nslots]);
+}
+
+
+/******************************************************************************
+ * metrics_init: Sets up the metrics pointed to by the argument with the      *
+ *               default bucket bounds, no scores counted and no listener     *
+ ******************************************************************************/
+void metrics_init(struct metrics *metrics)
+{
+	memset(metrics, 0, sizeof(*metrics));
+	parse_buckets_arg(DEFAULT_BUCKETS, metrics);
+	metrics->listen_fd = -1;
+	metrics->stop_pipe[0] = metrics->stop_pipe[1] = -1;
+}
+
+
+/******************************************************************************
+ * parse_buckets_arg: Converts the argument of the -B option, a               *
+ *                    comma-separated list of scores in ascending order, to   *
+ *                    the bucket bounds of the metrics pointed to by the      *
+ *                    second argument, replacing any set before. Exits with   *
+ *                    an error message if the list can't be interpreted       *
+ ******************************************************************************/
+void parse_buckets_arg(const char *arg, struct metrics *metrics)
+{
+	const char *p = arg, *end = arg + strlen(arg);
+	int bound;
+
+	metrics->nbounds = 0;
+	do {
+		if (!IS_DIGIT(*p) || !parse_int(&p, end, &bound) ||
+		    (*p != ',' && *p != '\0') ||
+		    (metrics->nbounds > 0 &&
+		     bound <= metrics->bounds[metrics->nbounds - 1])) {
+			fprintf(stderr, "wafreport: invalid bucket list: %s\n",
+			        arg);
+			exit(EXIT_FAILURE);
+		}
+
+		if (metrics->nbounds == MAX_BUCKETS) {
+			fprintf(stderr, "wafreport: at most %d buckets can be given\n",
+				MAX_BUCKETS);
+			exit(EXIT_FAILURE);
+		}
+		metrics->bounds[metrics->nbounds++] = bound;
+	} while (*p++ == ',');
+}
+
+
+/******************************************************************************
+ * metrics_add: Counts the inbound and outbound scores given by the second    *
+ *              and third arguments in the buckets of the metrics pointed to  *
+ *              by the first argument                                         *
+ ******************************************************************************/
+void metrics_add(struct metrics *metrics, int score_in, int score_out)
+{
+	metric_histogram_add(&metrics->in, metrics->bounds, metrics->nbounds,
+	                     score_in);
+	metric_histogram_add(&metrics->out, metrics->bounds, metrics->nbounds,
+	                     score_out);
+}
+
+
+/******************************************************************************
+ * metric_histogram_add: Counts the score given by the fourth argument in the *
+ *                       metrics histogram pointed to by the first argument,  *
+ *                       in the first bucket whose bound, from the list given *
+ *                       by the second and third arguments, is at or above    *
+ *                       it. Negative scores are counted as invalid           *
+ ******************************************************************************/
+void metric_histogram_add(struct metric_histogram *hist, const int *bounds,
+                          int nbounds, int score)
+{
+	int lo = 0, hi = nbounds, mid;
+
+	if (score < 0) {
+		hist->invalid++;
+		return;
+	}
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (bounds[mid] < score)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	hist->buckets[lo]++;
+	hist->count++;
+	hist->sum += score;
+}
+
+
+/******************************************************************************
+ * metrics_listen: Opens a listening socket for the metrics endpoint at the   *
+ *                 address given by the argument: a Unix socket if it         *
+ *                 contains a slash (replacing any stale socket of that       *
+ *                 name), else a TCP [HOST:]PORT, with HOST defaulting to     *
+ *                 127.0.0.1 and allowed to be a bracketed IPv6 address. The  *
+ *                 socket is non-blocking, so a scrape that went away before  *
+ *                 being accepted can't stall the server. Returns the socket, *
+ *                 or exits with an error message on failure                  *
+ ******************************************************************************/
+int metrics_listen(const char *addr)
+{
+	struct addrinfo hints, *res, *ai;
+	struct sockaddr_un sun;
+	struct stat st;
+	char host[256];
+	const char *port;
+	size_t len;
+	int fd = -1, on = 1, err;
+
+	if (strchr(addr, '/') != NULL) {
+		if (strlen(addr) >= sizeof(sun.sun_path)) {
+			fprintf(stderr, "wafreport: socket path too long: %s\n",
+			        addr);
+			exit(EXIT_FAILURE);
+		}
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strcpy(sun.sun_path, addr);
+		if (stat(addr, &st) == 0 && S_ISSOCK(st.st_mode))
+			unlink(addr);
+
+		if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+		    bind(fd, (struct sockaddr *) &sun, sizeof(sun)) < 0)
+			goto fail;
+	} else {
+		/* Split [HOST:]PORT at the last colon */
+		if ((port = strrchr(addr, ':')) == NULL) {
+			port = addr;
+			len = 0;
+		} else {
+			len = port++ - addr;
+		}
+		if (len >= 2 && addr[0] == '[' && addr[len - 1] == ']') {
+			addr++;
+			len -= 2;
+		}
+		if (len >= sizeof(host)) {
+			fprintf(stderr, "wafreport: invalid metrics address: %s\n",
+			        addr);
+			exit(EXIT_FAILURE);
+		}
+		memcpy(host, addr, len);
+		host[len] = '\0';
+
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = AI_PASSIVE;
+		if ((err = getaddrinfo(len ? host : "127.0.0.1", port, &hints,
+		                       &res)) != 0) {
+			fprintf(stderr, "wafreport: %s: %s\n", addr,
+			        gai_strerror(err));
+			exit(EXIT_FAILURE);
+		}
+
+		for (ai = res; ai != NULL; ai = ai->ai_next) {
+			if ((fd = socket(ai->ai_family, ai->ai_socktype,
+			                 ai->ai_protocol)) < 0)
+				continue;
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on,
+			           sizeof(on));
+			if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+				break;
+			err = errno;
+			close(fd);
+			fd = -1;
+			errno = err;
+		}
+		freeaddrinfo(res);
+		if (fd < 0)
+			goto fail;
+	}
+
+	if (listen(fd, 16) < 0 ||
+	    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0)
+		goto fail;
+
+	return fd;
+
+fail:
+	fprintf(stderr, "wafreport: %s: %s\n", addr, strerror(errno));
+	exit(EXIT_FAILURE);
+}
+
+
+/******************************************************************************
+ * metrics_start: Starts the thread answering scrapes on the listener of the  *
+ *                metrics pointed to by the argument. SIGINT and SIGTERM are  *
+ *                blocked in it, so that they reach the reader. Exits with an *
+ *                error message on failure                                    *
+ ******************************************************************************/
+void metrics_start(struct metrics *metrics)
+{
+	sigset_t block, old;
+
+	pthread_mutex_init(&metrics->lock, NULL);
+	if (pipe(metrics->stop_pipe) < 0) {
+		perror("wafreport: pipe");
+		exit(EXIT_FAILURE);
+	}
+
+	sigemptyset(&block);
+	sigaddset(&block, SIGINT);
+	sigaddset(&block, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &block, &old);
+	if (pthread_create(&metrics->thread, NULL, metrics_run, metrics) != 0) {
+		perror("wafreport: pthread_create");
+		exit(EXIT_FAILURE);
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	metrics->started = 1;
+}
+
+
+/******************************************************************************
+ * metrics_stop: Stops the thread started by metrics_start() for the metrics  *
+ *               pointed to by the argument, once it has finished any scrape  *
+ *               it is answering, and closes the listener                     *
+ ******************************************************************************/
+void metrics_stop(struct metrics *metrics)
+{
+	if (metrics->started) {
+		while (write(metrics->stop_pipe[1], "", 1) < 0 && errno == EINTR)
+			;
+		pthread_join(metrics->thread, NULL);
+		close(metrics->stop_pipe[0]);
+		close(metrics->stop_pipe[1]);
+		pthread_mutex_destroy(&metrics->lock);
+		metrics->started = 0;
+	}
+
+	close(metrics->listen_fd);
+	metrics->listen_fd = -1;
+}
+
+
+/******************************************************************************
+ * metrics_publish: Copies the counts of the metrics of the tally pointed to  *
+ *                  by the argument to where scrapes are answered from, which *
+ *                  costs time in proportion to the number of buckets         *
+ ******************************************************************************/
+void metrics_publish(const struct tally *tally)
+{
+	struct metrics *metrics = tally->metrics;
+
+	pthread_mutex_lock(&metrics->lock);
+	metrics->shown_in = metrics->in;
+	metrics->shown_out = metrics->out;
+	metrics->shown_scores_read = tally->scores_read;
+	pthread_mutex_unlock(&metrics->lock);
+}
+
+
+/******************************************************************************
+ * metrics_run: Thread function which answers scrapes on the listener of the  *
+ *              metrics pointed to by the argument as they come in, until     *
+ *              metrics_stop() asks it to stop                                *
+ ******************************************************************************/
+void *metrics_run(void *arg)
+{
+	struct metrics *metrics = arg;
+	struct pollfd pfd[2];
+
+	pfd[0].fd = metrics->listen_fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = metrics->stop_pipe[0];
+	pfd[1].events = POLLIN;
+
+	for (;;) {
+		if (poll(pfd, 2, -1) < 0)
+			continue;
+		if (pfd[1].revents != 0)
+			break;
+		if (pfd[0].revents & POLLIN)
+			metrics_serve(metrics);
+	}
+
+	return NULL;
+}
+
+
+/******************************************************************************
+ * metrics_serve: Accepts a connection on the listener of the metrics pointed *
+ *                to by the argument and answers its HTTP request: a GET of   *
+ *                /metrics (or /) gets the counts last published, anything    *
+ *                else an error. Clients which are slow to send their request *
+ *                or read the answer time out after METRICS_TIMEOUT_MS        *
+ *                milliseconds, and errors on the connection are ignored, so  *
+ *                a bad client can't take the server down. Only the rendering *
+ *                is done under the lock, never the network I/O               *
+ ******************************************************************************/
+void metrics_serve(struct metrics *metrics)
+{
+	struct timeval tv = { METRICS_TIMEOUT_MS / 1000,
+	                      METRICS_TIMEOUT_MS % 1000 * 1000 };
+	struct outbuf body;
+	char req[METRICS_REQUEST_SIZE], head[256], *path;
+	size_t len = 0, path_len;
+	ssize_t n;
+	int fd, head_len;
+
+	if ((fd = accept(metrics->listen_fd, NULL, NULL)) < 0)
+		return;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	/* Read up to the end of the request headers; there's no body */
+	while (len < sizeof(req) - 1) {
+		if ((n = recv(fd, req + len, sizeof(req) - 1 - len, 0)) <= 0)
+			break;
+		len += n;
+		req[len] = '\0';
+		if (strstr(req, "\r\n\r\n") != NULL ||
+		    strstr(req, "\n\n") != NULL)
+			break;
+	}
+	req[len] = '\0';
+
+	outbuf_init(&body, fd);
+	if (strncmp(req, "GET ", 4) != 0) {
+		out_str(&body, "Method not allowed\n");
+		head_len = snprintf(head, sizeof(head),
+		                    "HTTP/1.1 405 Method Not Allowed\r\n"
+		                    "Allow: GET\r\n"
+		                    "Content-Type: text/plain\r\n");
+	} else {
+		path = req + 4;
+		path_len = strcspn(path, " ?\r\n");
+		if ((path_len == 8 && memcmp(path, "/metrics", 8) == 0) ||
+		    (path_len == 1 && *path == '/')) {
+			pthread_mutex_lock(&metrics->lock);
+			print_metrics(metrics, &body);
+			pthread_mutex_unlock(&metrics->lock);
+			head_len = snprintf(head, sizeof(head),
+			                    "HTTP/1.1 200 OK\r\n"
+			                    "Content-Type: application/openmetrics-text; "
+			                    "version=1.0.0; charset=utf-8\r\n");
+		} else {
+			out_str(&body, "Not found\n");
+			head_len = snprintf(head, sizeof(head),
+			                    "HTTP/1.1 404 Not Found\r\n"
+			                    "Content-Type: text/plain\r\n");
+		}
+	}
+	head_len += snprintf(head + head_len, sizeof(head) - head_len,
+	                     "Content-Length: %zu\r\n"
+	                     "Connection: close\r\n\r\n", body.len);
+
+	if (send_all(fd, head, head_len))
+		send_all(fd, body.buf, body.len);
+
+	outbuf_free(&body);
+	close(fd);
+}
+
+
+/******************************************************************************
+ * print_metrics: Renders the OpenMetrics text exposition of the counts last  *
+ *                published for the metrics pointed to by the first argument  *
+ *                into the output buffer pointed to by the second argument:   *
+ *                the number of score lines read, a histogram of the valid    *
+ *                scores in each direction over the configured buckets, and   *
+ *                the invalid scores in each direction                        *
+ ******************************************************************************/
+void print_metrics(const struct metrics *metrics, struct outbuf *ob)
+{
+	out_str(ob, "# TYPE wafreport_scores_read counter\n");
+	out_str(ob, "# HELP wafreport_scores_read Score lines read.\n");
+	out_str(ob, "wafreport_scores_read_total ");
+	out_uint(ob, metrics->shown_scores_read, 0);
+	out_char(ob, '\n');
+
+	print_metric_histogram(ob, "wafreport_inbound_anomaly_score",
+	                       "Inbound anomaly scores of requests.",
+	                       metrics, &metrics->shown_in);
+	print_metric_histogram(ob, "wafreport_outbound_anomaly_score",
+	                       "Outbound anomaly scores of responses.",
+	                       metrics, &metrics->shown_out);
+
+	out_str(ob, "# TYPE wafreport_invalid_scores counter\n");
+	out_str(ob, "# HELP wafreport_invalid_scores Empty or invalid anomaly scores.\n");
+	out_str(ob, "wafreport_invalid_scores_total{direction=\"inbound\"} ");
+	out_uint(ob, metrics->shown_in.invalid, 0);
+	out_str(ob, "\nwafreport_invalid_scores_total{direction=\"outbound\"} ");
+	out_uint(ob, metrics->shown_out.invalid, 0);
+	out_str(ob, "\n# EOF\n");
+}
+
+
+/******************************************************************************
+ * print_metric_histogram: Renders the metrics histogram pointed to by the    *
+ *                         fifth argument as an OpenMetrics histogram family  *
+ *                         with the name and help text given by the second    *
+ *                         and third arguments, and the bucket bounds of the  *
+ *                         metrics pointed to by the fourth argument, into    *
+ *                         the output buffer pointed to by the first argument *
+ ******************************************************************************/
+void print_metric_histogram(struct outbuf *ob, const char *name,
+                            const char *help, const struct metrics *metrics,
+                            const struct metric_histogram *hist)
+{
+	uint64_t cumulative = 0;
+	int i;
+
+	out_str(ob, "# TYPE ");
+	out_str(ob, name);
+	out_str(ob, " histogram\n# HELP ");
+	out_str(ob, name);
+	out_char(ob, ' ');
+	out_str(ob, help);
+	out_char(ob, '\n');
+
+	for (i = 0; i <= metrics->nbounds; i++) {
+		cumulative += hist->buckets[i];
+		out_str(ob, name);
+		out_str(ob, "_bucket{le=\"");
+		if (i < metrics->nbounds) {
+			out_uint(ob, metrics->bounds[i], 0);
+			out_str(ob, ".0");
+		} else {
+			out_str(ob, "+Inf");
+		}
+		out_str(ob, "\"} ");
+		out_uint(ob, cumulative, 0);
+		out_char(ob, '\n');
+	}
+
+	out_str(ob, name);
+	out_str(ob, "_count ");
+	out_uint(ob, hist->count, 0);
+	out_char(ob, '\n');
+	out_str(ob, name);
+	out_str(ob, "_sum ");
+	out_uint(ob, hist->sum, 0);
+	out_char(ob, '\n');
+}
+
+
+/******************************************************************************
+ * send_all: Helper function which sends the bytes pointed to by the second   *
+ *           argument, of the length given by the third, on the socket given  *
+ *           by the first argument, without raising SIGPIPE if the peer has   *
+ *           gone. Returns 1 if everything was sent, else 0                   *
+ ******************************************************************************/
+int send_all(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = send(fd, buf, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return 0;
+		buf += n;
+		len -= n;
+	}
+
+	return 1;
+}
+
+
+/******************************************************************************
+ * save_snapshot: Writes the counts in the tally pointed to by the second     *
+ *                argument to the file named by the first argument ("-" for   *
+ *                stdout) as a snapshot, which takes space in proportion to   *
+ *                the number of populated scores rather than the number of    *
+ *                lines read, along with the source pointed to by the third   *
+ *                argument unless it's NULL. Exits on failure                 *
+ ******************************************************************************/
+void save_snapshot(const char *path, const struct tally *tally,
+                   const struct snapshot_source *source)
+{
+	struct outbuf ob;
+	uint32_t hash;
+	int fd, i;
+
+	if (strcmp(path, "-") == 0)
+		fd = STDOUT_FILENO;
+	else if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+		fprintf(stderr, "wafreport: %s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	outbuf_init(&ob, fd);
+	memcpy(outbuf_reserve(&ob, SNAPSHOT_MAGIC_LEN), SNAPSHOT_MAGIC,
+	       SNAPSHOT_MAGIC_LEN);
+	ob.len += SNAPSHOT_MAGIC_LEN;
+	out_char(&ob, SNAPSHOT_VERSION);
+	out_char(&ob, (tally->joint != NULL ? SNAPSHOT_JOINT : 0) |
+	              (source != NULL ? SNAPSHOT_SOURCE : 0));
+
+	out_varint(&ob, tally->scores_read);
+	snapshot_put_histogram(&ob, &tally->in);
+	snapshot_put_histogram(&ob, &tally->out);
+	if (tally->joint != NULL)
+		snapshot_put_joint(&ob, tally->joint);
+	if (source != NULL) {
+		out_varint(&ob, source->dev);
+		out_varint(&ob, source->ino);
+		out_varint(&ob, source->offset);
+		out_varint(&ob, source->check);
+	}
+
+	hash = fnv1a((const unsigned char *) ob.buf, ob.len);
+	for (i = 0; i < 4; i++)
+		out_char(&ob, (char) (hash >> (8 * i)));
+
+	outbuf_flush(&ob);
+	outbuf_free(&ob);
+
+	if (fd != STDOUT_FILENO && close(fd) < 0) {
+		fprintf(stderr, "wafreport: %s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+}
+
+
+/******************************************************************************
+ * save_state: Writes the counts in the tally pointed to by the second        *
+ *             argument, and the source pointed to by the third argument, to  *
+ *             the state file named by the first argument. The snapshot is    *
+ *             written alongside and renamed over the old state, so that a    *
+ *             run cut short leaves the old state whole. Exits on failure     *
+ ******************************************************************************/
+void save_state(const char *path, const struct tally *tally,
+                const struct snapshot_source *source)
+{
+	char *tmp;
+
+	if ((tmp = malloc(strlen(path) + sizeof(".tmp"))) == NULL) {
+		perror("wafreport: malloc");
+		exit(EXIT_FAILURE);
+	}
+	strcpy(tmp, path);
+	strcat(tmp, ".tmp");
+
+	save_snapshot(tmp, tally, source);
+	if (rename(tmp, path) < 0) {
+		fprintf(stderr, "wafreport: %s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	free(tmp);
+}
+
+
+/******************************************************************************
+ * snapshot_put_histogram: Appends the histogram pointed to by the second     *
+ *                         argument to the snapshot being built in the output *
+ *                         buffer pointed to by the first argument, as the    *
+ *                         invalid count and the populated scores, each       *
+ *                         delta-encoded from the one before                  *
+ ******************************************************************************/
+void snapshot_put_histogram(struct outbuf *ob, const struct histogram *hist)
+{
+	struct histogram_iter iter;
+	uint64_t count, n = 0;
+	int score, prev = -1;
+
+	histogram_iter_init(&iter, hist);
+	while (histogram_next(&iter, &score, &count))
+		n++;
+
+	out_varint(ob, hist->invalid);
+	out_varint(ob, n);
+
+	histogram_iter_init(&iter, hist);
+	while (histogram_next(&iter, &score, &count)) {
+		out_varint(ob, (uint64_t) score - prev);
+		out_varint(ob, count);
+		prev = score;
+	}
+}
+
+
+/******************************************************************************
+ * snapshot_put_joint: Appends the populated pairs of the joint histogram     *
+ *                     pointed to by the second argument to the snapshot      *
+ *                     being built in the output buffer pointed to by the     *
+ *                     first argument, delta-encoded in order                 *
+ ******************************************************************************/
+void snapshot_put_joint(struct outbuf *ob, const struct joint_histogram *joint)
+{
+	struct joint_bin *pairs;
+	size_t npairs, i;
+	int prev_in = -1, prev_out = -1;
+
+	npairs = joint_pairs(joint, &pairs);
+	out_varint(ob, npairs);
+
+	for (i = 0; i < npairs; i++) {
+		if (pairs[i].score_in != prev_in)
+			prev_out = -1;
+		out_varint(ob, (uint64_t) ((int64_t) pairs[i].score_in - prev_in));
+		out_varint(ob, (uint64_t) ((int64_t) pairs[i].score_out - prev_out));
+		out_varint(ob, pairs[i].count);
+		prev_in = pairs[i].score_in;
+		prev_out = pairs[i].score_out;
+	}
+
+	free(pairs);
+}
+
+
+/******************************************************************************
+ * load_snapshot: Reads the snapshot in the file named by the first argument  *
+ *                ("-" for stdin) and adds its counts to the tally pointed to *
+ *                by the second argument. Pairs of scores are only added when *
+ *                the tally counts them, in which case the snapshot has to    *
+ *                hold them too. If the snapshot records the source of its    *
+ *                counts, and the third argument isn't NULL, stores it in the *
+ *                structure pointed to by the third argument. Returns 1 if it *
+ *                was stored, else 0. Exits with an error message if the file *
+ *                can't be read or isn't a valid snapshot                     *
+ ******************************************************************************/
+int load_snapshot(const char *path, struct tally *tally,
+                  struct snapshot_source *source)
+{
+	const unsigned char *p, *end;
+	unsigned char *buf = NULL;
+	size_t len = 0, size;
+	uint64_t scores_read, dev, ino, offset, check;
+	uint32_t hash;
+	struct stat st;
+	ssize_t n;
+	int fd, flags;
+
+	if (strcmp(path, "-") == 0)
+		fd = STDIN_FILENO;
+	else if ((fd = open(path, O_RDONLY)) < 0) {
+		fprintf(stderr, "wafreport: %s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	/* Snapshots are small, so the whole file is read in at once */
+	size = READ_BLOCK_SIZE;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+		size = st.st_size + 1;
+	do {
+		if (buf == NULL || len == size) {
+			if (buf != NULL)
+				size *= 2;
+			if ((buf = realloc(buf, size)) == NULL) {
+				perror("wafreport: realloc");
+				exit(EXIT_FAILURE);
+			}
+		}
+		n = read(fd, buf + len, size - len);
+		if (n < 0 && errno != EINTR) {
+			fprintf(stderr, "wafreport: %s: %s\n", path,
+			        strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		if (n > 0)
+			len += n;
+	} while (n != 0);
+	if (fd != STDIN_FILENO)
+		close(fd);
+
+	if (len < SNAPSHOT_MAGIC_LEN + 2 + 4 ||
+	    memcmp(buf, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN) != 0) {
+		fprintf(stderr, "wafreport: %s: not a snapshot\n", path);
+		exit(EXIT_FAILURE);
+	}
+	if (buf[SNAPSHOT_MAGIC_LEN] != SNAPSHOT_VERSION) {
+		fprintf(stderr, "wafreport: %s: unsupported snapshot version %d\n",
+		        path, buf[SNAPSHOT_MAGIC_LEN]);
+		exit(EXIT_FAILURE);
+	}
+	flags = buf[SNAPSHOT_MAGIC_LEN + 1];
+	if (tally->joint != NULL && !(flags & SNAPSHOT_JOINT)) {
+		fprintf(stderr, "wafreport: %s: snapshot wasn't saved with -x\n",
+		        path);
+		exit(EXIT_FAILURE);
+	}
+
+	end = buf + len - 4;
+	hash = (uint32_t) end[0] | (uint32_t) end[1] << 8 |
+	       (uint32_t) end[2] << 16 | (uint32_t) end[3] << 24;
+	p = buf + SNAPSHOT_MAGIC_LEN + 2;
+
+	if ((flags & ~(SNAPSHOT_JOINT | SNAPSHOT_SOURCE)) != 0 ||
+	    fnv1a(buf, len - 4) != hash ||
+	    !get_varint(&p, end, &scores_read) ||
+	    !snapshot_get_histogram(&p, end, &tally->in) ||
+	    !snapshot_get_histogram(&p, end, &tally->out) ||
+	    ((flags & SNAPSHOT_JOINT) &&
+	     !snapshot_get_joint(&p, end, tally->joint)) ||
+	    ((flags & SNAPSHOT_SOURCE) &&
+	     (!get_varint(&p, end, &dev) || !get_varint(&p, end, &ino) ||
+	      !get_varint(&p, end, &offset) ||
+	      !get_varint(&p, end, &check) || check > UINT32_MAX)) ||
+	    p != end) {
+		fprintf(stderr, "wafreport: %s: corrupt snapshot\n", path);
+		exit(EXIT_FAILURE);
+	}
+	tally->scores_read += scores_read;
+
+	free(buf);
+
+	if (!(flags & SNAPSHOT_SOURCE) || source == NULL)
+		return 0;
+
+	source->dev = dev;
+	source->ino = ino;
+	source->offset = offset;
+	source->check = check;
+	return 1;
+}
+
+
+/******************************************************************************
+ * snapshot_get_histogram: Decodes a histogram written by                     *
+ *                         snapshot_put_histogram() from the position pointed *
+ *                         to by the first argument, adding its counts to the *
+ *                         histogram pointed to by the third argument and     *
+ *                         advancing the position past it. Returns 1 on       *
+ *                         success, or 0 if the data is malformed             *
+ ******************************************************************************/
+int snapshot_get_histogram(const unsigned char **pp, const unsigned char *end,
+                           struct histogram *hist)
+{
+	uint64_t invalid, n, delta, count;
+	int64_t score = -1;
+
+	if (!get_varint(pp, end, &invalid) || !get_varint(pp, end, &n))
+		return 0;
+
+	while (n-- > 0) {
+		if (!get_varint(pp, end, &delta) || !get_varint(pp, end, &count) ||
+		    delta == 0 || delta > (uint64_t) (INT_MAX - score) ||
+		    count == 0)
+			return 0;
+		score += delta;
+		histogram_add_count(hist, (int) score, count);
+	}
+
+	hist->invalid += invalid;
+	return 1;
+}
+
+
+/******************************************************************************
+ * snapshot_get_joint: Decodes the pairs written by snapshot_put_joint() from *
+ *                     the position pointed to by the first argument, adding  *
+ *                     them to the joint histogram pointed to by the third    *
+ *                     argument (or just skipping them if it's NULL) and      *
+ *                     advancing the position past them. Returns 1 on         *
+ *                     success, or 0 if the data is malformed                 *
+ ******************************************************************************/
+int snapshot_get_joint(const unsigned char **pp, const unsigned char *end,
+                       struct joint_histogram *joint)
+{
+	uint64_t n, delta_in, delta_out, count;
+	int64_t score_in = -1, score_out = -1;
+
+	if (!get_varint(pp, end, &n))
+		return 0;
+
+	while (n-- > 0) {
+		if (!get_varint(pp, end, &delta_in) ||
+		    !get_varint(pp, end, &delta_out) ||
+		    !get_varint(pp, end, &count) || count == 0 ||
+		    delta_in > (uint64_t) (INT_MAX - score_in))
+			return 0;
+		if (delta_in != 0)
+			score_out = -1;
+		if (delta_out > (uint64_t) (INT_MAX - score_out))
+			return 0;
+		score_in += delta_in;
+		score_out += delta_out;
+
+		if (joint != NULL)
+			joint_add_count(joint, (int) score_in, (int) score_out,
+			                count);
+	}
+
+	return 1;
+}
+
+
+/******************************************************************************
+ * get_varint: Decodes an unsigned LEB128 varint from the position pointed to *
+ *             by the first argument, storing it in the value pointed to by   *
+ *             the third argument and advancing the position past it. Returns *
+ *             1 on success, or 0 if the varint runs past the end or doesn't  *
+ *             fit in 64 bits                                                 *
+ ******************************************************************************/
+int get_varint(const unsigned char **pp, const unsigned char *end, uint64_t *n)
+{
+	const unsigned char *p = *pp;
+	int shift;
+
+	for (*n = 0, shift = 0; p < end && shift < 64; shift += 7) {
+		*n |= (uint64_t) (*p & 0x7f) << shift;
+		if ((*p++ & 0x80) == 0) {
+			*pp = p;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+/******************************************************************************
+ * fnv1a: Helper function which returns the 32-bit FNV-1a hash of the bytes   *
+ *        pointed to by the first argument, of the length given by the second *
+ ******************************************************************************/
+uint32_t fnv1a(const unsigned char *p, size_t len)
+{
+	uint32_t hash = UINT32_C(2166136261);
+
+	while (len-- > 0) {
+		hash ^= *p++;
+		hash *= UINT32_C(16777619);
+	}
+
+	return hash;
+}
+
+
+/******************************************************************************
+ * print_report: Renders the full report for the tally pointed to by the      *
+ *               first argument, using the report options pointed to by the   *
+ *               second argument, into the output buffer pointed to by the    *
+ *               third argument: the statistics for every score read, then    *
+ *               the joint distribution, the threshold simulation and any     *
+ *               time windows                                                 *
+ ******************************************************************************/
+void print_report(const struct tally *tally, const struct report_options *opts,
+                  struct outbuf *ob)
+{
+	print_stats(tally, opts, ob);
+	if (tally->joint != NULL)
+		print_joint(tally, ob);
+	if (opts->thresholds)
+		print_thresholds(tally, ob);
+	if (tally->ring != NULL)
+		print_windows(tally, opts, ob);
+	if (tally->groups != NULL)
+		print_groups(tally, opts, ob);
+}
+
+
+/******************************************************************************
+ * print_windows: Renders a section for each time window listed in the report *
+ *                options pointed to by the second argument, with the         *
+ *                statistics of the scores in that window, taken from the     *
+ *                ring of the tally pointed to by the first argument, into    *
+ *                the output buffer pointed to by the third argument. Windows *
+ *                end at the newest tick of the ring                          *
+ ******************************************************************************/
+void print_windows(const struct tally *tally,
+                   const struct report_options *opts, struct outbuf *ob)
+{
+	const struct window_ring *ring = tally->ring;
+	struct tally win;
+	struct tm tm;
+	time_t end_time;
+	char title[96];
+	int i, len, seconds, amount;
+	char unit;
+
+	for (i = 0; i < opts->nwindows; i++) {
+		seconds = opts->windows[i];
+		if (seconds % 86400 == 0)
+			amount = seconds / 86400, unit = 'd';
+		else if (seconds % 3600 == 0)
+			amount = seconds / 3600, unit = 'h';
+		else if (seconds % 60 == 0)
+			amount = seconds / 60, unit = 'm';
+		else
+			amount = seconds, unit = 's';
+
+		len = snprintf(title, sizeof(title), "Last %d%c", amount, unit);
+		if (ring->head >= 0) {
+			end_time = (time_t) ((ring->head + 1) * ring->tick);
+			gmtime_r(&end_time, &tm);
+			len += strftime(title + len, sizeof(title) - len,
+			                ", up to %Y-%m-%d %H:%M:%S UTC", &tm);
+		}
+
+		out_str(ob, "\n\n\n");
+		out_title(ob, title);
+
+		tally_init(&win);
+		window_ring_collect(ring, seconds, &win);
+		if (win.scores_read == 0)
+			out_str(ob, "No scores in this window\n");
+		else
+			print_stats(&win, opts, ob);
+		tally_free(&win);
+	}
+}
+
+
+/******************************************************************************
+ * print_groups: Renders a summary of the groups of the tally pointed to by   *
+ *               the first argument into the output buffer pointed to by the  *
+ *               third argument, one row per group with its number of         *
+ *               requests and the mean and 99th percentile of its scores in   *
+ *               each direction, sorted (highest first) by the inbound mean   *
+ *               or p99 as set in the report options pointed to by the second *
+ *               argument. Then, in the same order, a section for each group  *
+ *               with the statistics print_stats() gives for the whole input  *
+ ******************************************************************************/
+void print_groups(const struct tally *tally, const struct report_options *opts,
+                  struct outbuf *ob)
+{
+	const struct group_table *table = tally->groups;
+	struct group_row *rows;
+	struct score_stats in, out;
+	size_t i, nrows = 0;
+	int key_width = 5, count_width = 8;
+	char title[GROUP_KEY_MAX + 8];
+
+	if (table->ngroups == 0)
+		return;
+	if ((rows = malloc(table->ngroups * sizeof(*rows))) == NULL) {
+		perror("wafreport: malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < table->nslots; i++) {
+		if (table->slots[i] == NULL)
+			continue;
+		rows[nrows].group = table->slots[i];
+		compute_stats(&table->slots[i]->tally.in,
+		              table->slots[i]->tally.scores_read, &in);
+		compute_stats(&table->slots[i]->tally.out,
+		              table->slots[i]->tally.scores_read, &out);
+		rows[nrows].mean[0] = in.mean;
+		rows[nrows].mean[1] = out.mean;
+		rows[nrows].p99[0] = stats_percentile(&in, 990000);
+		rows[nrows].p99[1] = stats_percentile(&out, 990000);
+		rows[nrows].order = opts->group_order;
+		free_stats(&in);
+		free_stats(&out);
+
+		if ((int) table->slots[i]->key_len > key_width)
+			key_width = table->slots[i]->key_len;
+		if (digit_width(table->slots[i]->tally.scores_read) >
+		    count_width)
+			count_width = digit_width(
+				table->slots[i]->tally.scores_read);
+		nrows++;
+	}
+	qsort(rows, nrows, sizeof(*rows), group_row_cmp);
+
+	out_str(ob, "\n\n\n");
+	out_title(ob, opts->group_order == GROUP_ORDER_P99 ?
+	              "Groups by inbound p99" : "Groups by inbound mean");
+	out_str(ob, "Group");
+	out_spaces(ob, key_width - 4);
+	out_str(ob, "|");
+	out_spaces(ob, count_width - 7);
+	out_str(ob, "Requests | Inbound mean | Inbound p99 | Outbound mean | Outbound p99\n");
+
+	for (i = 0; i < nrows; i++) {
+		out_str(ob, rows[i].group->key);
+		out_spaces(ob, key_width - rows[i].group->key_len + 1);
+		out_str(ob, "| ");
+		out_uint(ob, rows[i].group->tally.scores_read, count_width);
+		out_str(ob, " | ");
+		out_fixed(ob, rows[i].mean[0], 12, 2);
+		out_str(ob, " | ");
+		out_p99(ob, rows[i].p99[0], 11);
+		out_str(ob, " | ");
+		out_fixed(ob, rows[i].mean[1], 13, 2);
+		out_str(ob, " | ");
+		out_p99(ob, rows[i].p99[1], 12);
+		out_char(ob, '\n');
+	}
+
+	for (i = 0; i < nrows; i++) {
+		snprintf(title, sizeof(title), "Group %s", rows[i].group->key);
+		out_str(ob, "\n\n\n");
+		out_title(ob, title);
+		print_stats(&rows[i].group->tally, opts, ob);
+	}
+
+	free(rows);
+}
+
+
+/******************************************************************************
+ * out_p99: Helper function for print_groups() which appends the score given  *
+ *          by the second argument, right-aligned in a field of the width     *
+ *          given by the third argument, to the output buffer pointed to by   *
+ *          the first argument, or a "-" if it's negative (no valid scores)   *
+ ******************************************************************************/
+void out_p99(struct outbuf *ob, int score, int width)
+{
+	if (score < 0) {
+		out_spaces(ob, width - 1);
+		out_char(ob, '-');
+	} else {
+		out_uint(ob, score, width);
+	}
+}
+
+
+/******************************************************************************
+ * group_row_cmp: qsort() comparison function which orders group rows from    *
+ *                the highest inbound mean or p99 (as set in each row) to the *
+ *                lowest, breaking ties with the other of the two, then the   *
+ *                number of requests (most first) and finally the key         *
+ ******************************************************************************/
+int group_row_cmp(const void *a, const void *b)
+{
+	const struct group_row *x = a, *y = b;
+	double xs[2] = { x->mean[0], x->p99[0] }, ys[2] = { y->mean[0], y->p99[0] };
+	int first = x->order == GROUP_ORDER_P99;
+
+	if (xs[first] != ys[first])
+		return xs[first] < ys[first] ? 1 : -1;
+	if (xs[!first] != ys[!first])
+		return xs[!first] < ys[!first] ? 1 : -1;
+	if (x->group->tally.scores_read != y->group->tally.scores_read)
+		return x->group->tally.scores_read <
+		       y->group->tally.scores_read ? 1 : -1;
+
+	return strcmp(x->group->key, y->group->key);
+}
+
+
+/******************************************************************************
+ * print_top: Renders the heaviest clients and URIs of the heavy-hitter       *
+ *            summaries pointed to by the first argument, by number of        *
+ *            requests and by summed inbound score, into the output buffer    *
+ *            pointed to by the second argument                               *
+ ******************************************************************************/
+void print_top(const struct top *top, struct outbuf *ob)
+{
+	print_top_list(ob, "Top clients by requests", "Client",
+	               "# of req.", &top->client_count, top->k);
+	print_top_list(ob, "Top clients by inbound score", "Client",
+	               "Score sum", &top->client_score, top->k);
+	print_top_list(ob, "Top URIs by requests", "URI", "# of req.",
+	               &top->uri_count, top->k);
+	print_top_list(ob, "Top URIs by inbound score", "URI", "Score sum",
+	               &top->uri_score, top->k);
+}
+
+
+/******************************************************************************
+ * print_top_list: Renders a table of the keys with the highest counts in the *
+ *                 Space-Saving summary pointed to by the fifth argument, at  *
+ *                 most the number given by the sixth argument, into the      *
+ *                 output buffer pointed to by the first argument, under the  *
+ *                 title given by the second argument, with the key and count *
+ *                 columns headed by the third and fourth. Each count may     *
+ *                 overstate the true one by at most the amount in the last   *
+ *                 column                                                     *
+ ******************************************************************************/
+void print_top_list(struct outbuf *ob, const char *title, const char *key_label,
+                    const char *count_label, const struct top_summary *summary,
+                    int k)
+{
+	const struct top_counter **rows;
+	size_t i, nrows;
+	int key_width = strlen(key_label), count_width = strlen(count_label);
+	int error_width = 9, len = strlen(title);
+
+	out_str(ob, "\n\n\n");
+	out_str(ob, title);
+	out_char(ob, '\n');
+	memset(outbuf_reserve(ob, len), '-', len);
+	ob->len += len;
+	out_char(ob, '\n');
+
+	if (summary->size == 0) {
+		out_str(ob, "None\n");
+		return;
+	}
+
+	if ((rows = malloc(summary->size * sizeof(*rows))) == NULL) {
+		perror("wafreport: malloc");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < summary->size; i++)
+		rows[i] = &summary->counters[i];
+	qsort(rows, summary->size, sizeof(*rows), top_counter_cmp);
+	nrows = summary->size < (size_t) k ? summary->size : (size_t) k;
+
+	for (i = 0; i < nrows; i++) {
+		if ((int) rows[i]->len > key_width)
+			key_width = rows[i]->len;
+		if (digit_width(rows[i]->count) > count_width)
+			count_width = digit_width(rows[i]->count);
+		if (digit_width(rows[i]->error) > error_width)
+			error_width = digit_width(rows[i]->error);
+	}
+
+	out_str(ob, key_label);
+	out_spaces(ob, key_width - strlen(key_label) + 1);
+	out_str(ob, "|");
+	out_spaces(ob, count_width - strlen(count_label) + 1);
+	out_str(ob, count_label);
+	out_str(ob, " |   % share |");
+	out_spaces(ob, error_width - 8);
+	out_str(ob, "Overcount\n");
+
+	for (i = 0; i < nrows; i++) {
+		out_str(ob, rows[i]->key);
+		out_spaces(ob, key_width - rows[i]->len + 1);
+		out_str(ob, "| ");
+		out_uint(ob, rows[i]->count, count_width);
+		out_str(ob, " | ");
+		out_fixed(ob, 100 * ((double) rows[i]->count / summary->total),
+		          8, 4);
+		out_str(ob, "% | ");
+		out_uint(ob, rows[i]->error, error_width);
+		out_char(ob, '\n');
+	}
+
+	free(rows);
+}
+
+
+/******************************************************************************
+ * top_counter_cmp: qsort() comparison function which orders pointers to      *
+ *                  Space-Saving counters from the highest count to the       *
+ *                  lowest, then by key                                       *
+ ******************************************************************************/
+int top_counter_cmp(const void *a, const void *b)
+{
+	const struct top_counter *x = *(const struct top_counter * const *) a;
+	const struct top_counter *y = *(const struct top_counter * const *) b;
+
+	if (x->count != y->count)
+		return x->count < y->count ? 1 : -1;
+
+	return strcmp(x->key, y->key);
+}
+
+
+/******************************************************************************
+ * print_distinct_bands: Renders a table of the number of lines and the       *
+ *                       estimated number of distinct clients in each score   *
+ *                       band of the distinct-client sketches pointed to by   *
+ *                       the fifth argument, into the output buffer pointed   *
+ *                       to by the first argument, under the title given by   *
+ *                       the second argument, with the count column headed by *
+ *                       the third. The lines are counted from the statistics *
+ *                       pointed to by the fourth argument, and the clients   *
+ *                       from the sketch table pointed to by the last         *
+ ******************************************************************************/
+void print_distinct_bands(struct outbuf *ob, const char *title,
+                          const char *count_label,
+                          const struct score_stats *stats,
+                          const struct distinct *distinct,
+                          const struct hll_table *table)
+{
+	uint64_t counts[MAX_BANDS] = { 0 };
+	char labels[MAX_BANDS][32];
+	int label_width = 16, count_width = strlen(count_label);
+	int i, len = strlen(title);
+	size_t r;
+
+	for (r = 0; r < stats->nrows; r++)
+		counts[distinct_key(distinct, stats->rows[r].score)] +=
+			stats->rows[r].count;
+
+	for (i = 0; i < distinct->nbands; i++) {
+		if (i + 1 < distinct->nbands)
+			snprintf(labels[i], sizeof(labels[i]), "%d-%d",
+			         distinct->bands[i], distinct->bands[i + 1] - 1);
+		else
+			snprintf(labels[i], sizeof(labels[i]), "%d+",
+			         distinct->bands[i]);
+		if ((int) strlen(labels[i]) > label_width)
+			label_width = strlen(labels[i]);
+	}
+	if (digit_width(stats->scores_read) > count_width)
+		count_width = digit_width(stats->scores_read);
+
+	out_str(ob, "\n\n\n");
+	out_str(ob, title);
+	out_char(ob, '\n');
+	memset(outbuf_reserve(ob, len), '-', len);
+	ob->len += len;
+	out_char(ob, '\n');
+
+	out_str(ob, "Score band");
+	out_spaces(ob, label_width - 9);
+	out_str(ob, "|");
+	out_spaces(ob, count_width - strlen(count_label) + 1);
+	out_str(ob, count_label);
+	out_str(ob, " | Distinct clients\n");
+
+	out_str(ob, "All");
+	out_spaces(ob, label_width - 2);
+	out_str(ob, "| ");
+	out_uint(ob, stats->scores_read, count_width);
+	out_str(ob, " | ");
+	out_uint(ob, hll_estimate(distinct->all), 16);
+	out_str(ob, "\n\n");
+
+	out_str(ob, "Empty or invalid");
+	out_spaces(ob, label_width - 15);
+	out_str(ob, "| ");
+	out_uint(ob, stats->invalid, count_width);
+	out_str(ob, " | ");
+	out_uint(ob, distinct_estimate(table, -1), 16);
+	out_char(ob, '\n');
+
+	for (i = 0; i < distinct->nbands; i++) {
+		out_str(ob, labels[i]);
+		out_spaces(ob, label_width - strlen(labels[i]) + 1);
+		out_str(ob, "| ");
+		out_uint(ob, counts[i], count_width);
+		out_str(ob, " | ");
+		out_uint(ob, distinct_estimate(table, i), 16);
+		out_char(ob, '\n');
+	}
+}
+
+
+/******************************************************************************
+ * print_joint: Renders the joint distribution of inbound and outbound scores *
+ *              from the tally pointed to by the first argument into the      *
+ *              output buffer pointed to by the second argument: a            *
+ *              cross-tabulation of the number of requests with each pair of  *
+ *              scores, the distribution of outbound scores given each        *
+ *              inbound score and vice versa, and the correlation of the two  *
+ *              scores over the lines where both are valid                    *
+ ******************************************************************************/
+void print_joint(const struct tally *tally, struct outbuf *ob)
+{
+	struct joint_bin *pairs;
+	uint64_t *col_totals = NULL, valid = 0;
+	double sx = 0, sy = 0, sxx = 0, syy = 0, sxy = 0, n, x, y, var;
+	size_t npairs, ncols = 0, i, lo, hi, mid;
+	int *cols = NULL;
+
+	npairs = joint_pairs(tally->joint, &pairs);
+
+	/* The columns are the distinct outbound scores, in order */
+	if (npairs > 0 &&
+	    ((cols = malloc(npairs * sizeof(*cols))) == NULL ||
+	     (col_totals = calloc(npairs, sizeof(*col_totals))) == NULL)) {
+		perror("wafreport: malloc");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < npairs; i++) {
+		for (lo = 0, hi = ncols; lo < hi; ) {
+			mid = lo + (hi - lo) / 2;
+			if (cols[mid] < pairs[i].score_out)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (lo == ncols || cols[lo] != pairs[i].score_out) {
+			memmove(cols + lo + 1, cols + lo,
+			        (ncols - lo) * sizeof(*cols));
+			memmove(col_totals + lo + 1, col_totals + lo,
+			        (ncols - lo) * sizeof(*col_totals));
+			cols[lo] = pairs[i].score_out;
+			col_totals[lo] = 0;
+			ncols++;
+		}
+		col_totals[lo] += pairs[i].count;
+
+		if (pairs[i].score_in >= 0 && pairs[i].score_out >= 0) {
+			x = pairs[i].score_in;
+			y = pairs[i].score_out;
+			n = pairs[i].count;
+			valid += pairs[i].count;
+			sx += n * x;
+			sy += n * y;
+			sxx += n * x * x;
+			syy += n * y * y;
+			sxy += n * x * y;
+		}
+	}
+
+	out_str(ob, "\n\n\n");
+	out_str(ob, "Inbound x Outbound (Requests)\n");
+	out_str(ob, "-----------------------------\n");
+	print_joint_table(ob, pairs, npairs, cols, col_totals, ncols, 0);
+
+	out_str(ob, "\nOutbound score given inbound score (% of the row)\n");
+	print_joint_table(ob, pairs, npairs, cols, col_totals, ncols, 1);
+
+	out_str(ob, "\nInbound score given outbound score (% of the column)\n");
+	print_joint_table(ob, pairs, npairs, cols, col_totals, ncols, 2);
+
+	/* Pearson's r, from the sums of the valid pairs */
+	n = valid;
+	var = (n * sxx - sx * sx) * (n * syy - sy * sy);
+	out_str(ob, "\nCorrelation of inbound and outbound scores: ");
+	if (var > 0)
+		out_fixed(ob, (n * sxy - sx * sy) / sqrt(var), 0, 4);
+	else
+		out_char(ob, '-');
+	out_str(ob, " over ");
+	out_uint(ob, valid, 0);
+	out_str(ob, " requests with both scores valid\n");
+
+	free(pairs);
+	free(cols);
+	free(col_totals);
+}
+
+
+/******************************************************************************
+ * print_joint_table: Renders one table of the joint distribution into the    *
+ *                    output buffer pointed to by the first argument, from    *
+ *                    the sorted pairs given by the second and third          *
+ *                    arguments. There is a row for each inbound score and a  *
+ *                    column for each of the outbound scores given by the     *
+ *                    fourth argument, whose totals are given by the fifth,   *
+ *                    with the number of columns given by the sixth. The      *
+ *                    mode given by the seventh argument picks the cells:     *
+ *                    0 for counts, with totals, 1 for percentages of the     *
+ *                    row and 2 for percentages of the column                 *
+ ******************************************************************************/
+void print_joint_table(struct outbuf *ob, const struct joint_bin *pairs,
+                       size_t npairs, const int *cols,
+                       const uint64_t *col_totals, size_t ncols, int mode)
+{
+	static const char corner[] = "Inbound \\ Outbound";
+	uint64_t total = 0, row_total, count;
+	size_t i, j, c;
+	int width = 9, label_width = sizeof(corner) - 1;
+
+	for (c = 0; c < ncols; c++)
+		total += col_totals[c];
+	if (mode == 0)
+		width = digit_width(total) > 5 ? digit_width(total) : 5;
+	for (c = 0; c < ncols; c++)
+		if (cols[c] >= 0 && digit_width(cols[c]) > width)
+			width = digit_width(cols[c]);
+
+	/* Heading */
+	out_str(ob, corner);
+	for (c = 0; c < ncols; c++) {
+		out_str(ob, " | ");
+		out_score_label(ob, cols[c], width);
+	}
+	if (mode == 0) {
+		out_str(ob, " | ");
+		out_spaces(ob, width - 5);
+		out_str(ob, "Total");
+	}
+	out_char(ob, '\n');
+
+	/* One row per inbound score, from its run of pairs */
+	for (i = 0; i < npairs; i = j) {
+		for (j = i, row_total = 0;
+		     j < npairs && pairs[j].score_in == pairs[i].score_in; j++)
+			row_total += pairs[j].count;
+
+		out_score_label(ob, pairs[i].score_in, label_width);
+		for (c = 0, j = i; c < ncols; c++) {
+			count = 0;
+			if (j < npairs && pairs[j].score_in == pairs[i].score_in &&
+			    pairs[j].score_out == cols[c])
+				count = pairs[j++].count;
+
+			out_str(ob, " | ");
+			if (mode == 0) {
+				out_uint(ob, count, width);
+			} else {
+				out_fixed(ob, 100 * ((double) count /
+				          (mode == 1 ? row_total : col_totals[c])),
+				          width - 1, 4);
+				out_char(ob, '%');
+			}
+		}
+		if (mode == 0) {
+			out_str(ob, " | ");
+			out_uint(ob, row_total, width);
+		}
+		out_char(ob, '\n');
+	}
+
+	if (mode == 0) {
+		out_spaces(ob, label_width - 5);
+		out_str(ob, "Total");
+		for (c = 0; c < ncols; c++) {
+			out_str(ob, " | ");
+			out_uint(ob, col_totals[c], width);
+		}
+		out_str(ob, " | ");
+		out_uint(ob, total, width);
+		out_char(ob, '\n');
+	}
+}
+
+
+/******************************************************************************
+ * out_score_label: Appends the score given by the second argument, or "-"    *
+ *                  for an invalid score, right-aligned in a field of the     *
+ *                  width given by the third argument, to the output buffer   *
+ *                  pointed to by the first argument                          *
+ ******************************************************************************/
+void out_score_label(struct outbuf *ob, int score, int width)
+{
+	if (score >= 0) {
+		out_uint(ob, score, width);
+		return;
+	}
+
+	if (width > 1)
+		out_spaces(ob, width - 1);
+	out_char(ob, '-');
+}
+
+
+/******************************************************************************
+ * print_thresholds: Renders the threshold simulation for the tally pointed   *
+ *                   to by the first argument into the output buffer pointed  *
+ *                   to by the second argument: for every candidate inbound   *
+ *                   and outbound anomaly threshold, how many requests or     *
+ *                   responses would be blocked, and when the pairs of scores *
+ *                   were counted, the exact combined block rate for every    *
+ *                   pair of thresholds                                       *
+ ******************************************************************************/
+void print_thresholds(const struct tally *tally, struct outbuf *ob)
+{
+	struct score_stats in, out;
+
+	compute_stats(&tally->in, tally->scores_read, &in);
+	compute_stats(&tally->out, tally->scores_read, &out);
+
+	out_str(ob, "\n\n\n");
+	out_str(ob, "Inbound thresholds (Requests)\n");
+	out_str(ob, "-----------------------------\n");
+	print_threshold_table(ob, &in);
+
+	out_str(ob, "\n\n\n");
+	out_str(ob, "Outbound thresholds (Responses)\n");
+	out_str(ob, "-------------------------------\n");
+	print_threshold_table(ob, &out);
+
+	if (tally->joint != NULL)
+		print_threshold_matrix(tally, ob);
+
+	free_stats(&in);
+	free_stats(&out);
+}
+
+
+/******************************************************************************
+ * print_threshold_table: Renders a table into the output buffer pointed to   *
+ *                        by the first argument with a row for each populated *
+ *                        score of the statistics pointed to by the second    *
+ *                        argument, giving the number and share of lines that *
+ *                        a threshold of that score would block (those with a *
+ *                        score at or above it) and pass. These come straight *
+ *                        from the cumulative counts of the rows. Invalid     *
+ *                        scores are never blocked                            *
+ ******************************************************************************/
+void print_threshold_table(struct outbuf *ob, const struct score_stats *stats)
+{
+	uint64_t valid, below, blocked;
+	size_t i;
+	int width = stats->count_width > 7 ? stats->count_width : 7;
+
+	valid = stats->nrows ? stats->rows[stats->nrows - 1].cumulative : 0;
+
+	out_str(ob, "Threshold |");
+	out_spaces(ob, width - 6);
+	out_str(ob, "Blocked | % blocked |");
+	out_spaces(ob, width - 5);
+	out_str(ob, "Passed |  % passed\n");
+
+	for (i = 0, below = 0; i < stats->nrows; i++) {
+		blocked = valid - below;
+		out_uint(ob, stats->rows[i].score, 9);
+		out_str(ob, " | ");
+		out_uint(ob, blocked, width);
+		out_str(ob, " | ");
+		out_fixed(ob, 100 * ((double) blocked / stats->scores_read),
+		          8, 4);
+		out_str(ob, "% | ");
+		out_uint(ob, stats->scores_read - blocked, width);
+		out_str(ob, " | ");
+		out_fixed(ob, 100 - 100 * ((double) blocked /
+		                           stats->scores_read), 8, 4);
+		out_str(ob, "%\n");
+		below = stats->rows[i].cumulative;
+	}
+}
+
+
+/******************************************************************************
+ * print_threshold_matrix: Renders a table of the combined block rate into    *
+ *                         the output buffer pointed to by the second         *
+ *                         argument, from the joint histogram of the tally    *
+ *                         pointed to by the first argument. There is a row   *
+ *                         for each candidate inbound threshold and a column  *
+ *                         for each candidate outbound threshold, holding the *
+ *                         share of requests whose inbound score reaches the  *
+ *                         one threshold or whose outbound score reaches the  *
+ *                         other. Rows are filled in threshold order by       *
+ *                         adding each run of pairs into running column       *
+ *                         counts, whose prefix sums along the row give the   *
+ *                         requests passed at every outbound threshold, so    *
+ *                         the whole table takes one pass over the pairs      *
+ ******************************************************************************/
+void print_threshold_matrix(const struct tally *tally, struct outbuf *ob)
+{
+	static const char corner[] = "Inbound \\ Outbound";
+	struct joint_bin *pairs;
+	uint64_t *col_counts, passed;
+	size_t npairs, ncols = 0, i, j, c, lo, hi, mid;
+	int *cols, width = 9, label_width = sizeof(corner) - 1;
+
+	npairs = joint_pairs(tally->joint, &pairs);
+	if (npairs == 0) {
+		free(pairs);
+		return;
+	}
+
+	/* The distinct outbound scores, invalid first if present */
+	if ((cols = malloc(npairs * sizeof(*cols))) == NULL ||
+	    (col_counts = calloc(npairs, sizeof(*col_counts))) == NULL) {
+		perror("wafreport: malloc");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < npairs; i++) {
+		for (lo = 0, hi = ncols; lo < hi; ) {
+			mid = lo + (hi - lo) / 2;
+			if (cols[mid] < pairs[i].score_out)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (lo == ncols || cols[lo] != pairs[i].score_out) {
+			memmove(cols + lo + 1, cols + lo,
+			        (ncols - lo) * sizeof(*cols));
+			cols[lo] = pairs[i].score_out;
+			ncols++;
+		}
+	}
+	for (c = 0; c < ncols; c++)
+		if (cols[c] >= 0 && digit_width(cols[c]) > width)
+			width = digit_width(cols[c]);
+
+	out_str(ob, "\n\n\n");
+	out_str(ob, "Combined thresholds (% of requests blocked inbound or outbound)\n");
+	out_str(ob, "---------------------------------------------------------------\n");
+	out_str(ob, corner);
+	for (c = 0; c < ncols; c++)
+		if (cols[c] >= 0) {
+			out_str(ob, " | ");
+			out_uint(ob, cols[c], width);
+		}
+	out_char(ob, '\n');
+
+	for (i = 0; i < npairs; i = j) {
+		/* A row for each valid inbound score as the threshold, with
+		 * the pairs below it already added into the column counts */
+		if (pairs[i].score_in >= 0) {
+			out_uint(ob, pairs[i].score_in, label_width);
+			for (c = 0, passed = 0; c < ncols; c++) {
+				passed += col_counts[c];
+				if (cols[c] < 0)
+					continue;
+				/* The requests passed by this pair of
+				 * thresholds are those below both, counted in
+				 * the columns before this one */
+				out_str(ob, " | ");
+				out_fixed(ob, 100 - 100 *
+				          ((double) (passed - col_counts[c]) /
+				           tally->scores_read), width - 1, 4);
+				out_char(ob, '%');
+			}
+			out_char(ob, '\n');
+		}
+
+		for (j = i, c = 0;
+		     j < npairs && pairs[j].score_in == pairs[i].score_in; j++) {
+			while (cols[c] != pairs[j].score_out)
+				c++;
+			col_counts[c] += pairs[j].count;
+		}
+	}
+
+	free(pairs);
+	free(cols);
+	free(col_counts);
+}
+
+
+/******************************************************************************
+ * print_stats: Renders statistics based on the tally of scores pointed to by *
+ *              the first argument, with any extras asked for in the report   *
+ *              options pointed to by the second argument, into the output    *
+ *              buffer pointed to by the third argument                       *
+ ******************************************************************************/
+void print_stats (const struct tally *tally, const struct report_options *opts,
+                  struct outbuf *ob)
+{
+	struct score_stats in, out;
+	const struct distinct *distinct = tally->distinct;
+	const struct hll_table *din = NULL, *dout = NULL;
+	size_t i;
+
+	compute_stats(&tally->in, tally->scores_read, &in);
+	compute_stats(&tally->out, tally->scores_read, &out);
+
+	/* Without bands, the distinct clients are a column of the score
+	 * tables. With them, they get tables of their own */
+	if (distinct != NULL && distinct->nbands == 0) {
+		din = &distinct->in;
+		dout = &distinct->out;
+	}
+
+
+
+	/* Print stats on the inbound requests */
+	out_str(ob, "Inbound (Requests)\n");
+	out_str(ob, "------------------");
+	out_spaces(ob, in.score_width + in.count_width + 7);
+	out_str(ob, "# of req. | % of req. | Cumulative | Outstanding");
+	out_str(ob, din != NULL ? " | Distinct clients\n" : "\n");
+	out_spaces(ob, in.score_width + 7);
+	out_str(ob, "Total number of requests | ");
+	out_uint(ob, in.scores_read, 0);
+	out_str(ob, " | 100.0000% | 100.0000%  |   0.0000%");
+	if (din != NULL) {
+		out_str(ob, "   | ");
+		out_uint(ob, hll_estimate(distinct->all), 16);
+	}
+	out_str(ob, "\n\n");
+
+	out_str(ob, "Empty or invalid inbound score ");
+	out_spaces(ob, in.score_width + 1);
+	print_row_counts(ob, in.invalid, in.count_width, in.invalid,
+			 in.scores_read,
+			 din != NULL ? (int64_t) distinct_estimate(din, -1) : -1);
+
+	/* Print out the populated inbound scores */
+	for (i = 0; i < in.nrows; i++) {
+		out_str(ob, "Requests with inbound score of ");
+		out_uint(ob, in.rows[i].score, in.score_width);
+		out_char(ob, ' ');
+		print_row_counts(ob, in.rows[i].count, in.count_width,
+				 in.invalid + in.rows[i].cumulative,
+				 in.scores_read,
+				 din != NULL ? (int64_t) distinct_estimate(din,
+				 in.rows[i].score) : -1);
+	}
+	out_char(ob, '\n');
+
+	/* Print averages */
+	out_str(ob, "Mean: ");
+	out_fixed(ob, in.mean, 0, 2);
+	out_str(ob, "    Median: ");
+	if (in.median_known)
+		out_fixed(ob, in.median, 0, 2);
+	else
+		out_char(ob, '-');
+	out_char(ob, '\n');
+	print_percentiles(&in, opts, ob);
+	if (distinct != NULL && din == NULL)
+		print_distinct_bands(ob, "Distinct clients by inbound score band",
+		                     "# of req.", &in, distinct, &distinct->in);
+	if (tally->top != NULL)
+		print_top(tally->top, ob);
+
+	out_str(ob, "\n\n\n");
+
+
+
+	/* Print stats on the outbound responses */
+	out_str(ob, "Outbound (Responses)\n");
+	out_str(ob, "--------------------");
+	out_spaces(ob, out.score_width + out.count_width + 6);
+	out_str(ob, "# of res. | % of res. | Cumulative | Outstanding");
+	out_str(ob, dout != NULL ? " | Distinct clients\n" : "\n");
+	out_spaces(ob, out.score_width + 7);
+	out_str(ob, "Total number of responses | ");
+	out_uint(ob, out.scores_read, 0);
+	out_str(ob, " | 100.0000% | 100.0000%  |   0.0000%");
+	if (dout != NULL) {
+		out_str(ob, "   | ");
+		out_uint(ob, hll_estimate(distinct->all), 16);
+	}
+	out_str(ob, "\n\n");
+
+	out_str(ob, "Empty or invalid outbound score ");
+	out_spaces(ob, out.score_width + 1);
+	print_row_counts(ob, out.invalid, out.count_width, out.invalid,
+			 out.scores_read,
+			 dout != NULL ? (int64_t) distinct_estimate(dout, -1) : -1);
+
+	/* Print out the populated outbound scores */
+	for (i = 0; i < out.nrows; i++) {
+		out_str(ob, "Responses with inbound score of ");
+		out_uint(ob, out.rows[i].score, out.score_width);
+		out_char(ob, ' ');
+		print_row_counts(ob, out.rows[i].count, out.count_width,
+				 out.invalid + out.rows[i].cumulative,
+				 out.scores_read,
+				 dout != NULL ? (int64_t) distinct_estimate(dout,
+				 out.rows[i].score) : -1);
+	}
+	out_char(ob, '\n');
+
+	/* Print averages */
+	out_str(ob, "Mean: ");
+	out_fixed(ob, out.mean, 0, 2);
+	out_str(ob, "    Median: ");
+	if (out.median_known)
+		out_fixed(ob, out.median, 0, 2);
+	else
+		out_char(ob, '-');
+	out_char(ob, '\n');
+	print_percentiles(&out, opts, ob);
+	if (distinct != NULL && dout == NULL)
+		print_distinct_bands(ob, "Distinct clients by outbound score band",
+		                     "# of res.", &out, distinct, &distinct->out);
+
+	free_stats(&in);
+	free_stats(&out);
+}
+
+
+/******************************************************************************
+ * print_row_counts: Renders the columns of a table row, from the count given *
+ *                   by the second argument (right-aligned to the width given *
+ *                   by the third argument) onwards, into the output buffer   *
+ *                   pointed to by the first argument. The percentage         *
+ *                   columns are worked out from the running total given by   *
+ *                   the fourth argument and the number of score lines read.  *
+ *                   The last argument, unless negative, fills a final column *
+ *                   of distinct clients                                      *
+ ******************************************************************************/
+void print_row_counts(struct outbuf *ob, uint64_t count, int count_width,
+                      uint64_t running_total, uint64_t scores_read,
+                      int64_t distinct)
+{
+	double cumulative = 100 * ((double) running_total / scores_read);
+
+	out_str(ob, "| ");
+	out_uint(ob, count, count_width);
+	out_str(ob, " | ");
+	out_fixed(ob, 100 * ((double) count / scores_read), 8, 4);
+	out_str(ob, "% | ");
+	out_fixed(ob, cumulative, 8, 4);
+	out_str(ob, "%  | ");
+	out_fixed(ob, 100 - cumulative, 8, 4);
+	out_char(ob, '%');
+	if (distinct >= 0) {
+		out_str(ob, "   | ");
+		out_uint(ob, distinct, 16);
+	}
+	out_char(ob, '\n');
+}
+
+
+/******************************************************************************
+ * print_percentiles: Renders a line with the percentiles listed in the       *
+ *                    report options pointed to by the second argument, taken *
+ *                    from the statistics pointed to by the first argument,   *
+ *                    into the output buffer pointed to by the third          *
+ *                    argument, or nothing if no percentiles were asked for.  *
+ *                    A percentile is printed as "-" when there are no valid  *
+ *                    scores                                                  *
+ ******************************************************************************/
+void print_percentiles(const struct score_stats *stats,
+                       const struct report_options *opts, struct outbuf *ob)
+{
+	unsigned long ppm, frac;
+	int i, score, places;
+
+	for (i = 0; i < opts->npercentiles; i++) {
+		ppm = opts->percentiles[i];
+
+		/* Label: the percentile as given, minus trailing zeros */
+		out_str(ob, i ? "    p" : "p");
+		out_uint(ob, ppm / 10000, 0);
+		if ((frac = ppm % 10000) != 0) {
+			for (places = 4; frac % 10 == 0; places--)
+				frac /= 10;
+			out_char(ob, '.');
+			out_zeros(ob, places - digit_width(frac));
+			out_uint(ob, frac, 0);
+		}
+
+		out_str(ob, ": ");
+		if ((score = stats_percentile(stats, ppm)) < 0)
+			out_char(ob, '-');
+		else
+			out_uint(ob, score, 0);
+	}
+
+	if (opts->npercentiles > 0)
+		out_char(ob, '\n');
+}
+
+
+/******************************************************************************
+ * compute_stats: Takes the histogram pointed to by the first argument and    *
+ *                the number of score lines read, and from those computes the *
+ *                populated rows with their cumulative counts, the mean and   *
+ *                median scores, and the digit widths needed to print them,   *
+ *                storing the results in the structure pointed to by the      *
+ *                third argument. Everything is done in a single pass over    *
+ *                the populated scores of the histogram. The rows must be     *
+ *                released with free_stats()                                  *
+ ******************************************************************************/
+void compute_stats(const struct histogram *hist, uint64_t scores_read,
+                   struct score_stats *stats)
+{
+	struct histogram_iter iter;
+	uint64_t seen = 0, count, lower_target, upper_target;
+	int i, lower_value = -1, upper_value = -1;
+	size_t max_rows;
+	double sum = 0.0;
+
+	profile_start(PROFILE_STATS);
+	stats->scores_read = scores_read;
+	stats->invalid = hist->invalid;
+	stats->nrows = 0;
+	stats->rows = NULL;
+
+	/* At most every slot of the populated dense range, plus the tail */
+	max_rows = hist->nsparse;
+	if (hist->min < hist->dense_len)
+		max_rows += (hist->max < hist->dense_len ?
+			     hist->max : hist->dense_len - 1) - hist->min + 1;
+	if (max_rows > 0 &&
+	    (stats->rows = malloc(max_rows * sizeof(*stats->rows))) == NULL) {
+		perror("wafreport: malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	/* The median is the value of the middle score for an odd number of
+	 * scores, else the average of the two middle scores. Like the table,
+	 * it's taken relative to every line read, invalid scores included */
+	if (scores_read % 2) {
+		lower_target = upper_target = scores_read / 2 + 1;
+	} else {
+		lower_target = scores_read / 2;
+		upper_target = scores_read / 2 + 1;
+	}
+	if (lower_target == 0)
+		lower_value = 0;
+
+	histogram_iter_init(&iter, hist);
+	while (histogram_next(&iter, &i, &count)) {
+		seen += count;
+		sum += (double) i * count;
+
+		stats->rows[stats->nrows].score = i;
+		stats->rows[stats->nrows].count = count;
+		stats->rows[stats->nrows].cumulative = seen;
+		stats->nrows++;
+
+		if (lower_value < 0 && seen >= lower_target)
+			lower_value = i;
+		if (upper_value < 0 && seen >= upper_target)
+			upper_value = i;
+	}
+
+	/* Invalid scores can make up so much of the input that the middle is
+	 * never reached, leaving no median (printed as "-") */
+	stats->mean = sum / scores_read;
+	stats->median_known = lower_value >= 0 && upper_value >= 0;
+	stats->median = stats->median_known ?
+	                ((double) lower_value + upper_value) / 2 : 0.0;
+
+	/* How many digits in the largest score and the number of records? */
+	stats->score_width = digit_width(stats->nrows ? hist->max : 0);
+	stats->count_width = digit_width(scores_read);
+	profile_stop(PROFILE_STATS);
+}
+
+
+/******************************************************************************
+ * stats_percentile: Answers a percentile query, with the percentile given in *
+ *                   parts per million by the second argument, from the       *
+ *                   cumulative counts of the statistics pointed to by the    *
+ *                   first argument. These form a prefix-sum index over the   *
+ *                   populated scores, so the nearest-rank percentile of the  *
+ *                   valid scores is found with a binary search. Returns the  *
+ *                   score, or -1 if there are no valid scores                *
+ ******************************************************************************/
+int stats_percentile(const struct score_stats *stats, unsigned long ppm)
+{
+	uint64_t valid, rank;
+	size_t lo, hi, mid;
+
+	if (stats->nrows == 0)
+		return -1;
+	valid = stats->rows[stats->nrows - 1].cumulative;
+
+	/* rank = ceil(valid * ppm / 1e6), split up so as not to overflow */
+	rank = valid / 1000000 * ppm +
+	       (valid % 1000000 * ppm + 999999) / 1000000;
+	if (rank == 0)
+		rank = 1;
+
+	/* Find the first row whose cumulative count reaches the rank */
+	for (lo = 0, hi = stats->nrows - 1; lo < hi; ) {
+		mid = lo + (hi - lo) / 2;
+		if (stats->rows[mid].cumulative >= rank)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return stats->rows[lo].score;
+}
+
+
+/******************************************************************************
+ * free_stats: Releases the rows held by the statistics pointed to by the     *
+ *             argument                                                       *
+ ******************************************************************************/
+void free_stats(struct score_stats *stats)
+{
+	free(stats->rows);
+	stats->rows = NULL;
+	stats->nrows = 0;
+}
+
+
+/******************************************************************************
+ * digit_width: Helper function which returns the number of digits required   *
+ *              to display a given count, as an int value                     *
+ ******************************************************************************/
+int digit_width(uint64_t n)
+{
+	int width = 1;
+
+	while (n > 9) {
+		n /= 10;
+		width++;
+	}
 
 	return width;
 }
+
+
+/******************************************************************************
+ * outbuf_init: Sets up the output buffer pointed to by the first argument to *
+ *              collect text for the file descriptor given by the second      *
+ *              argument                                                      *
+ ******************************************************************************/
+void outbuf_init(struct outbuf *ob, int fd)
+{
+	ob->buf = NULL;
+	ob->len = ob->size = 0;
+	ob->fd = fd;
+}
+
+
+/******************************************************************************
+ * outbuf_flush: Writes everything collected in the output buffer pointed to  *
+ *               by the argument with as few write(2) calls as the kernel     *
+ *               allows (normally one), then empties the buffer, keeping its  *
+ *               memory for reuse. Exits on a write error                     *
+ ******************************************************************************/
+void outbuf_flush(struct outbuf *ob)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < ob->len) {
+		n = write(ob->fd, ob->buf + done, ob->len - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			perror("wafreport: write");
+			exit(EXIT_FAILURE);
+		}
+		done += n;
+	}
+
+	ob->len = 0;
+}
+
+
+/******************************************************************************
+ * outbuf_free: Releases the memory held by the output buffer pointed to by   *
+ *              the argument, discarding anything not yet flushed             *
+ ******************************************************************************/
+void outbuf_free(struct outbuf *ob)
+{
+	free(ob->buf);
+	outbuf_init(ob, ob->fd);
+}
+
+
+/******************************************************************************
+ * outbuf_reserve: Makes sure that the output buffer pointed to by the first  *
+ *                 argument has room for at least the number of bytes given   *
+ *                 by the second argument, and returns a pointer to where     *
+ *                 they go                                                    *
+ ******************************************************************************/
+char *outbuf_reserve(struct outbuf *ob, size_t n)
+{
+	if (ob->size - ob->len < n) {
+		for (ob->size = ob->size ? ob->size : OUTBUF_SIZE;
+		     ob->size - ob->len < n; ob->size *= 2)
+			;
+		if ((ob->buf = realloc(ob->buf, ob->size)) == NULL) {
+			perror("wafreport: realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	return ob->buf + ob->len;
+}
+
+
+/******************************************************************************
+ * out_str: Appends the string given by the second argument to the output     *
+ *          buffer pointed to by the first argument                           *
+ ******************************************************************************/
+void out_str(struct outbuf *ob, const char *s)
+{
+	size_t n = strlen(s);
+
+	memcpy(outbuf_reserve(ob, n), s, n);
+	ob->len += n;
+}
+
+
+/******************************************************************************
+ * out_char: Appends the character given by the second argument to the output *
+ *           buffer pointed to by the first argument                          *
+ ******************************************************************************/
+void out_char(struct outbuf *ob, char c)
+{
+	*outbuf_reserve(ob, 1) = c;
+	ob->len++;
+}
+
+
+/******************************************************************************
+ * out_title: Appends the title given by the second argument to the output    *
+ *            buffer pointed to by the first argument, underlined with '='    *
+ *            and followed by a blank line                                    *
+ ******************************************************************************/
+void out_title(struct outbuf *ob, const char *title)
+{
+	size_t len = strlen(title);
+
+	out_str(ob, title);
+	out_char(ob, '\n');
+	memset(outbuf_reserve(ob, len), '=', len);
+	ob->len += len;
+	out_str(ob, "\n\n");
+}
+
+
+/******************************************************************************
+ * out_spaces: Appends the number of spaces given by the second argument to   *
+ *             the output buffer pointed to by the first argument, but always *
+ *             at least one (as printf("%*s", n, " ") would)                  *
+ ******************************************************************************/
+void out_spaces(struct outbuf *ob, int n)
+{
+	if (n < 1)
+		n = 1;
+
+	memset(outbuf_reserve(ob, n), ' ', n);
+	ob->len += n;
+}
+
+
+/******************************************************************************
+ * out_zeros: Appends the number of '0' characters given by the second        *
+ *            argument (if positive) to the output buffer pointed to by the   *
+ *            first argument                                                  *
+ ******************************************************************************/
+void out_zeros(struct outbuf *ob, int n)
+{
+	if (n <= 0)
+		return;
+
+	memset(outbuf_reserve(ob, n), '0', n);
+	ob->len += n;
+}
+
+
+/******************************************************************************
+ * out_uint: Appends the number given by the second argument, right-aligned   *
+ *           in a field of the width given by the third argument, to the      *
+ *           output buffer pointed to by the first argument, as printf("%*"   *
+ *           PRIu64) would                                                    *
+ ******************************************************************************/
+void out_uint(struct outbuf *ob, uint64_t n, int width)
+{
+	char digits[20], *p = digits + sizeof(digits), *dest;
+	int len;
+
+	do {
+		*--p = '0' + n % 10;
+		n /= 10;
+	} while (n > 0);
+	len = digits + sizeof(digits) - p;
+
+	dest = outbuf_reserve(ob, width > len ? width : len);
+	if (width > len) {
+		memset(dest, ' ', width - len);
+		dest += width - len;
+		ob->len += width - len;
+	}
+	memcpy(dest, p, len);
+	ob->len += len;
+}
+
+
+/******************************************************************************
+ * out_varint: Appends the number given by the second argument to the output  *
+ *             buffer pointed to by the first argument as an unsigned LEB128  *
+ *             varint: seven bits per byte, least significant first, with the *
+ *             top bit set on every byte but the last                         *
+ ******************************************************************************/
+void out_varint(struct outbuf *ob, uint64_t n)
+{
+	while (n > 0x7f) {
+		out_char(ob, (char) ((n & 0x7f) | 0x80));
+		n >>= 7;
+	}
+	out_char(ob, (char) n);
+}
+
+
+/******************************************************************************
+ * out_fixed: Appends the value given by the second argument with the number  *
+ *            of decimal places given by the fourth argument (at most 4),     *
+ *            right-aligned in a field of the width given by the third        *
+ *            argument, to the output buffer pointed to by the first          *
+ *            argument. The result is exactly what printf("%*.*f") gives:     *
+ *            the double is taken apart into an integer mantissa and a power  *
+ *            of two, so it can be scaled and rounded (half to even) with     *
+ *            integer arithmetic and no loss of precision. Values outside the *
+ *            range this handles, and NaNs and infinities, go to snprintf()   *
+ ******************************************************************************/
+void out_fixed(struct outbuf *ob, double value, int width, int places)
+{
+	static const uint64_t pow5[] = { 1, 5, 25, 125, 625 };
+	uint64_t mant, q, rem, half;
+	char text[64];
+	int exp, shift, negative, len, i;
+
+	if (!isfinite(value) || places < 0 || places > 4 ||
+	    fabs(value) >= 1e14) {
+		len = snprintf(text, sizeof(text), "%*.*f", width, places,
+			       value);
+		memcpy(outbuf_reserve(ob, len), text, len);
+		ob->len += len;
+		return;
+	}
+
+	negative = signbit(value) != 0;
+
+	/* |value| = mant * 2^exp exactly, with mant a 53-bit integer, so
+	 * |value| * 10^places = mant * 5^places * 2^(exp + places), where the
+	 * product of mant and 5^places still fits in 64 bits */
+	mant = (uint64_t) ldexp(frexp(fabs(value), &exp), 53);
+	mant *= pow5[places];
+	shift = exp - 53 + places;
+
+	if (shift >= 0) {
+		/* Already a whole number once scaled, and small enough (as
+		 * |value| < 1e14) not to overflow when shifted */
+		q = mant << shift;
+	} else if (shift <= -64) {
+		q = 0;
+	} else {
+		shift = -shift;
+		q = mant >> shift;
+		rem = mant & ((UINT64_C(1) << shift) - 1);
+		half = UINT64_C(1) << (shift - 1);
+		if (rem > half || (rem == half && (q & 1)))
+			q++;
+	}
+
+	/* Render right to left: decimals, point, whole part, sign */
+	len = sizeof(text);
+	if (places > 0) {
+		for (i = 0; i < places; i++) {
+			text[--len] = '0' + q % 10;
+			q /= 10;
+		}
+		text[--len] = '.';
+	}
+	do {
+		text[--len] = '0' + q % 10;
+		q /= 10;
+	} while (q > 0);
+	if (negative)
+		text[--len] = '-';
+
+	len = sizeof(text) - len;
+	if (width > len)
+		out_spaces(ob, width - len);
+	memcpy(outbuf_reserve(ob, len), text + sizeof(text) - len, len);
+	ob->len += len;
+}